@@ -0,0 +1,181 @@
+#!/bin/sh
+# Erzeugt einen synthetischen /proc- und /sys-Baum für coreusage --sysroot
+# Aufruf: mkfixture.sh <verzeichnis> <cpus> [sockets]
+# Enthalten sind /proc/stat, /proc/interrupts, /proc/softirqs, /proc/schedstat,
+# /proc/pressure/cpu, /proc/cpuinfo, die CPU-Liste, Frequenzen, Topologie (zwei Threads
+# pro Kern), vier cpuidle-Zustände pro CPU und ein NUMA-Knoten pro Socket.
+
+set -e
+
+if [ $# -lt 2 ] || [ "$2" -lt 1 ] 2>/dev/null; then
+    echo "Usage: $0 <dir> <cpus> [sockets]" >&2
+    exit 1
+fi
+
+root=$1
+cpus=$2
+sockets=${3:-1}
+if [ "$cpus" -ge 64 ] && [ $# -lt 3 ]; then
+    sockets=2
+fi
+
+rm -rf "$root"
+mkdir -p "$root/proc/pressure"
+
+# Verzeichnisse in einem Rutsch anlegen
+awk -v root="$root" -v cpus="$cpus" -v sockets="$sockets" 'BEGIN {
+    for (c = 0; c < cpus; c++) {
+        print root "/sys/devices/system/cpu/cpu" c "/cpufreq"
+        print root "/sys/devices/system/cpu/cpu" c "/topology"
+        for (k = 0; k < 4; k++)
+            print root "/sys/devices/system/cpu/cpu" c "/cpuidle/state" k
+    }
+    for (s = 0; s < sockets; s++)
+        print root "/sys/devices/system/node/node" s
+}' | xargs mkdir -p
+
+awk -v root="$root" -v cpus="$cpus" -v sockets="$sockets" '
+function cpulist(first, count, step,    s, i) {
+    s = ""
+    for (i = 0; i < count; i++)
+        s = s (i ? "," : "") (first + i * step)
+    return s
+}
+BEGIN {
+    # Ohne SMT bei nur einer CPU
+    threads = cpus >= 2 && cpus % 2 == 0 ? 2 : 1
+    cores = cpus / threads
+    per_socket = int((cores + sockets - 1) / sockets)
+    sys = root "/sys/devices/system"
+    split("POLL C1 C1E C6", idle, " ")
+
+    stat = root "/proc/stat"
+    printf "cpu  %.0f %.0f %.0f %.0f %.0f %.0f %.0f 0 0 0\n", cpus * 100000, cpus * 500, cpus * 40000, cpus * 900000, cpus * 2000, cpus * 300, cpus * 700 > stat
+    for (c = 0; c < cpus; c++) {
+        printf "cpu%d %d %d %d %d %d %d %d %d %d %d\n", c,
+            100000 + c * 13 % 5000, 500 + c % 50, 40000 + c * 7 % 3000, 900000 + c * 29 % 20000,
+            2000 + c % 100, 300 + c % 10, 700 + c % 30, 0, 0, 0 > stat
+    }
+    line = "intr 123456789"
+    for (i = 0; i < 512; i++)
+        line = line " " (i % 7 ? 0 : i * 1000)
+    print line > stat
+    print "ctxt 987654321" > stat
+    print "btime 1760000000" > stat
+    print "processes 123456" > stat
+    print "procs_running 3" > stat
+    print "procs_blocked 0" > stat
+    print "softirq 5000000 10 2000000 300 400000 50000 0 60000 1500000 2000 900000" > stat
+    close(stat)
+
+    # Bis zu 64 Queues einer Netzwerkkarte plus die benannten Zeilen des Kernels
+    irqs = root "/proc/interrupts"
+    queues = cpus < 64 ? cpus : 64
+    line = "     "
+    for (c = 0; c < cpus; c++)
+        line = line sprintf(" %10s", "CPU" c)
+    print line > irqs
+    for (q = 0; q < queues + 2; q++) {
+        line = sprintf("%4d:", 24 + q)
+        for (c = 0; c < cpus; c++)
+            line = line sprintf(" %10d", q < queues && c % queues == q ? 100000 + c * 17 % 9000 : c % 5)
+        if (q < queues)
+            line = line "  IR-PCI-MSI 524288" q "-edge      eth0-TxRx-" q
+        else
+            line = line "  IR-PCI-MSI 327680-edge      nvme0q" (q - queues)
+        print line > irqs
+    }
+    split("NMI LOC RES CAL TLB", named, " ")
+    split("Non-maskable interrupts|Local timer interrupts|Rescheduling interrupts|Function call interrupts|TLB shootdowns", descs, "|")
+    for (k = 1; k <= 5; k++) {
+        line = sprintf("%4s:", named[k])
+        for (c = 0; c < cpus; c++)
+            line = line sprintf(" %10d", (6 - k) * 20000 + c * 31 % 1000)
+        print line "   " descs[k] > irqs
+    }
+    print " ERR:          0" > irqs
+    print " MIS:          0" > irqs
+    close(irqs)
+
+    softirqs = root "/proc/softirqs"
+    line = "         "
+    for (c = 0; c < cpus; c++)
+        line = line sprintf(" %10s", "CPU" c)
+    print line > softirqs
+    n = split("HI TIMER NET_TX NET_RX BLOCK IRQ_POLL TASKLET SCHED HRTIMER RCU", types, " ")
+    for (k = 1; k <= n; k++) {
+        line = sprintf("%9s:", types[k])
+        for (c = 0; c < cpus; c++)
+            line = line sprintf(" %10d", k * 3000 + c * 7 % 500)
+        print line > softirqs
+    }
+    close(softirqs)
+
+    # Zwei Scheduling-Domänen je CPU, wie auf einem Rechner mit SMT und mehreren Kernen
+    sched = root "/proc/schedstat"
+    print "version 15" > sched
+    print "timestamp 4295000000" > sched
+    for (c = 0; c < cpus; c++) {
+        printf "cpu%d 0 0 %d %d %d %d %.0f %.0f %d\n", c, 900000 + c, 400000 + c, 500000 + c, 300000 + c,
+            1000000000000 + c * 7919, 20000000000 + c * 104729, 800000 + c * 13 > sched
+        for (d = 0; d < 2; d++) {
+            line = "domain" d " ff,ffffffff"
+            for (i = 0; i < 45; i++)
+                line = line " " (i * c % 97)
+            print line > sched
+        }
+    }
+    close(sched)
+
+    psi = root "/proc/pressure/cpu"
+    print "some avg10=1.23 avg60=0.98 avg300=0.75 total=123456789" > psi
+    print "full avg10=0.00 avg60=0.00 avg300=0.00 total=0" > psi
+    close(psi)
+
+    info = root "/proc/cpuinfo"
+    for (c = 0; c < cpus; c++)
+        printf "processor\t: %d\nvendor_id\t: GenuineIntel\ncpu MHz\t\t: %.3f\n\n", c, 800 + c * 37 % 3000 > info
+    close(info)
+
+    f = sys "/cpu/possible"
+    print "0-" (cpus - 1) > f
+    close(f)
+    for (c = 0; c < cpus; c++) {
+        core = c % cores
+        dir = sys "/cpu/cpu" c
+        f = dir "/cpufreq/scaling_cur_freq"
+        print (800 + c * 37 % 3000) * 1000 > f
+        close(f)
+        f = dir "/topology/physical_package_id"
+        print int(core / per_socket) > f
+        close(f)
+        f = dir "/topology/core_id"
+        print core % per_socket > f
+        close(f)
+        f = dir "/topology/thread_siblings_list"
+        print cpulist(core, threads, cores) > f
+        close(f)
+        # Zeit in µs und Anzahl der Eintritte, tiefere Zustände seltener, aber länger
+        for (k = 0; k < 4; k++) {
+            f = dir "/cpuidle/state" k "/name"
+            print idle[k + 1] > f
+            close(f)
+            f = dir "/cpuidle/state" k "/time"
+            printf "%.0f\n", (k + 1) * (k + 1) * 1000000000 + c * 7919 > f
+            close(f)
+            f = dir "/cpuidle/state" k "/usage"
+            print (4 - k) * 250000 + c * 13 > f
+            close(f)
+        }
+    }
+    for (s = 0; s < sockets; s++) {
+        f = sys "/node/node" s "/cpulist"
+        first = s * per_socket
+        count = first + per_socket > cores ? cores - first : per_socket
+        line = ""
+        for (t = 0; t < threads; t++)
+            line = line (t ? "," : "") (first + t * cores) "-" (first + t * cores + count - 1)
+        print line > f
+        close(f)
+    }
+}'
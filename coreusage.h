@@ -0,0 +1,167 @@
+/*
+ * coreusage.h - Sampling engine of coreusage as a library (libcoreusage)
+ *
+ * Reads the per-CPU counters of /proc/stat, the current frequency of every CPU and any
+ * number of temperature inputs, and computes the usage between two samples:
+ *
+ *     struct coreusage *cu = coreusage_open(NULL);
+ *     int n = coreusage_max_cpus(cu);
+ *     struct coreusage_snapshot a, b;
+ *     coreusage_snapshot_init(&a, malloc(coreusage_snapshot_size(n)), n);
+ *     coreusage_snapshot_init(&b, malloc(coreusage_snapshot_size(n)), n);
+ *     float *usage = malloc(n * sizeof(float));
+ *     coreusage_read(cu, &(struct coreusage_read){.snap = &a});
+ *     sleep(1);
+ *     coreusage_read(cu, &(struct coreusage_read){.snap = &b});
+ *     coreusage_delta(&a, &b, n, usage, NULL);
+ *     coreusage_close(cu);
+ *
+ * A sampler keeps its files open and reads them as one batch per coreusage_read(), through
+ * io_uring where that is faster than one pread() per file. coreusage_open() allocates all
+ * it needs; reading and computing deltas allocate nothing and never write to stdio, and
+ * all results go into storage the caller provides. Samplers share no state, so every
+ * thread can have its own; a single sampler must not be used by two threads at a time.
+ *
+ * Functions that can fail return a negative errno value, or NULL with errno set.
+ * Structures the caller fills in are only ever extended at the end and must be
+ * zero-initialized; COREUSAGE_API_VERSION changes when existing fields change meaning.
+ */
+
+#ifndef COREUSAGE_H
+#define COREUSAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define COREUSAGE_API_VERSION 1
+#define COREUSAGE_MAX_TEMPS 128 // Temperature inputs per sampler
+
+// The /proc/stat fields of every CPU, in the order of the file
+enum
+{
+    COREUSAGE_USER,
+    COREUSAGE_NICE,
+    COREUSAGE_SYSTEM,
+    COREUSAGE_IDLE,
+    COREUSAGE_IOWAIT,
+    COREUSAGE_IRQ,
+    COREUSAGE_SOFTIRQ,
+    COREUSAGE_STEAL,
+    COREUSAGE_GUEST,      // Also counted in user
+    COREUSAGE_GUEST_NICE, // Also counted in nice
+    COREUSAGE_FIELDS
+};
+
+// Values of coreusage_config.io: how the files of a read are read
+enum
+{
+    COREUSAGE_IO_AUTO,  // io_uring if available and faster here, which coreusage_open() measures
+    COREUSAGE_IO_URING, // io_uring; coreusage_open() fails with ENOSYS without it
+    COREUSAGE_IO_SYNC   // One pread() per file
+};
+
+// Values of coreusage_config.flags
+#define COREUSAGE_NO_FREQ 1u // Do not open the frequency files, e.g. for a sampler of /proc/stat only
+
+// Values of coreusage_freq_source() (the same as COREUSAGE_SHM_FREQ_* of coreusage_shm.h)
+enum
+{
+    COREUSAGE_FREQ_NONE = 0,
+    COREUSAGE_FREQ_CPUFREQ = 1, // cpufreq/scaling_cur_freq of every CPU
+    COREUSAGE_FREQ_CPUINFO = 2  // The "cpu MHz" lines of /proc/cpuinfo, e.g. in VMs without cpufreq
+};
+
+// Options of coreusage_open(); NULL means all defaults
+struct coreusage_config
+{
+    const char *sysroot; // Read /proc and /sys below this directory instead of /, if set
+    int io;              // COREUSAGE_IO_*
+    unsigned flags;      // COREUSAGE_NO_FREQ
+};
+
+// One sample of the /proc/stat counters, indexed by CPU id (0 .. max_cpus - 1)
+// All arrays are carved out of one block of coreusage_snapshot_size() bytes: the counter
+// arrays one after the other, then the online flags. The block can be copied as a whole.
+struct coreusage_snapshot
+{
+    uint64_t *field[COREUSAGE_FIELDS]; // Cumulative ticks in USER_HZ of every field
+    uint8_t *online;                   // 1 if the CPU had a line in /proc/stat
+};
+
+// What coreusage_read() takes and where it puts it; every part whose pointer is NULL is skipped
+struct coreusage_read
+{
+    struct coreusage_snapshot *snap; // Receives the counters of /proc/stat
+    int *cpu_ids;                    // [max_cpus] Receives the ids of the CPUs in snap, ascending
+    int num_online;                  // Out: number of CPUs in snap
+    const uint8_t *online;           // CPUs online now, to follow CPU hotplug without snap
+    uint32_t *freq_khz;              // [max_cpus] Receives the frequencies in kHz, 0 if unknown
+    double *temp;                    // [inputs added] Receives the temperatures in °C, NAN if a read failed
+    int temp_errors;                 // Out: temperature inputs whose read failed
+};
+
+// Counters of a sampler, for benchmarks
+struct coreusage_stats
+{
+    uint64_t reads;    // Files read so far
+    uint64_t syscalls; // System calls issued for them
+    int io;            // COREUSAGE_IO_URING or COREUSAGE_IO_SYNC: the path in use
+};
+
+struct coreusage;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Returns COREUSAGE_API_VERSION of the library, which may be newer than the header
+int coreusage_version(void);
+
+// Opens a sampler: /proc/stat and, unless COREUSAGE_NO_FREQ, the frequency files of every
+// online CPU. Returns NULL with errno set if /proc/stat (or the sysroot) cannot be read,
+// ENOSYS for COREUSAGE_IO_URING without io_uring, EINVAL for an unknown io mode.
+struct coreusage *coreusage_open(const struct coreusage_config *config);
+
+// Closes every file of the sampler and releases it
+void coreusage_close(struct coreusage *cu);
+
+// Number of possible CPU ids: the highest id in /sys/devices/system/cpu/possible + 1
+int coreusage_max_cpus(const struct coreusage *cu);
+
+// COREUSAGE_FREQ_* the frequencies come from
+int coreusage_freq_source(const struct coreusage *cu);
+
+// Opens a temperature input such as /sys/class/hwmon/hwmon2/temp1_input (in m°C, not below
+// the sysroot). Returns the index of its value in coreusage_read.temp, or a negative errno.
+int coreusage_add_temp(struct coreusage *cu, const char *path);
+
+// Closes all temperature inputs; indices start over at 0
+void coreusage_clear_temps(struct coreusage *cu);
+
+// Reads the parts requested in r as one batch. Frequency and temperature files that fail are
+// reported as unknown, and the frequency file of a CPU is reopened when it comes back online.
+// Returns 0, or a negative errno if /proc/stat could not be read.
+int coreusage_read(struct coreusage *cu, struct coreusage_read *r);
+
+// Size of the storage of one snapshot for max_cpus CPUs, in bytes
+size_t coreusage_snapshot_size(int max_cpus);
+
+// Points the arrays of snap into mem (coreusage_snapshot_size() bytes, aligned for uint64_t)
+// and zeroes it
+void coreusage_snapshot_init(struct coreusage_snapshot *snap, void *mem, int max_cpus);
+
+// Computes the usage (user + nice + system) of every CPU between two snapshots in percent of
+// the elapsed time, and if field_pct is not NULL the share of every field (entries may be
+// NULL). CPUs that were not online in both get 0. The elapsed time is the sum of the fields
+// up to steal, so iowait going backwards counts as zero.
+void coreusage_delta(const struct coreusage_snapshot *prev, const struct coreusage_snapshot *cur, int max_cpus,
+                     float usage[], float *const field_pct[COREUSAGE_FIELDS]);
+
+// Copies the counters of the sampler into st
+void coreusage_get_stats(const struct coreusage *cu, struct coreusage_stats *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * coreusage_shm.h - Layout of the shared-memory segment published by "coreusage --daemon"
+ *
+ * The daemon samples /proc/stat once per interval and publishes the result in the
+ * POSIX shared-memory object COREUSAGE_SHM_NAME (or the name given to --daemon=).
+ * Any number of readers can map it read-only and copy the latest sample without
+ * system calls or locks:
+ *
+ *     int fd = shm_open(COREUSAGE_SHM_NAME, O_RDONLY, 0);
+ *     struct stat st;
+ *     fstat(fd, &st);
+ *     const struct coreusage_shm_header *h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+ *     // Check magic, version and that header_size + max_cpus * cpu_size fits into st.st_size
+ *     uint64_t seq;
+ *     do
+ *     {
+ *         seq = coreusage_shm_read_begin(h);
+ *         // Copy what is needed from h and coreusage_shm_cpus(h)
+ *     } while (coreusage_shm_read_retry(h, seq));
+ *
+ * The segment is a seqlock: seq is odd while the daemon writes and advances by two
+ * per sample. A copy is consistent if seq was even and unchanged around it.
+ * All values are in host byte order. Fields are only ever appended; readers must use
+ * header_size and cpu_size as strides, and the version changes when existing fields
+ * change their meaning.
+ */
+
+#ifndef COREUSAGE_SHM_H
+#define COREUSAGE_SHM_H
+
+#include <stdint.h>
+
+#define COREUSAGE_SHM_NAME "/coreusage"
+#define COREUSAGE_SHM_MAGIC 0x4d535543u // "CUSM" in little-endian byte order
+#define COREUSAGE_SHM_VERSION 1
+#define COREUSAGE_SHM_FIELDS 10 // user, nice, system, idle, iowait, irq, softirq, steal, guest, guest_nice
+#define COREUSAGE_SHM_TEMP_UNKNOWN INT16_MIN
+
+// Values of coreusage_shm_header.state
+enum
+{
+    COREUSAGE_SHM_STOPPED = 0, // The daemon has exited; the data is the last sample it took
+    COREUSAGE_SHM_RUNNING = 1
+};
+
+// Values of coreusage_shm_header.freq_source
+enum
+{
+    COREUSAGE_SHM_FREQ_NONE = 0, // No frequencies available, freq_khz is 0
+    COREUSAGE_SHM_FREQ_CPUFREQ = 1,
+    COREUSAGE_SHM_FREQ_CPUINFO = 2
+};
+
+// At offset 0 of the segment (128 bytes)
+struct coreusage_shm_header
+{
+    uint32_t magic;        // COREUSAGE_SHM_MAGIC
+    uint32_t version;      // COREUSAGE_SHM_VERSION
+    uint32_t header_size;  // Offset of the first CPU entry
+    uint32_t cpu_size;     // Size of one CPU entry
+    uint32_t max_cpus;     // Number of CPU entries: highest possible CPU id + 1
+    uint32_t interval_us;  // Sample interval of the daemon
+    uint32_t pid;          // Process id of the daemon
+    uint32_t state;        // COREUSAGE_SHM_RUNNING or COREUSAGE_SHM_STOPPED
+    uint64_t seq;          // Seqlock sequence number, odd while the daemon writes
+    uint64_t samples;      // Number of samples published so far
+    uint64_t monotonic_ns; // CLOCK_MONOTONIC time of the sample
+    uint64_t realtime_ns;  // CLOCK_REALTIME time of the sample
+    uint32_t num_online;   // CPUs online in the sample
+    uint32_t freq_source;  // COREUSAGE_SHM_FREQ_*
+    uint8_t reserved[56];
+};
+
+// One per possible CPU id, starting at header_size (136 bytes)
+struct coreusage_shm_cpu
+{
+    uint64_t ticks[COREUSAGE_SHM_FIELDS];   // Cumulative /proc/stat counters in USER_HZ ticks
+    float field_pct[COREUSAGE_SHM_FIELDS];  // Share of every field in the last interval, in percent
+    float usage;                            // user + nice + system of the last interval, in percent
+    uint32_t freq_khz;                      // Current frequency, 0 if unknown
+    int16_t temp;                           // Temperature in 1/10 °C, COREUSAGE_SHM_TEMP_UNKNOWN if unknown
+    uint8_t online;                         // 1 if the CPU was online in the last sample
+    uint8_t reserved[5];
+};
+
+static inline const struct coreusage_shm_cpu *coreusage_shm_cpus(const struct coreusage_shm_header *h)
+{
+    return (const struct coreusage_shm_cpu *)(const void *)((const char *)h + h->header_size);
+}
+
+// Starts a read; returns the sequence number to pass to coreusage_shm_read_retry()
+static inline uint64_t coreusage_shm_read_begin(const struct coreusage_shm_header *h)
+{
+    return __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+}
+
+// Returns non-zero if the data copied since coreusage_shm_read_begin() may be torn
+// A daemon killed while writing leaves seq odd; readers should give up after a few retries.
+static inline int coreusage_shm_read_retry(const struct coreusage_shm_header *h, uint64_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (seq & 1) || __atomic_load_n(&h->seq, __ATOMIC_RELAXED) != seq;
+}
+
+#endif
@@ -0,0 +1,843 @@
+/*
+ * libcoreusage - the sampling engine of coreusage (see coreusage.h)
+ *
+ * coreusage_open() sets up everything a read needs: the files stay open, the buffers are
+ * sized for the largest contents they can get, and the batch has a slot for every file.
+ * A read then only issues the batch and parses the results into the caller's storage.
+ */
+
+#define _GNU_SOURCE // syscall() and MAP_POPULATE
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "coreusage.h"
+#include "scan.h"
+
+#define STAT_FILE "/proc/stat"
+#define CPUINFO_FILE "/proc/cpuinfo"
+#define CPU_POSSIBLE_FILE "/sys/devices/system/cpu/possible"
+#define CPU_DIR "/sys/devices/system/cpu/cpu"
+#define CPUFREQ_FILE "/cpufreq/scaling_cur_freq"
+#define STAT_LINE_MAX 256      // Longest "cpuN" line: the id and ten 20-digit counters
+#define SMALL_READ 32          // Buffer of one frequency or temperature read
+#define URING_MAX_ENTRIES 4096 // Submission queue size at most; larger batches go in chunks
+#define CALIBRATE_ROUNDS 8     // Read batches timed on each path before COREUSAGE_IO_AUTO picks one
+
+// Slots of the registered file table: /proc/stat, /proc/cpuinfo, one per possible CPU, one per temperature input
+#define SLOT_STAT 0
+#define SLOT_CPUINFO 1
+#define SLOT_FREQ 2
+#define SLOT_TEMP(cu) (SLOT_FREQ + (cu)->max_cpus)
+
+// One read of a batch, from offset 0
+struct io_read
+{
+    int fd;
+    int slot; // Entry in the registered file table
+    char *buf;
+    unsigned len;
+    int res; // Bytes read or -errno
+};
+
+struct coreusage
+{
+    int root_fd; // Directory the /proc and /sys paths are resolved under, AT_FDCWD for the live system
+    int max_cpus;
+    int freq_source;
+    int stat_fd;
+    char *stat_buf; // Room for a "cpuN" line of every possible CPU; the rest of the file is not read
+    size_t stat_size;
+    int cpuinfo_fd;
+    char *cpuinfo_buf; // Twice the size /proc/cpuinfo had at coreusage_open()
+    size_t cpuinfo_size;
+    int *freq_fd;          // [max_cpus] Open scaling_cur_freq per CPU id, -1 if closed
+    uint8_t *freq_online;  // [max_cpus] Online state seen by the frequency reader
+    int temp_fd[COREUSAGE_MAX_TEMPS];
+    int num_temps;
+
+    // The batch: through io_uring with registered files, one io_uring_enter() for all of
+    // it, or with one pread() each if io_uring is not available or slower
+    int io;
+    int ring_fd; // -1 without io_uring
+    void *sq_map, *cq_map; // The rings, one mapping with IORING_FEAT_SINGLE_MMAP
+    size_t sq_map_size, cq_map_size, sqes_size;
+    struct io_uring_sqe *sqes;
+    _Atomic uint32_t *sq_tail, *cq_head, *cq_tail;
+    uint32_t *sq_array;
+    uint32_t sq_mask, cq_mask, sq_entries;
+    struct io_uring_cqe *cqes;
+    int *registered; // [slot] fd in the registered file table, -1 if empty; NULL if none
+    int nslots;
+    struct io_read *reads; // [nslots] The current batch
+    int count;
+    char *small; // [slot] SMALL_READ bytes each for frequency and temperature reads
+    uint64_t files_read;
+    uint64_t syscalls;
+};
+
+// Opens a /proc or /sys path read-only, below the sysroot if one is set
+static int open_sys_path(const struct coreusage *cu, const char *path)
+{
+    if (cu->root_fd == AT_FDCWD)
+        return open(path, O_RDONLY | O_CLOEXEC);
+    return openat(cu->root_fd, path + (path[0] == '/'), O_RDONLY | O_CLOEXEC);
+}
+
+// Opens the scaling_cur_freq file of one CPU, returns the fd or -1
+// The path is put together by hand, as nothing here uses stdio.
+static int open_cpu_freq(const struct coreusage *cu, int cpu_id)
+{
+    char path[sizeof(CPU_DIR) + 12 + sizeof(CPUFREQ_FILE)];
+    char digits[12];
+    int n = 0;
+    do
+        digits[n++] = (char)('0' + cpu_id % 10);
+    while ((cpu_id /= 10) > 0);
+    char *p = path;
+    memcpy(p, CPU_DIR, sizeof(CPU_DIR) - 1);
+    p += sizeof(CPU_DIR) - 1;
+    while (n > 0)
+        *p++ = digits[--n];
+    memcpy(p, CPUFREQ_FILE, sizeof(CPUFREQ_FILE));
+    return open_sys_path(cu, path);
+}
+
+// Reads a file from offset 0 until the end or until buf is full, returns the length or -errno
+// seq_files such as /proc/cpuinfo return about a page per read, whatever size is asked for.
+static ssize_t read_full(struct coreusage *cu, int fd, char *buf, size_t size, size_t len)
+{
+    while (len < size)
+    {
+        cu->syscalls++;
+        ssize_t n = pread(fd, buf + len, size - len, (off_t)len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -errno;
+        if (n == 0)
+            break;
+        len += (size_t)n;
+    }
+    return (ssize_t)len;
+}
+
+// Reads a whole file into a new buffer of twice its size at least min, for coreusage_open()
+// Returns the length, or -errno; *buf is set either way and has to be freed.
+static ssize_t read_sized(struct coreusage *cu, int fd, char **buf, size_t *size, size_t min)
+{
+    *size = min;
+    *buf = malloc(*size);
+    for (;;)
+    {
+        if (!*buf)
+            return -ENOMEM;
+        ssize_t len = read_full(cu, fd, *buf, *size, 0);
+        if (len < 0)
+            return len;
+        if ((size_t)len < *size / 2)
+            return len;
+        char *nb = realloc(*buf, *size * 2);
+        if (!nb)
+            return -ENOMEM;
+        *buf = nb;
+        *size *= 2;
+    }
+}
+
+// Determines the number of possible CPU ids from a cpulist such as "0-511" or "0,2-7"
+// Falls back to the configured processor count if the file cannot be read.
+static int count_possible_cpus(const struct coreusage *cu)
+{
+    int max_id = -1;
+    int fd = open_sys_path(cu, CPU_POSSIBLE_FILE);
+    if (fd >= 0)
+    {
+        char buf[256];
+        ssize_t n = read(fd, buf, sizeof(buf));
+        close(fd);
+        const char *p = buf;
+        const char *end = buf + (n > 0 ? n : 0);
+        unsigned long long v;
+        // The highest id is the last number of the list
+        while (p < end && scan_ull(&p, end, &v))
+        {
+            if ((long long)v > max_id)
+                max_id = (int)v;
+            if (p < end && (*p == '-' || *p == ','))
+                p++;
+        }
+    }
+    if (max_id < 0)
+    {
+        long n = sysconf(_SC_NPROCESSORS_CONF);
+        max_id = n > 0 ? (int)n - 1 : 0;
+    }
+    return max_id + 1;
+}
+
+// Parses the per-core lines of the /proc/stat contents in buf into snap
+// All snapshot arrays are indexed directly by CPU id (0 .. max_cpus - 1). Fills cpu_ids (if
+// not NULL) with the CPUs present in the file (the online ones) and returns their number.
+static int parse_cpu_stats(const char *buf, size_t len, struct coreusage_snapshot *snap, int cpu_ids[], int max_cpus)
+{
+    int found_cpus = 0;
+    // Offline CPUs have no line in /proc/stat
+    memset(snap->online, 0, (size_t)max_cpus);
+    const char *p = buf;
+    const char *end = buf + len;
+    while (p < end)
+    {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        // A line cut off by the end of the buffer is incomplete
+        if (!eol)
+            break;
+        // Only consider lines starting with "cpu" followed by a digit
+        if (eol - p > 4 && p[0] == 'c' && p[1] == 'p' && p[2] == 'u' && (unsigned char)(p[3] - '0') <= 9)
+        {
+            const char *s = p + 3;
+            unsigned long long cpu_id = 0;
+            unsigned long long v[COREUSAGE_FIELDS] = {0};
+            int matched = 0;
+            scan_ull(&s, eol, &cpu_id);
+            // Parse CPU stats (accept variable field count)
+            while (matched < COREUSAGE_FIELDS && scan_ull(&s, eol, &v[matched]))
+                matched++;
+            if (matched >= 4 && cpu_id < (unsigned long long)max_cpus)
+            {
+                int id = (int)cpu_id;
+                // Fields missing on older kernels stay zero
+                for (int f = 0; f < COREUSAGE_FIELDS; ++f)
+                    snap->field[f][id] = v[f];
+                snap->online[id] = 1;
+                if (cpu_ids)
+                    cpu_ids[found_cpus] = id;
+                found_cpus++;
+            }
+        }
+        else if (found_cpus > 0)
+        {
+            // The per-core lines are contiguous; nothing of interest follows them
+            break;
+        }
+        p = eol + 1;
+    }
+    return found_cpus;
+}
+
+// Parses the "processor" and "cpu MHz" lines of /proc/cpuinfo in a single pass
+static void parse_cpuinfo_freqs(const char *buf, size_t len, uint32_t freq_khz[], int max_cpus)
+{
+    const char *p = buf;
+    const char *end = buf + len;
+    long cpu_id = -1;
+    while (p < end)
+    {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol)
+            eol = end;
+        const char *colon = memchr(p, ':', (size_t)(eol - p));
+        if (colon)
+        {
+            const char *s = colon + 1;
+            unsigned long long v = 0;
+            if (eol - p > 9 && memcmp(p, "processor", 9) == 0)
+            {
+                cpu_id = scan_ull(&s, eol, &v) ? (long)v : -1;
+            }
+            else if (eol - p > 7 && memcmp(p, "cpu MHz", 7) == 0 && cpu_id >= 0 && cpu_id < max_cpus && scan_ull(&s, eol, &v))
+            {
+                // Convert "2400.123" to kHz without going through floating point parsing
+                unsigned long long khz = v * 1000;
+                if (s < eol && *s == '.')
+                {
+                    s++;
+                    for (unsigned long long scale = 100; scale > 0 && s < eol && (unsigned char)(*s - '0') <= 9; scale /= 10)
+                        khz += (unsigned long long)(*s++ - '0') * scale;
+                }
+                freq_khz[cpu_id] = (uint32_t)khz;
+            }
+        }
+        p = eol + 1;
+    }
+}
+
+// Sets up an io_uring whose registered file table has nslots entries, all empty at first
+// Returns -1 if the kernel lacks io_uring or IORING_OP_READ (before 5.6), or forbids it
+// (seccomp, kernel.io_uring_disabled). Without sparse file tables the reads use plain fds.
+static int uring_open(struct coreusage *cu)
+{
+    unsigned entries = cu->nslots < URING_MAX_ENTRIES ? (unsigned)cu->nslots : URING_MAX_ENTRIES;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+        return -1;
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    int ok = probe && syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+             probe->last_op >= IORING_OP_READ && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    cu->ring_fd = fd;
+    if (!ok)
+        return -1;
+    cu->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cu->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && cu->cq_map_size > cu->sq_map_size)
+        cu->sq_map_size = cu->cq_map_size;
+    void *sq = mmap(NULL, cu->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        return -1;
+    cu->sq_map = sq;
+    void *cq = single ? sq : mmap(NULL, cu->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED)
+        return -1;
+    cu->cq_map = cq;
+    cu->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, cu->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        return -1;
+    cu->sqes = sqes;
+    cu->sq_tail = (_Atomic uint32_t *)((char *)sq + p.sq_off.tail);
+    cu->sq_array = (uint32_t *)((char *)sq + p.sq_off.array);
+    cu->sq_mask = *(uint32_t *)((char *)sq + p.sq_off.ring_mask);
+    cu->sq_entries = p.sq_entries;
+    cu->cq_head = (_Atomic uint32_t *)((char *)cq + p.cq_off.head);
+    cu->cq_tail = (_Atomic uint32_t *)((char *)cq + p.cq_off.tail);
+    cu->cq_mask = *(uint32_t *)((char *)cq + p.cq_off.ring_mask);
+    cu->cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+    // A sparse table (every entry -1) is filled as the files are used
+    cu->registered = malloc((size_t)cu->nslots * sizeof(*cu->registered));
+    for (int s = 0; cu->registered && s < cu->nslots; ++s)
+        cu->registered[s] = -1;
+    if (cu->registered && syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, cu->registered, cu->nslots) != 0)
+    {
+        free(cu->registered);
+        cu->registered = NULL;
+    }
+    return 0;
+}
+
+// Tears the io_uring down; the batches are read with pread() from then on
+static void uring_close(struct coreusage *cu)
+{
+    if (cu->sqes)
+        munmap(cu->sqes, cu->sqes_size);
+    if (cu->cq_map && cu->cq_map != cu->sq_map)
+        munmap(cu->cq_map, cu->cq_map_size);
+    if (cu->sq_map)
+        munmap(cu->sq_map, cu->sq_map_size);
+    if (cu->ring_fd >= 0)
+        close(cu->ring_fd);
+    free(cu->registered);
+    cu->sqes = NULL;
+    cu->sq_map = cu->cq_map = NULL;
+    cu->registered = NULL;
+    cu->ring_fd = -1;
+}
+
+// Empties a slot of the registered file table before its fd is closed
+// The table holds its own reference, so a new file that gets the same fd number would
+// otherwise still be read through the old one.
+static void io_forget_slot(struct coreusage *cu, int slot)
+{
+    if (!cu->registered || cu->registered[slot] < 0)
+        return;
+    int fd = -1;
+    struct io_uring_files_update update = {.offset = (uint32_t)slot, .fds = (uint64_t)(uintptr_t)&fd};
+    cu->syscalls++;
+    syscall(__NR_io_uring_register, cu->ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+    cu->registered[slot] = -1;
+}
+
+// Puts fd into its slot of the registered file table. Returns 1 if it is registered there
+static int uring_register_slot(struct coreusage *cu, int slot, int fd)
+{
+    if (!cu->registered)
+        return 0;
+    if (cu->registered[slot] == fd)
+        return 1;
+    io_forget_slot(cu, slot);
+    struct io_uring_files_update update = {.offset = (uint32_t)slot, .fds = (uint64_t)(uintptr_t)&fd};
+    cu->syscalls++;
+    if (syscall(__NR_io_uring_register, cu->ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1)
+        return 0;
+    cu->registered[slot] = fd;
+    return 1;
+}
+
+// Closes a kept-open file of a slot
+static void close_slot(struct coreusage *cu, int slot, int *fd)
+{
+    if (*fd < 0)
+        return;
+    io_forget_slot(cu, slot);
+    close(*fd);
+    *fd = -1;
+}
+
+// Small per-slot buffer for a frequency or temperature read
+static char *io_small_buf(struct coreusage *cu, int slot)
+{
+    return cu->small + (size_t)slot * SMALL_READ;
+}
+
+// Queues a read of up to len bytes from offset 0 of fd into buf; every slot at most once per batch
+static void io_batch_add(struct coreusage *cu, int slot, int fd, char *buf, size_t len)
+{
+    if (cu->count >= cu->nslots)
+        return;
+    cu->reads[cu->count++] = (struct io_read){.fd = fd, .slot = slot, .buf = buf, .len = (unsigned)len, .res = -EIO};
+}
+
+// Submits the batch in chunks of the submission queue size and reaps the completions
+// Every chunk costs one io_uring_enter(), or a few if it is interrupted by a signal.
+// Returns -1 if io_uring_enter() fails.
+static int uring_run(struct coreusage *cu)
+{
+    for (int first = 0; first < cu->count; first += (int)cu->sq_entries)
+    {
+        int n = cu->count - first < (int)cu->sq_entries ? cu->count - first : (int)cu->sq_entries;
+        uint32_t tail = atomic_load_explicit(cu->sq_tail, memory_order_relaxed);
+        for (int i = first; i < first + n; ++i)
+        {
+            struct io_read *r = &cu->reads[i];
+            int fixed = uring_register_slot(cu, r->slot, r->fd);
+            uint32_t index = tail++ & cu->sq_mask;
+            struct io_uring_sqe *sqe = &cu->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->flags = fixed ? IOSQE_FIXED_FILE : 0;
+            sqe->fd = fixed ? r->slot : r->fd;
+            sqe->addr = (uint64_t)(uintptr_t)r->buf;
+            sqe->len = r->len;
+            sqe->user_data = (uint64_t)i;
+            cu->sq_array[index] = index;
+        }
+        atomic_store_explicit(cu->sq_tail, tail, memory_order_release);
+        // The kernel never takes more entries than are queued, so n can be passed every time
+        int done = 0;
+        while (done < n)
+        {
+            cu->syscalls++;
+            if (syscall(__NR_io_uring_enter, cu->ring_fd, n, n - done, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                return -1;
+            uint32_t head = atomic_load_explicit(cu->cq_head, memory_order_relaxed);
+            uint32_t cq_tail = atomic_load_explicit(cu->cq_tail, memory_order_acquire);
+            for (; head != cq_tail; ++head, ++done)
+            {
+                const struct io_uring_cqe *cqe = &cu->cqes[head & cu->cq_mask];
+                if (cqe->user_data < (uint64_t)cu->count)
+                    cu->reads[cqe->user_data].res = cqe->res;
+            }
+            atomic_store_explicit(cu->cq_head, head, memory_order_release);
+        }
+    }
+    return 0;
+}
+
+// Reads one entry of the batch with pread()
+static void sync_read(struct coreusage *cu, struct io_read *r)
+{
+    ssize_t n;
+    do
+    {
+        cu->syscalls++;
+        n = pread(r->fd, r->buf, r->len, 0);
+    } while (n < 0 && errno == EINTR);
+    r->res = n < 0 ? -errno : (int)n;
+}
+
+// Issues all queued reads and waits for them: through io_uring if it is set up, else with
+// one pread() each. Reads io_uring failed are repeated with pread(), so files it cannot read
+// (procfs before Linux 5.10) still work; if io_uring itself fails, it is given up.
+static void io_batch_run(struct coreusage *cu)
+{
+    if (cu->ring_fd >= 0 && uring_run(cu) != 0)
+    {
+        uring_close(cu);
+        for (int i = 0; i < cu->count; ++i)
+            cu->reads[i].res = -EIO;
+    }
+    for (int i = 0; i < cu->count; ++i)
+        if (cu->reads[i].res < 0)
+            sync_read(cu, &cu->reads[i]);
+    cu->files_read += (uint64_t)cu->count;
+}
+
+// Queues the files of a read into a new batch; the frequencies are read from cpufreq or /proc/cpuinfo
+static void queue_reads(struct coreusage *cu, int stat, int freq, int temp)
+{
+    cu->count = 0;
+    if (stat)
+        io_batch_add(cu, SLOT_STAT, cu->stat_fd, cu->stat_buf, cu->stat_size);
+    if (freq && cu->freq_source == COREUSAGE_FREQ_CPUINFO)
+        io_batch_add(cu, SLOT_CPUINFO, cu->cpuinfo_fd, cu->cpuinfo_buf, cu->cpuinfo_size);
+    for (int cpu_id = 0; freq && cu->freq_source == COREUSAGE_FREQ_CPUFREQ && cpu_id < cu->max_cpus; ++cpu_id)
+        if (cu->freq_fd[cpu_id] >= 0)
+            io_batch_add(cu, SLOT_FREQ + cpu_id, cu->freq_fd[cpu_id], io_small_buf(cu, SLOT_FREQ + cpu_id), SMALL_READ);
+    for (int j = 0; temp && j < cu->num_temps; ++j)
+        if (cu->temp_fd[j] >= 0)
+            io_batch_add(cu, SLOT_TEMP(cu) + j, cu->temp_fd[j], io_small_buf(cu, SLOT_TEMP(cu) + j), SMALL_READ);
+}
+
+// Closes the cpufreq files of CPUs that went offline and reopens those of CPUs that came back
+// The cpufreq files stay open otherwise; a file is also closed when its read fails.
+static void sync_cpu_freq_files(struct coreusage *cu, const uint8_t online[], uint32_t freq_khz[])
+{
+    // Walk all possible CPUs so that offline transitions are seen as well
+    for (int cpu_id = 0; cpu_id < cu->max_cpus; ++cpu_id)
+    {
+        if (!online[cpu_id])
+        {
+            if (cu->freq_online[cpu_id])
+            {
+                close_slot(cu, SLOT_FREQ + cpu_id, &cu->freq_fd[cpu_id]);
+                cu->freq_online[cpu_id] = 0;
+                freq_khz[cpu_id] = 0;
+            }
+        }
+        else if (!cu->freq_online[cpu_id])
+        {
+            // CPU came back online: its cpufreq directory has been recreated
+            cu->freq_fd[cpu_id] = open_cpu_freq(cu, cpu_id);
+            cu->freq_online[cpu_id] = 1;
+        }
+    }
+}
+
+// Takes the frequencies from the batch into freq_khz, then follows CPU hotplug if online is
+// known (a CPU that came back online is read from the next batch on)
+static void finish_freqs(struct coreusage *cu, const struct io_read *r, const uint8_t online[], uint32_t freq_khz[])
+{
+    if (cu->freq_source == COREUSAGE_FREQ_CPUINFO)
+    {
+        // The batch got the first part of /proc/cpuinfo
+        ssize_t len = r->res >= 0 ? read_full(cu, cu->cpuinfo_fd, cu->cpuinfo_buf, cu->cpuinfo_size, (size_t)r->res) : r->res;
+        if (len < 0)
+        {
+            // Do not retry every read
+            cu->freq_source = COREUSAGE_FREQ_NONE;
+            close_slot(cu, SLOT_CPUINFO, &cu->cpuinfo_fd);
+            return;
+        }
+        parse_cpuinfo_freqs(cu->cpuinfo_buf, (size_t)len, freq_khz, cu->max_cpus);
+        return;
+    }
+    if (cu->freq_source != COREUSAGE_FREQ_CPUFREQ)
+        return;
+    for (; r < cu->reads + cu->count && r->slot < SLOT_TEMP(cu); ++r)
+    {
+        int cpu_id = r->slot - SLOT_FREQ;
+        const char *s = r->buf;
+        unsigned long long khz = 0;
+        if (r->res <= 0 || !scan_ull(&s, r->buf + r->res, &khz))
+        {
+            close_slot(cu, r->slot, &cu->freq_fd[cpu_id]);
+            freq_khz[cpu_id] = 0;
+            continue;
+        }
+        freq_khz[cpu_id] = (uint32_t)khz;
+    }
+    if (online)
+        sync_cpu_freq_files(cu, online, freq_khz);
+}
+
+// Takes the temperatures from the batch (in m°C, as the hwmon ABI defines them)
+// Returns the number of inputs whose read failed.
+static int finish_temps(struct coreusage *cu, const struct io_read *r, double temp[])
+{
+    int errors = 0;
+    for (int j = 0; j < cu->num_temps; ++j)
+        temp[j] = NAN;
+    for (; r < cu->reads + cu->count; ++r)
+    {
+        const char *s = r->buf;
+        const char *end = r->buf + (r->res > 0 ? r->res : 0);
+        int negative = s < end && *s == '-';
+        unsigned long long millis;
+        s += negative;
+        if (r->res <= 0 || !scan_ull(&s, end, &millis))
+            continue;
+        temp[r->slot - SLOT_TEMP(cu)] = (negative ? -(double)millis : (double)millis) / 1000.0;
+    }
+    for (int j = 0; j < cu->num_temps; ++j)
+        errors += isnan(temp[j]);
+    return errors;
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// With COREUSAGE_IO_AUTO, times a few read batches on both paths and keeps io_uring only if it wins
+// Fewer system calls do not always pay for its cost per request: most sysfs files are read
+// by io_uring's worker threads, since they cannot be read without blocking.
+static void io_calibrate(struct coreusage *cu)
+{
+    int ring_fd = cu->ring_fd;
+    uint64_t ns[2] = {0, 0};
+    // Alternating evens out noise; the first round of each path registers the files
+    for (int round = 0; round < (CALIBRATE_ROUNDS + 1) * 2; ++round)
+    {
+        int uring = round & 1;
+        cu->ring_fd = uring ? ring_fd : -1;
+        uint64_t t0 = monotonic_ns();
+        queue_reads(cu, 1, 1, 0);
+        io_batch_run(cu);
+        // A failed submission tears the ring down (and leaves ring_fd at -1): stay on pread
+        if (!cu->sq_map)
+            return;
+        if (round >= 2)
+            ns[uring] += monotonic_ns() - t0;
+    }
+    cu->ring_fd = ring_fd;
+    if (ns[1] >= ns[0])
+        uring_close(cu);
+}
+
+// Opens the frequency sources once
+// Uses the per-core cpufreq files when at least one exists, otherwise falls back
+// to the "cpu MHz" lines of /proc/cpuinfo (typical in VMs without cpufreq).
+static int init_freqs(struct coreusage *cu, const uint8_t online[])
+{
+    int opened = 0;
+    for (int cpu_id = 0; cpu_id < cu->max_cpus; ++cpu_id)
+    {
+        cu->freq_online[cpu_id] = online[cpu_id];
+        if (online[cpu_id] && (cu->freq_fd[cpu_id] = open_cpu_freq(cu, cpu_id)) >= 0)
+            opened++;
+    }
+    if (opened > 0)
+    {
+        cu->freq_source = COREUSAGE_FREQ_CPUFREQ;
+        return 0;
+    }
+    cu->cpuinfo_fd = open_sys_path(cu, CPUINFO_FILE);
+    if (cu->cpuinfo_fd < 0)
+        return 0;
+    ssize_t len = read_sized(cu, cu->cpuinfo_fd, &cu->cpuinfo_buf, &cu->cpuinfo_size, 4096);
+    if (len == -ENOMEM)
+        return -1;
+    cu->freq_source = len > 0 ? COREUSAGE_FREQ_CPUINFO : COREUSAGE_FREQ_NONE;
+    return 0;
+}
+
+int coreusage_version(void)
+{
+    return COREUSAGE_API_VERSION;
+}
+
+struct coreusage *coreusage_open(const struct coreusage_config *config)
+{
+    static const struct coreusage_config defaults = {.io = COREUSAGE_IO_AUTO};
+    if (!config)
+        config = &defaults;
+    if (config->io < COREUSAGE_IO_AUTO || config->io > COREUSAGE_IO_SYNC)
+        return errno = EINVAL, NULL;
+    struct coreusage *cu = calloc(1, sizeof(*cu));
+    if (!cu)
+        return NULL;
+    cu->root_fd = AT_FDCWD;
+    cu->stat_fd = cu->cpuinfo_fd = cu->ring_fd = -1;
+    for (int j = 0; j < COREUSAGE_MAX_TEMPS; ++j)
+        cu->temp_fd[j] = -1;
+    cu->io = config->io;
+    void *first = NULL; // The first sample, for the online CPUs
+
+    if (config->sysroot && (cu->root_fd = open(config->sysroot, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        goto fail;
+    cu->max_cpus = count_possible_cpus(cu);
+    size_t n = (size_t)cu->max_cpus;
+    // One read of /proc/stat finds the online CPUs; the per-core lines come right after the total
+    cu->stat_size = (n + 1) * STAT_LINE_MAX;
+    cu->stat_buf = malloc(cu->stat_size);
+    cu->freq_fd = malloc(n * sizeof(*cu->freq_fd));
+    cu->freq_online = calloc(n, sizeof(*cu->freq_online));
+    cu->nslots = SLOT_FREQ + cu->max_cpus + COREUSAGE_MAX_TEMPS;
+    cu->reads = malloc((size_t)cu->nslots * sizeof(*cu->reads));
+    cu->small = malloc((size_t)cu->nslots * SMALL_READ);
+    first = malloc(coreusage_snapshot_size(cu->max_cpus));
+    if (!cu->stat_buf || !cu->freq_fd || !cu->freq_online || !cu->reads || !cu->small || !first)
+        goto fail;
+    for (size_t i = 0; i < n; ++i)
+        cu->freq_fd[i] = -1;
+    if ((cu->stat_fd = open_sys_path(cu, STAT_FILE)) < 0)
+        goto fail;
+    ssize_t len = read_full(cu, cu->stat_fd, cu->stat_buf, cu->stat_size, 0);
+    if (len < 0)
+    {
+        errno = (int)-len;
+        goto fail;
+    }
+    struct coreusage_snapshot snap;
+    coreusage_snapshot_init(&snap, first, cu->max_cpus);
+    if (parse_cpu_stats(cu->stat_buf, (size_t)len, &snap, NULL, cu->max_cpus) == 0)
+    {
+        errno = ENODATA;
+        goto fail;
+    }
+    if (!(config->flags & COREUSAGE_NO_FREQ) && init_freqs(cu, snap.online) != 0)
+        goto fail;
+    if (cu->io != COREUSAGE_IO_SYNC && uring_open(cu) != 0)
+    {
+        uring_close(cu);
+        if (cu->io == COREUSAGE_IO_URING)
+        {
+            errno = ENOSYS;
+            goto fail;
+        }
+    }
+    if (cu->io == COREUSAGE_IO_AUTO && cu->ring_fd >= 0)
+        io_calibrate(cu);
+    free(first);
+    return cu;
+fail:;
+    int err = errno;
+    free(first);
+    coreusage_close(cu);
+    errno = err;
+    return NULL;
+}
+
+void coreusage_close(struct coreusage *cu)
+{
+    if (!cu)
+        return;
+    uring_close(cu);
+    coreusage_clear_temps(cu);
+    for (int cpu_id = 0; cu->freq_fd && cpu_id < cu->max_cpus; ++cpu_id)
+        if (cu->freq_fd[cpu_id] >= 0)
+            close(cu->freq_fd[cpu_id]);
+    if (cu->stat_fd >= 0)
+        close(cu->stat_fd);
+    if (cu->cpuinfo_fd >= 0)
+        close(cu->cpuinfo_fd);
+    if (cu->root_fd >= 0)
+        close(cu->root_fd);
+    free(cu->stat_buf);
+    free(cu->cpuinfo_buf);
+    free(cu->freq_fd);
+    free(cu->freq_online);
+    free(cu->reads);
+    free(cu->small);
+    free(cu);
+}
+
+int coreusage_max_cpus(const struct coreusage *cu)
+{
+    return cu->max_cpus;
+}
+
+int coreusage_freq_source(const struct coreusage *cu)
+{
+    return cu->freq_source;
+}
+
+int coreusage_add_temp(struct coreusage *cu, const char *path)
+{
+    if (cu->num_temps >= COREUSAGE_MAX_TEMPS)
+        return -ENOSPC;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    cu->temp_fd[cu->num_temps] = fd;
+    return cu->num_temps++;
+}
+
+void coreusage_clear_temps(struct coreusage *cu)
+{
+    for (int j = 0; j < cu->num_temps; ++j)
+        close_slot(cu, SLOT_TEMP(cu) + j, &cu->temp_fd[j]);
+    cu->num_temps = 0;
+}
+
+int coreusage_read(struct coreusage *cu, struct coreusage_read *r)
+{
+    queue_reads(cu, r->snap != NULL, r->freq_khz != NULL, r->temp != NULL);
+    io_batch_run(cu);
+    // The batch is in slot order: /proc/stat, /proc/cpuinfo, the frequencies, the temperatures
+    const struct io_read *next = cu->reads;
+    const struct io_read *end = cu->reads + cu->count;
+    int ret = 0;
+    if (r->snap)
+    {
+        if (next->res < 0)
+            ret = next->res;
+        else
+            r->num_online = parse_cpu_stats(next->buf, (size_t)next->res, r->snap, r->cpu_ids, cu->max_cpus);
+        next++;
+    }
+    if (r->freq_khz)
+    {
+        const uint8_t *online = r->snap && ret == 0 ? r->snap->online : r->online;
+        if (cu->freq_source == COREUSAGE_FREQ_CPUFREQ)
+            for (int cpu_id = 0; cpu_id < cu->max_cpus; ++cpu_id)
+                if (cu->freq_fd[cpu_id] < 0)
+                    r->freq_khz[cpu_id] = 0;
+        finish_freqs(cu, next, online, r->freq_khz);
+        while (next < end && next->slot < SLOT_TEMP(cu))
+            next++;
+    }
+    if (r->temp)
+        r->temp_errors = finish_temps(cu, next, r->temp);
+    return ret;
+}
+
+size_t coreusage_snapshot_size(int max_cpus)
+{
+    return (size_t)max_cpus * sizeof(uint64_t) * COREUSAGE_FIELDS + (size_t)max_cpus;
+}
+
+void coreusage_snapshot_init(struct coreusage_snapshot *snap, void *mem, int max_cpus)
+{
+    size_t counters = (size_t)max_cpus * sizeof(uint64_t);
+    memset(mem, 0, coreusage_snapshot_size(max_cpus));
+    for (int f = 0; f < COREUSAGE_FIELDS; ++f)
+        snap->field[f] = (uint64_t *)((char *)mem + counters * (size_t)f);
+    snap->online = (uint8_t *)mem + counters * COREUSAGE_FIELDS;
+}
+
+void coreusage_delta(const struct coreusage_snapshot *prev, const struct coreusage_snapshot *cur, int max_cpus,
+                     float usage[], float *const field_pct[COREUSAGE_FIELDS])
+{
+    for (int c = 0; c < max_cpus; ++c)
+    {
+        float delta[COREUSAGE_FIELDS];
+        float total = 0.0f;
+        for (int f = 0; f < COREUSAGE_FIELDS; ++f)
+        {
+            // iowait may go backwards; such a field counts as zero
+            uint64_t a = prev->field[f][c], b = cur->field[f][c];
+            delta[f] = b > a ? (float)(b - a) : 0.0f;
+            if (f < COREUSAGE_GUEST)
+                total += delta[f];
+        }
+        float scale = total > 0.0f && (prev->online[c] & cur->online[c]) ? 100.0f / total : 0.0f;
+        for (int f = 0; field_pct && f < COREUSAGE_FIELDS; ++f)
+            if (field_pct[f])
+                field_pct[f][c] = delta[f] * scale;
+        usage[c] = (delta[COREUSAGE_USER] + delta[COREUSAGE_NICE] + delta[COREUSAGE_SYSTEM]) * scale;
+    }
+}
+
+void coreusage_get_stats(const struct coreusage *cu, struct coreusage_stats *st)
+{
+    st->reads = cu->files_read;
+    st->syscalls = cu->syscalls;
+    st->io = cu->ring_fd >= 0 ? COREUSAGE_IO_URING : COREUSAGE_IO_SYNC;
+}
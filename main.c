@@ -7,6 +7,7 @@
                                                        
 */
 
+#define _GNU_SOURCE // pthread_setaffinity_np() and the CPU_ALLOC() macros
 #define _POSIX_C_SOURCE 200809L
 
 #include <stdio.h>
@@ -24,456 +25,5388 @@
 #include <errno.h>
 #include <time.h>
 #include <getopt.h>
+#include <poll.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <netdb.h>
+#include "coreusage.h"
+#include "coreusage_shm.h"
+#include "scan.h"
 
 #define VERSION "1.0.2"
-#define MAX_CPUS 256 // Maximum number of CPU cores supported
 #define BAR_WIDTH 40 // Width of the usage bar
 #define COLOR_RESET "\033[0m"
 #define COLOR_GREEN "\033[32m"
 #define COLOR_YELLOW "\033[33m"
 #define COLOR_RED "\033[31m"
+#define COLOR_GRAY "\033[90m"
+#define COLOR_BLUE "\033[34m"
+#define COLOR_MAGENTA "\033[35m"
+#define COLOR_CYAN "\033[36m"
 #define TERM_WIDTH_FALLBACK 80
+#define TERM_HEIGHT_FALLBACK 24
+#define FB_PIPE_ROWS 64      // Initial frame height when stdout is not a terminal
+#define FB_OUT_INITIAL 16384 // Initial size of the frame output buffer
+#define FB_MAX_REWRITE_GAP 4 // Unchanged cells re-sent instead of moving the cursor
 #define TIME_BETWEEN_SAMPLES_US 200000 // 200ms
-#define TIME_BETWEEN_KEY_POLL_US 50000 // 50ms
 #define KEY_ESC 27
-#define STAT_FILE "/proc/stat"
+#define KEY_LEFT 2  // Ctrl-B, also reported for the left arrow key
+#define KEY_RIGHT 6 // Ctrl-F, also reported for the right arrow key
+#define CPU_TOPOLOGY_FMT "/sys/devices/system/cpu/cpu%d/topology/%s"
+#define MAX_TEMP_SENSORS COREUSAGE_MAX_TEMPS // Maximum number of resolved temperature inputs
+#define TEMP_COLUMN_WIDTH 6  // Display width of the per-core " 55°C" column
+#define TEMP_RESOLVE_MIN_NS 5000000000ULL // A failing CPU sensor triggers a new discovery at most this often
+#define NODE_DIR "/sys/devices/system/node"
+#define ROW_VALUES_WIDTH 24  // Display width of " %6.1f%%  %8.2f MHz  " after the row label
+#define GROUP_LABEL_LEN 24   // Maximum length of a group label such as "CPU 3,67"
+#define HEAT_CELL_WIDTH 4    // Display width of one CPU in the heat grid
+#define HEAT_IDLE_PERCENT 5  // Heat grid cells below this usage are drawn dimmed
+#define HISTORY_DEFAULT 300  // Samples in the statistics window (one minute at the default interval)
+#define HISTORY_MAX 36000
+#define HISTORY_BINS 101     // One histogram bin per whole percent
+#define SPARK_DEFAULT 20     // Samples shown in the sparkline
+#define STATS_COLUMN_WIDTH 18 // Display width of "  min  avg  max  p95" minus the sparkline gap
+#define RECORD_BYTES_PER_CPU 64 // Upper bound of one CPU's share of a text record
+#define RECORD_HEADER_BYTES 128  // Upper bound of the fixed part of a record
+#define BIN_MAGIC 0x31425543u    // "CUB1" in little-endian byte order
+#define BIN_VERSION 1
+#define BIN_HEADER_SIZE 24
+#define BIN_CPU_SIZE 8
+#define BIN_USAGE_OFFLINE 0xFFFFu
+#define BIN_TEMP_UNKNOWN INT16_MIN
+#define RING_MAGIC "CURING1" // Includes the terminating NUL: 8 bytes
+#define RING_VERSION 2
+#define RING_HEADER_SIZE 4096 // Header page; the slots start page-aligned after it
+#define RING_MAX_CPUS 65536
+#define RING_DEFAULT_MIB 64
+#define RING_TEMP_UNKNOWN INT16_MIN
+#define REPLAY_MIN_TICK_US 20000  // Fastest replay frame rate: 50 frames per second
+#define REPLAY_SEEK_SAMPLES 10    // Samples skipped by the arrow keys
+#define REPLAY_SPEED_MIN_LOG2 -4  // 1/16x
+#define REPLAY_SPEED_MAX_LOG2 10  // 1024x
+#define SAMPLER_MAX_SLOTS 1024  // Upper bound of the sampler ring
+#define PEAK_WINDOW_DEFAULT_MS 50 // /proc/stat counts in 10 ms ticks; shorter windows are mostly noise
+#define PEAK_COLUMN_WIDTH 8      // Display width of " %6.1f%%" for the peak column
+#define SHM_READ_ATTEMPTS 64   // Seqlock retries before a frame is skipped
+#define EXPORT_MAX_CLIENTS 16  // Scrapes served at the same time; further ones wait in the backlog
+#define EXPORT_REQUEST_MAX 2048 // Longest accepted request head
+#define EXPORT_TIMEOUT_NS 5000000000ULL // Connections not done by then are dropped
+#define EXPORT_HEAD_RESERVE 256 // Room for the HTTP response head in front of the metrics
+#define EXPORT_FIXED_BYTES 4096 // Upper bound of the HELP/TYPE lines and the global metrics
+#define EXPORT_BYTES_PER_CPU 2048 // Upper bound of one CPU's share of the metrics
+#define SELF_IO_FILE "/proc/self/io"
+#define SELF_STAT_FILE "/proc/self/stat"
+#define PHASE_BUCKETS 40 // Power-of-two duration buckets, the last one open-ended (beyond 4.5 min)
+#define RECORD_SELF_BYTES 384 // Upper bound of the --self-stats part of a record
+#define TOP_DEFAULT 3            // Tasks shown per busy CPU
+#define TOP_BUDGET_DEFAULT 4096  // Task stat reads per frame
+#define TOP_HOT_PERCENT 50       // CPUs at or above this usage get their top tasks shown
+#define TOP_MAX_ROWS 16          // Busy CPUs listed at most
+#define TOP_INITIAL_TASKS 1024
+#define TOP_FD_RESERVE 256       // File descriptors never used for kept-open task files
+#define TOP_MAX_AGE_NS 10000000000ULL // Tasks not re-read for this long are not ranked
+#define SCHEDSTAT_FILE "/proc/schedstat"
+#define PSI_CPU_FILE "/proc/pressure/cpu"
+#define WAIT_COLUMN_WIDTH 8    // Display width of " %7s" for the run delay per timeslice
+#define WAIT_WARN_NS 500000    // Run delay per timeslice drawn yellow from here on
+#define WAIT_CRIT_NS 5000000   // and red from here on
+#define PSI_WARN_PERCENT 10    // CPU pressure drawn yellow from here on
+#define PSI_CRIT_PERCENT 40    // and red from here on
+#define INTERRUPTS_FILE "/proc/interrupts"
+#define SOFTIRQS_FILE "/proc/softirqs"
+#define IRQ_TOP 3              // Busiest interrupt lines shown per CPU
+#define SOFTIRQ_TOP 2          // Busiest softirq types shown per CPU
+#define IRQ_ENTRY_WIDTH 21     // Display width of "%-14.14s %6s" for one interrupt line
+#define SOFTIRQ_ENTRY_WIDTH 15 // Display width of "%-8.8s %6s" for one softirq type
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_RESCAN_DEFAULT_S 30 // Full walk of the subtree: cpuset changes and missed events
+#define CGROUP_FD_LIMIT 1024       // Kept-open cpu.stat files at most
+#define CGROUP_INITIAL 256
+#define CGROUP_MAX_ROWS 32         // Groups listed when stdout is not a terminal
+#define CGROUP_NAME_MAX 48         // Longer paths are shortened from the left
+#define CPUIDLE_STATE_FMT "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/%s"
+#define IDLE_MAX_STATES 10         // The kernel's CPUIDLE_STATE_MAX
+#define IDLE_FD_LIMIT 16384        // Kept-open time and usage files at most
+#define IDLE_COLUMN_WIDTH 7        // Display width of " %5.1f%%" for the share of one state
+#define IDLE_WAKEUP_WIDTH 9        // Display width of " %8s" for the wakeup rate
+#define BENCH_DEFAULT_ITERATIONS 1000
+#define BENCH_COLS 160 // Frame width for --bench
+#define PROC_BUF_SIZE 65536 // Initial size of the buffers for kept-open proc files
 
 static int terminal_modified = 0;
-static volatile sig_atomic_t g_should_terminate = 0;
-static volatile sig_atomic_t g_winch = 0;
+
+// Off-screen frame buffer: each frame is drawn into cells and diffed against the previous one
+enum
+{
+    FB_COLOR_DEFAULT,
+    FB_COLOR_GREEN,
+    FB_COLOR_YELLOW,
+    FB_COLOR_RED,
+    FB_COLOR_GRAY,
+    FB_COLOR_BLUE,
+    FB_COLOR_MAGENTA,
+    FB_COLOR_CYAN,
+    FB_COLOR_COUNT
+};
+static const char *const g_fb_color_seq[FB_COLOR_COUNT] = {COLOR_RESET, COLOR_GREEN, COLOR_YELLOW, COLOR_RED, COLOR_GRAY,
+                                                           COLOR_BLUE, COLOR_MAGENTA, COLOR_CYAN};
+
+// One character cell; every glyph used by coreusage is a single column wide
+struct fb_cell
+{
+    char ch[4];          // UTF-8 bytes of the glyph
+    unsigned char len;   // Number of bytes used in ch
+    unsigned char color; // FB_COLOR_* index
+};
+#define FB_BLANK ((struct fb_cell){.ch = {' '}, .len = 1, .color = FB_COLOR_DEFAULT})
+
+static struct
+{
+    int rows;
+    int cols;
+    int used_rows;        // Rows written in the current frame
+    int fixed;            // 1 on a TTY: size follows the terminal and content is clipped
+    int full_redraw;      // Screen content unknown: clear and draw everything
+    struct fb_cell *cur;  // Frame being built
+    struct fb_cell *prev; // Frame currently on screen
+    char *out;            // Output bytes of one frame, written with a single write()
+    size_t out_len;
+    size_t out_cap;
+} g_fb;
+
+// A procfs/sysfs file that is kept open and re-read in full with pread()
+struct proc_file
+{
+    const char *path;
+    int fd;
+    char *buf;
+    size_t size;
+    int own; // 1 for a file about this process, which is never looked up below --sysroot
+};
+#define PROC_FILE_INIT(p) {.path = (p), .fd = -1, .buf = NULL, .size = 0}
+#define PROC_SELF_FILE_INIT(p) {.path = (p), .fd = -1, .buf = NULL, .size = 0, .own = 1}
+
+// Directory the /proc and /sys paths are resolved under (--sysroot), AT_FDCWD for the live system
+static int g_root_fd = AT_FDCWD;
+static const char *g_sysroot = NULL; // Its path, for the engines of libcoreusage
+
+// The sampling engine (libcoreusage): /proc/stat, frequencies and temperature inputs
+// NULL in a replay and in a viewer attached to a daemon.
+static struct coreusage *g_cu = NULL;
+
+// The time fields of a "cpuN" line in /proc/stat are COREUSAGE_USER .. COREUSAGE_GUEST_NICE
+// guest and guest_nice are already contained in user and nice.
+#define CPU_TIME_FIELDS COREUSAGE_GUEST // Fields up to steal add up to the elapsed time
+
+// Samples of the per-core counters are struct coreusage_snapshot: every field a contiguous
+// array of g_max_cpus entries (structure of arrays), all carved out of one allocation
+
+// Number of possible CPU ids (highest id in /sys/devices/system/cpu/possible + 1)
+static int g_max_cpus = 0;
+
+// Continuous sampling state: the previous sample is the baseline for the next one
+static struct coreusage_snapshot g_snap[2];
+static int g_snap_cur = 0;
+static int *g_cpu_ids = NULL; // Online CPU ids of the current sample, ascending
+static int g_num_cpus = 0;
+static float *g_usage = NULL; // Usage (user + nice + system) in percent of the last interval, indexed by CPU id
+static float *g_field_pct[COREUSAGE_FIELDS]; // Share of every field in percent of the last interval, indexed by CPU id
+static unsigned long long g_sample_realtime_ns = 0;  // Wall-clock time of the current sample
+static unsigned long long g_sample_monotonic_ns = 0; // CLOCK_MONOTONIC time of the current sample
+
+// Run-queue contention per CPU from /proc/schedstat: the time runnable tasks waited for the
+// CPU (run delay) and the number of timeslices run, both as counters of the latest sample
+// and as their increase over the last interval
+static struct
+{
+    int available;                  // The latest read succeeded
+    unsigned generation;            // Incremented with every read
+    unsigned *seen;                 // [cpu] Generation of the last read that had a line for the CPU
+    unsigned long long *delay_ns;   // [cpu]
+    unsigned long long *slices;     // [cpu]
+    unsigned long long *d_delay_ns; // [cpu]
+    unsigned long long *d_slices;   // [cpu]
+    float *wait_ns;                 // [cpu] Mean run delay per timeslice in ns, NAN if unknown
+} g_sched;
+static struct proc_file g_schedstat_file = PROC_FILE_INIT(SCHEDSTAT_FILE);
+
+// CPU pressure stall information (/proc/pressure/cpu): the share of time in which some
+// (or all non-idle) tasks were stalled waiting for a CPU
+static struct
+{
+    int available;
+    unsigned long long some_us, full_us; // Totals of the latest read
+    unsigned long long read_ns;          // CLOCK_MONOTONIC time of the latest read
+    float some_pct, full_pct;            // Over the last interval, NAN before the second read
+    float some_avg10, full_avg10;        // The kernel's 10 s averages
+} g_psi = {.some_pct = NAN, .full_pct = NAN};
+static struct proc_file g_psi_file = PROC_FILE_INIT(PSI_CPU_FILE);
+
+// Idle-state residency per CPU from cpuidle sysfs (idle view): the time files count µs spent
+// in a state, the usage files the entries into it. Two files per CPU and state are kept open.
+static struct
+{
+    int *fd;                     // [(cpu * IDLE_MAX_STATES + state) * 2 + 0/1] time/usage, -1 if not kept open
+    int *states;                 // [cpu] Idle states of the CPU, -1 if not probed yet
+    unsigned long long *time_us; // [cpu * IDLE_MAX_STATES + state] Totals of the latest read
+    unsigned long long *usage;   // [cpu * IDLE_MAX_STATES + state]
+    float *share;                // [cpu * IDLE_MAX_STATES + state] Percent of the last interval, NAN if unknown
+    float *wakeups;              // [cpu] Entries into any idle state per second, NAN if unknown
+    unsigned long long *read_ns; // [cpu] CLOCK_MONOTONIC time of the latest read, 0 if none
+    char names[IDLE_MAX_STATES][16]; // Such as "POLL", "C1E" or "C6"
+    int nstates;                 // Most states of any CPU
+    int open_fds, fd_limit;
+    int files;                   // Files read in the latest pass
+    unsigned long long pass_ns;  // Duration of the latest pass
+} g_idle;
+
+// Sampler thread (--sample-interval): reads /proc/stat much more often than frames are drawn
+// and hands the snapshots to the main thread through a single-producer/single-consumer ring.
+// The main thread keeps the newest peak_window slots as baselines for the sliding peak,
+// so no snapshot is ever copied between the threads.
+static struct
+{
+    int running;
+    int interval_us;
+    int cpu;                        // CPU the thread is pinned to, -1 if not pinned
+    int capacity;                   // Number of slots, a power of two
+    int peak_window;                // Samples per peak window
+    pthread_t thread;
+    struct coreusage_snapshot *slots;
+    unsigned long long *monotonic_ns; // Per slot
+    unsigned long long *realtime_ns;  // Per slot
+    struct coreusage *cu;           // The sampler's own engine, for /proc/stat only
+    uint64_t next;                  // First slot the main thread has not looked at
+    float *peak;                    // Highest usage per CPU id in any peak window since the last frame
+    float *window_usage;            // Scratch: usage per CPU id over one peak window
+    atomic_int stop;
+    _Alignas(64) _Atomic uint64_t head; // Slots written by the sampler
+    _Alignas(64) _Atomic uint64_t tail; // Oldest slot still held by the main thread
+} g_sampler = {.cpu = -1};
+
+// Frequency source of g_cu: COREUSAGE_FREQ_* (per-core cpufreq files kept open, or /proc/cpuinfo as fallback)
+static int g_freq_source = COREUSAGE_FREQ_NONE;
+static uint32_t *g_freq_khz = NULL; // Last frequency per CPU id in kHz
+
+// CPU topology, indexed by CPU id
+static int *g_cpu_package = NULL; // physical_package_id, -1 if unknown
+static int *g_cpu_core = NULL;    // core_id within the package, -1 if unknown
+static int *g_cpu_node = NULL;    // NUMA node, -1 if unknown
+static int *g_cpu_sibling = NULL; // Lowest CPU id on the same physical core (SMT siblings)
+static int g_num_packages = 0;
+
+// Aggregation of CPUs per physical core, NUMA node and socket
+enum
+{
+    GROUP_CORE,
+    GROUP_NODE,
+    GROUP_SOCKET,
+    GROUP_COUNT
+};
+static const char *const g_group_titles[GROUP_COUNT] = {"Core", "Node", "Socket"};
+struct cpu_groups
+{
+    int count;
+    int *key;                   // Core sibling, node id or package id of each group
+    int *of_cpu;                // Group index per CPU id, -1 if not assigned
+    char (*label)[GROUP_LABEL_LEN];
+    float *usage;               // Mean usage of the online members
+    float (*field_pct)[COREUSAGE_FIELDS]; // Mean share of every field of the online members
+    float *peak;                // Highest peak of the online members (sampler thread only)
+    unsigned long long *freq_khz; // Mean frequency of the online members
+    double *temp;               // Hottest member, NAN if none
+    float *wait_ns;             // Run delay per timeslice over the online members, NAN if unknown
+    unsigned long long *slices; // Timeslices of the online members in the last interval
+    int *online;                // Online members in the last sample
+};
+static struct cpu_groups g_groups[GROUP_COUNT];
+static int g_groups_dirty = 1; // Topology changed: rebuild the groups before the next use
+
+// Temperature inputs resolved once from libsensors
+enum
+{
+    TEMP_KIND_OTHER,
+    TEMP_KIND_PACKAGE,
+    TEMP_KIND_CORE
+};
+struct temp_sensor
+{
+    const sensors_chip_name *chip;
+    int subfeat; // Subfeature number of the TEMP_INPUT
+    int kind;
+    int package; // Package the sensor belongs to, -1 for TEMP_KIND_OTHER
+    int core;    // Core id for TEMP_KIND_CORE
+    char label[32];
+    double value; // Last reading in °C, NAN if the read failed
+    int input;    // Temperature input of g_cu reading the hwmon file, -1 to read it through libsensors
+};
+static struct temp_sensor g_temps[MAX_TEMP_SENSORS];
+static int g_num_temps = 0;
+static int g_temps_resolved = 0;
+static unsigned long long g_temps_resolved_ns = 0; // CLOCK_MONOTONIC time of the latest discovery
+static int *g_cpu_temp_sensor = NULL; // Index into g_temps per CPU id, -1 if none
+static double *g_cpu_temp = NULL;     // Temperature per CPU id in °C of the current sample, NAN if unknown
+
+// How the reads of a sample are issued (--io), passed on to g_cu: COREUSAGE_IO_*
+// auto takes io_uring if the kernel allows it and it is faster than pread() here.
+static const char *const g_io_mode_names[] = {[COREUSAGE_IO_AUTO] = "auto", [COREUSAGE_IO_URING] = "uring", [COREUSAGE_IO_SYNC] = "sync"};
+#define IO_MODE_COUNT (int)(sizeof(g_io_mode_names) / sizeof(g_io_mode_names[0]))
+static int g_io_mode = COREUSAGE_IO_AUTO;
 
 // Runtime-configurable settings
 static int g_bar_width = BAR_WIDTH;
 static int g_use_color = 1;
 static int g_show_temp = 1;
 static int g_interval_us = TIME_BETWEEN_SAMPLES_US;
+static int g_show_stats = 0;
+static int g_spark_width = SPARK_DEFAULT;
+
+// Phases of a frame whose duration is measured with --self-stats
+enum
+{
+    PHASE_STAT,   // The read batch of libcoreusage (/proc/stat or the sampler's snapshots, frequencies,
+                  // temperature inputs), computing the usage, the scheduler statistics and pressure,
+                  // in the irq and cgroup views also the interrupt counters resp. cpu.stat of every group
+    PHASE_TEMP,   // Sensors without an input file, mapping the temperatures onto the CPUs
+    PHASE_IDLE,   // Reading the cpuidle residency in the idle view
+    PHASE_TOP,    // Scanning the tasks for --top
+    PHASE_RENDER, // Drawing and writing the frame
+    PHASE_OUTPUT, // Records, ring file, shared memory and the export response
+    PHASE_COUNT
+};
+static const char *const g_phase_names[PHASE_COUNT] = {"stat", "temp", "idle", "top", "render", "output"};
+
+// Cost of coreusage itself (--self-stats): phase durations on CLOCK_MONOTONIC and the
+// process' own resource usage. Bucket k of a histogram counts durations below 2^k ns.
+static struct
+{
+    int enabled;
+    unsigned long long last_ns[PHASE_COUNT]; // Duration in the latest frame that ran the phase
+    unsigned long long sum_ns[PHASE_COUNT];
+    unsigned long long max_ns[PHASE_COUNT];
+    unsigned long long count[PHASE_COUNT];
+    unsigned long long hist[PHASE_COUNT][PHASE_BUCKETS];
+    // Totals at the latest sample; syscalls is -1 without task I/O accounting
+    unsigned long long wall_ns, cpu_ns, ctx_switches;
+    long long syscalls;
+    unsigned long long rss_kib;
+    // Increase over the last interval
+    double cpu_pct; // Own CPU time in percent of one CPU
+    unsigned long long d_ctx_switches;
+    long long d_syscalls;
+} g_self = {.syscalls = -1, .d_syscalls = -1};
+static struct proc_file g_self_io_file = PROC_SELF_FILE_INIT(SELF_IO_FILE);
+static struct proc_file g_self_stat_file = PROC_SELF_FILE_INIT(SELF_STAT_FILE);
+
+// A thread tracked by --top, keyed by its tid
+struct task
+{
+    int tid;
+    int pid;
+    int fd;                     // Kept-open /proc/<pid>/task/<tid>/stat, -1 beyond the fd limit
+    int cpu;                    // CPU the task last ran on
+    unsigned long long ticks;   // utime + stime at the last read
+    unsigned long long read_ns; // CLOCK_MONOTONIC time of the last read
+    float pct;                  // Usage between the last two reads in percent of one CPU, NAN before
+    char comm[16];
+};
+
+// Per-CPU task attribution (--top): an incremental scan of /proc with a budget of reads per
+// frame. The tasks live in a dense array with an open-addressing hash from tid to index.
+static struct
+{
+    int enabled;
+    int n;            // Tasks shown per busy CPU
+    int budget;       // Stat reads per frame
+    int proc_fd;      // /proc, all task files are opened relative to it
+    DIR *proc_dir;    // Walk through the pid directories, continued every frame
+    DIR *task_dir;    // Task directory of task_pid while it is listed, also across frames
+    int task_pid;
+    struct task *tasks;
+    int count;
+    int cap;
+    int *hash;        // Task index per slot, -1 for empty
+    size_t hash_mask;
+    int next;         // Next task to re-read
+    int open_fds;
+    int fd_limit;     // Kept-open task files allowed
+    long hz;
+    int *top;         // n task indices per CPU id, busiest first, -1 for none
+    char buf[1024];   // Reused for every stat read
+} g_top = {.n = TOP_DEFAULT, .budget = TOP_BUDGET_DEFAULT, .proc_fd = -1};
+
+// One line of /proc/interrupts or /proc/softirqs
+struct irq_line
+{
+    char label[16]; // Text before the colon: "24", "LOC", "NET_RX"
+    char name[24];  // Shown name: the device at the end of the line, else the label
+};
+
+// Per-CPU event counters of /proc/interrupts or /proc/softirqs, turned into rates per second
+// The file is kept open and parsed as a stream of columns. The column-to-CPU map is only
+// rebuilt when the header line changes, and the lines are matched by position, so a sample
+// costs one pass over the buffer unless an interrupt line appeared or went away.
+struct irq_table
+{
+    struct proc_file file; // fd -2 if the file does not exist
+    char *header;          // Header line the column map was built from
+    size_t header_len;
+    int *col_cpu;          // CPU id of every column
+    int ncols;
+    struct irq_line *lines;
+    unsigned long long *prev; // [line * ncols + column] Counts of the previous sample
+    int nlines;
+    int cap;
+    int top_n;
+    float *total;          // [cpu] Events per second of all lines
+    int *top;              // [cpu * top_n + k] Busiest line indices, -1 for none
+    float *top_rate;       // [cpu * top_n + k] Their events per second
+    unsigned long long last_ns; // CLOCK_MONOTONIC time of the previous sample
+    int valid;             // prev holds the counts of the previous sample
+    int rates_valid;       // The rates cover the interval since a recent previous sample
+};
+static struct irq_table g_interrupts = {.file = PROC_FILE_INIT(INTERRUPTS_FILE), .top_n = IRQ_TOP};
+static struct irq_table g_softirqs = {.file = PROC_FILE_INIT(SOFTIRQS_FILE), .top_n = SOFTIRQ_TOP};
+
+// A cgroup v2 group below the subtree of the cgroup view
+struct cgroup
+{
+    char *path;       // Relative to the subtree, "." for the subtree itself
+    char *cpuset;     // cpuset.cpus.effective (the parent's without the cpuset controller), NULL if unknown
+    unsigned char *cpus; // [cpu] The cpuset as a mask, parsed when it changes; NULL if unknown
+    int ncpus;        // CPUs in the cpuset
+    int fd;           // Kept-open cpu.stat, -1 beyond the fd limit
+    int wd;           // inotify watch of the directory, -1 if none
+    int seen;         // Cleared before a walk or sweep, groups still clear afterwards are dropped
+    unsigned long long usage_usec, throttled_usec; // Totals of the latest read
+    unsigned long long read_ns; // CLOCK_MONOTONIC time of the latest read, 0 before the first
+    float usage_pct;     // CPU time over the last interval in percent of one CPU, NAN before
+    float throttled_pct; // Throttled time over the last interval in percent of it, NAN before
+};
+
+// Per-cgroup usage for the cgroup view (--cgroup): the subtree is walked once, then kept
+// current by inotify and a slow rescan, so a sample only reads every group's cpu.stat.
+// Groups are found by path through an open-addressing hash.
+static struct
+{
+    const char *dir;  // Subtree: absolute or relative to CGROUP_ROOT
+    int root_fd;      // The subtree, all group paths are relative to it; -1 before the first walk, -2 if unavailable
+    int inotify_fd;   // -1 without inotify: changes are only found by the rescan
+    struct cgroup *groups;
+    int count;
+    int cap;
+    int *hash;        // Group index per slot, -1 for empty
+    size_t hash_mask;
+    int *wd_group;    // Group index per inotify watch descriptor, -1 for none
+    int wd_cap;
+    int open_fds;
+    int fd_limit;     // Kept-open cpu.stat files allowed
+    unsigned long long rescan_ns;
+    unsigned long long walked_ns; // Time of the latest full walk
+    int *order;       // Scratch for the busiest groups shown
+    char buf[1024];      // Reused for every file read
+} g_cgroup = {.dir = CGROUP_ROOT, .root_fd = -1, .inotify_fd = -1, .rescan_ns = CGROUP_RESCAN_DEFAULT_S * 1000000000ULL};
+
+// Rolling window of the last len usage samples of every possible CPU, in whole percent
+// Everything is allocated once; a new sample updates sum, min/max and p95 in O(1) amortized
+// instead of rescanning the window:
+// - min and max come from monotonic deques of ring slots (values only increase resp.
+//   decrease from front to back, so the front is the extreme of the window)
+// - p95 is a pointer into a per-CPU histogram that moves by the few bins a sample shifts it
+static struct
+{
+    int len;                 // Window length in samples, 0 if no history is kept
+    int count;               // Samples currently in the window
+    int next;                // Ring slot of the next sample
+    unsigned char *values;   // [cpu * len + slot]
+    uint16_t *min_q;         // [cpu * len + i] Deque of ring slots, ascending values
+    uint16_t *max_q;         // [cpu * len + i] Deque of ring slots, descending values
+    uint16_t *min_head, *min_size, *max_head, *max_size; // [cpu]
+    uint16_t *bins;          // [cpu * HISTORY_BINS + percent]
+    uint32_t *sum;           // [cpu]
+    unsigned char *p95;      // [cpu] Current 95th percentile
+    uint16_t *below;         // [cpu] Samples in the window below p95
+} g_hist;
+
+// Table layouts, cycled with 'v'
+enum
+{
+    VIEW_CPU,
+    VIEW_CORE,
+    VIEW_NODE,
+    VIEW_SOCKET,
+    VIEW_COMPACT,
+    VIEW_IRQ,
+    VIEW_CGROUP,
+    VIEW_IDLE,
+    VIEW_COUNT
+};
+static const char *const g_view_names[VIEW_COUNT] = {"cpu", "core", "node", "socket", "compact", "irq", "cgroup", "idle"};
+static int g_view = VIEW_CPU;
+
+// Contents of the load column: a bar stacked from the time fields, or their numbers
+enum
+{
+    BARS_STACKED,
+    BARS_FIELDS,
+    BARS_COUNT
+};
+static const char *const g_bars_names[BARS_COUNT] = {"stacked", "fields"};
+static int g_bars = BARS_STACKED;
+
+// Segments of the stacked bar, in drawing order; without colors the letter is drawn
+#define BAR_SEGMENT_COUNT 7
+static const struct
+{
+    int field;
+    int color;
+    const char *letter;
+    const char *name;
+} g_bar_segments[BAR_SEGMENT_COUNT] = {
+    {COREUSAGE_USER, FB_COLOR_GREEN, "u", "user"},
+    {COREUSAGE_NICE, FB_COLOR_CYAN, "n", "nice"},
+    {COREUSAGE_SYSTEM, FB_COLOR_BLUE, "s", "system"},
+    {COREUSAGE_IRQ, FB_COLOR_MAGENTA, "i", "irq"},
+    {COREUSAGE_SOFTIRQ, FB_COLOR_YELLOW, "q", "softirq"},
+    {COREUSAGE_STEAL, FB_COLOR_RED, "t", "steal"},
+    {COREUSAGE_IOWAIT, FB_COLOR_GRAY, "w", "iowait"},
+};
+
+// Columns of the numeric mode; guest includes guest_nice
+#define FIELD_COLUMN_COUNT 8
+#define FIELD_COLUMN_WIDTH 6
+static const int g_field_columns[FIELD_COLUMN_COUNT] = {COREUSAGE_USER, COREUSAGE_NICE, COREUSAGE_SYSTEM,
+                                                       COREUSAGE_IOWAIT, COREUSAGE_IRQ, COREUSAGE_SOFTIRQ,
+                                                       COREUSAGE_STEAL, COREUSAGE_GUEST};
+static const char *const g_field_titles[FIELD_COLUMN_COUNT] = {"user", "nice", "sys", "iow",
+                                                               "irq", "sirq", "steal", "guest"};
+
+// Output modes: the interactive table or one machine-readable record per sample
+enum
+{
+    OUTPUT_TUI,
+    OUTPUT_JSONL,
+    OUTPUT_CSV,
+    OUTPUT_BIN,
+    OUTPUT_COUNT
+};
+static const char *const g_output_names[OUTPUT_COUNT] = {"tui", "jsonl", "csv", "bin"};
+static int g_output = OUTPUT_TUI;
+static char *g_record_buf = NULL; // Reusable buffer for one machine-readable record
+static size_t g_record_cap = 0;
+
+// Ring file written by --record and read by --replay (host byte order)
+// The header occupies the first page, followed by capacity fixed-size slots.
+// Sample number k (counted from 0 since the ring was created) lives in slot k % capacity.
+struct ring_header
+{
+    char magic[8];            // RING_MAGIC
+    uint32_t version;         // RING_VERSION
+    uint32_t header_size;     // RING_HEADER_SIZE
+    uint32_t slot_size;       // Bytes per slot
+    uint32_t max_cpus;        // Possible CPUs of the recording host
+    uint32_t interval_us;     // Sample interval of the recorder
+    uint32_t freq_source;     // COREUSAGE_FREQ_* of the recorder
+    uint64_t capacity;        // Number of slots
+    _Atomic uint64_t head;    // Number of samples written so far
+};
+
+// Start of every slot, followed by the sample data (see ring_slot_layout())
+struct ring_slot
+{
+    _Atomic uint64_t seq; // Sample number + 1 once the slot is complete, 0 while it is written
+    uint64_t monotonic_ns;
+    uint64_t realtime_ns;
+};
+
+static struct
+{
+    int fd;
+    unsigned char *map;
+    size_t map_size;
+    struct ring_header *hdr;
+    size_t freq_offset; // Offsets of the frequency and temperature arrays within a slot
+    size_t temp_offset;
+} g_ring = {.fd = -1};
+static const char *g_record_path = NULL;
+
+// Shared-memory segment published by --daemon or read by --attach (see coreusage_shm.h)
+static struct
+{
+    int fd;
+    int daemon;              // 1 if this process publishes the segment
+    void *map;
+    size_t size;
+    const char *name;
+    unsigned char *copy;     // --attach: consistent copy of the whole segment
+    uint64_t samples;        // --attach: sample counter of the last copy used
+} g_shm = {.fd = -1};
+static const char *g_replay_path = NULL;
+
+// One connection to the --export endpoint
+struct export_client
+{
+    int fd;                      // -1 for a free slot
+    int buf;                     // Response buffer being sent, -1 for none
+    const char *out;             // Response being sent, NULL while the request is read
+    size_t out_len;
+    size_t sent;
+    size_t req_len;
+    unsigned long long since_ns; // CLOCK_MONOTONIC time of accept()
+    char req[EXPORT_REQUEST_MAX];
+};
+
+// OpenMetrics endpoint of --export, served from the main loop without blocking
+// The response is rendered once per sample; a scrape only writes it out. There are two
+// buffers, so a new sample never overwrites a response that is still being sent.
+static struct
+{
+    int fd;                 // Listening socket
+    const char *unix_path;  // Socket file to remove on exit
+    char *buf[2];
+    size_t cap;
+    const char *resp[2];    // Complete HTTP response within buf
+    size_t resp_len[2];
+    int users[2];           // Connections still sending from each buffer
+    int cur;                // Buffer with the latest response, -1 before the first sample
+    struct export_client client[EXPORT_MAX_CLIENTS];
+} g_export = {.fd = -1, .cur = -1};
+
+// Replay position and controls
+static struct
+{
+    uint64_t pos;   // Sample number shown
+    int paused;
+    int speed_log2; // Replay speed as a power of two
+    int step;       // Samples advanced per timer tick
+} g_replay = {.step = 1};
+
+// Layout shared by the rows of one table
+struct row_layout
+{
+    int pad;         // Left padding that centers the table
+    int label_width; // Width of the first column
+    int has_temps;   // 1 if the rows carry a temperature column
+    int load_width;  // Width of the bar or of the numeric field columns
+    int stats_width; // Width of the statistics and sparkline columns, 0 if not shown
+    int peak_width;  // Width of the peak column, 0 without a sampler thread
+    int wait_width;  // Width of the run delay column, 0 without /proc/schedstat
+};
+
+// Appends bytes to the frame output buffer (grown as needed, reused across frames)
+static int fb_out(const char *data, size_t n)
+{
+    if (g_fb.out_len + n > g_fb.out_cap)
+    {
+        size_t cap = g_fb.out_cap ? g_fb.out_cap : FB_OUT_INITIAL;
+        while (cap < g_fb.out_len + n)
+            cap *= 2;
+        char *nb = realloc(g_fb.out, cap);
+        if (!nb)
+            return -1;
+        g_fb.out = nb;
+        g_fb.out_cap = cap;
+    }
+    memcpy(g_fb.out + g_fb.out_len, data, n);
+    g_fb.out_len += n;
+    return 0;
+}
+
+// Appends a cursor-move sequence for the 0-based (row, col) without stdio formatting
+static void fb_out_cursor(int row, int col)
+{
+    char seq[24];
+    char *p = seq + sizeof(seq);
+    *--p = 'H';
+    for (unsigned v = (unsigned)col + 1; ; v /= 10)
+    {
+        *--p = (char)('0' + v % 10);
+        if (v < 10)
+            break;
+    }
+    *--p = ';';
+    for (unsigned v = (unsigned)row + 1; ; v /= 10)
+    {
+        *--p = (char)('0' + v % 10);
+        if (v < 10)
+            break;
+    }
+    *--p = '[';
+    *--p = '\033';
+    fb_out(p, (size_t)(seq + sizeof(seq) - p));
+}
+
+// Writes a buffer completely, waiting if the terminal cannot take it all at once
+// stdout may share the O_NONBLOCK file description with the terminal's stdin.
+static int write_all(int fd, const char *data, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t w = write(fd, data, n);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        data += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+// Sets the frame size and forces a full redraw of the next frame
+// On a TTY the size follows the terminal; otherwise rows grow on demand.
+static int fb_resize(int rows, int cols)
+{
+    size_t n = (size_t)rows * (size_t)cols;
+    struct fb_cell *cur = realloc(g_fb.cur, n * sizeof(*cur));
+    if (!cur)
+        return -1;
+    g_fb.cur = cur;
+    struct fb_cell *prev = realloc(g_fb.prev, n * sizeof(*prev));
+    if (!prev)
+        return -1;
+    g_fb.prev = prev;
+    for (size_t i = 0; i < n; ++i)
+        g_fb.cur[i] = g_fb.prev[i] = FB_BLANK;
+    g_fb.rows = rows;
+    g_fb.cols = cols;
+    g_fb.full_redraw = 1;
+    return 0;
+}
+
+// Starts a new frame: all cells become blank
+static void fb_begin_frame(void)
+{
+    size_t n = (size_t)g_fb.rows * (size_t)g_fb.cols;
+    for (size_t i = 0; i < n; ++i)
+        g_fb.cur[i] = FB_BLANK;
+    g_fb.used_rows = 0;
+}
+
+// Makes sure row exists; only grows when not bound to a terminal. Returns 0 if usable
+static int fb_ensure_row(int row)
+{
+    if (row < 0)
+        return -1;
+    if (row >= g_fb.rows)
+    {
+        if (g_fb.fixed)
+            return -1;
+        int old_rows = g_fb.rows;
+        int rows = old_rows ? old_rows : FB_PIPE_ROWS;
+        while (rows <= row)
+            rows *= 2;
+        struct fb_cell *cur = realloc(g_fb.cur, (size_t)rows * (size_t)g_fb.cols * sizeof(*cur));
+        if (!cur)
+            return -1;
+        g_fb.cur = cur;
+        for (size_t i = (size_t)old_rows * (size_t)g_fb.cols; i < (size_t)rows * (size_t)g_fb.cols; ++i)
+            g_fb.cur[i] = FB_BLANK;
+        g_fb.rows = rows;
+    }
+    if (row >= g_fb.used_rows)
+        g_fb.used_rows = row + 1;
+    return 0;
+}
+
+// Writes a UTF-8 string into the frame at (row, col); every code point takes one column
+// Content outside the frame is clipped. Returns the number of columns the string spans
+static int fb_puts(int row, int col, int color, const char *s)
+{
+    int usable = fb_ensure_row(row) == 0;
+    int w = 0;
+    while (*s)
+    {
+        unsigned char c = (unsigned char)*s;
+        int n = c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+        for (int k = 1; k < n; ++k)
+        {
+            if (s[k] == '\0')
+            {
+                n = k;
+                break;
+            }
+        }
+        int x = col + w;
+        if (usable && x >= 0 && x < g_fb.cols)
+        {
+            struct fb_cell *cell = &g_fb.cur[(size_t)row * (size_t)g_fb.cols + (size_t)x];
+            memcpy(cell->ch, s, (size_t)n);
+            cell->len = (unsigned char)n;
+            cell->color = (unsigned char)color;
+        }
+        s += n;
+        w++;
+    }
+    return w;
+}
+
+// Repeats one glyph n times starting at (row, col)
+static int fb_fill(int row, int col, int n, int color, const char *glyph)
+{
+    for (int i = 0; i < n; ++i)
+        fb_puts(row, col + i, color, glyph);
+    return n > 0 ? n : 0;
+}
+
+// Formats a string and writes it into the frame. Returns the number of columns used
+static int fb_printf(int row, int col, int color, const char *fmt, ...)
+{
+    char buf[512];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (n < 0)
+        return 0;
+    return fb_puts(row, col, color, buf);
+}
+
+// Returns the display width of a UTF-8 string (one column per code point)
+static int utf8_width(const char *s)
+{
+    int w = 0;
+    for (; *s; ++s)
+        w += ((unsigned char)*s & 0xC0) != 0x80;
+    return w;
+}
+
+// Returns the left padding that centers a block of the given width
+static int fb_center_pad(int width)
+{
+    int pad = (g_fb.cols - width) / 2;
+    return pad > 0 ? pad : 0;
+}
+
+// Emits the frame: on a TTY only the cells that differ from the previous frame are
+// written, using cursor moves; otherwise the whole frame is written as plain lines.
+// Everything goes out in a single write(). Returns 0 on success
+static int fb_flush(void)
+{
+    g_fb.out_len = 0;
+    if (!g_fb.fixed)
+    {
+        for (int r = 0; r < g_fb.used_rows; ++r)
+        {
+            const struct fb_cell *row = &g_fb.cur[(size_t)r * (size_t)g_fb.cols];
+            int last = g_fb.cols;
+            while (last > 0 && row[last - 1].len == 1 && row[last - 1].ch[0] == ' ')
+                last--;
+            for (int c = 0; c < last; ++c)
+                fb_out(row[c].ch, row[c].len);
+            fb_out("\n", 1);
+        }
+        return write_all(STDOUT_FILENO, g_fb.out, g_fb.out_len);
+    }
+    if (g_fb.full_redraw)
+    {
+        // Screen content is unknown: clear it and compare against blank cells
+        fb_out("\033[?25l\033[H\033[2J", 13);
+        size_t n = (size_t)g_fb.rows * (size_t)g_fb.cols;
+        for (size_t i = 0; i < n; ++i)
+            g_fb.prev[i] = FB_BLANK;
+        g_fb.full_redraw = 0;
+    }
+    int cur_row = -1, cur_col = -1, cur_color = FB_COLOR_DEFAULT;
+    for (int r = 0; r < g_fb.rows; ++r)
+    {
+        for (int c = 0; c < g_fb.cols; ++c)
+        {
+            size_t i = (size_t)r * (size_t)g_fb.cols + (size_t)c;
+            struct fb_cell *cell = &g_fb.cur[i];
+            if (memcmp(cell, &g_fb.prev[i], sizeof(*cell)) == 0)
+                continue;
+            if (r == cur_row && c > cur_col && c - cur_col <= FB_MAX_REWRITE_GAP)
+            {
+                // Re-sending a few unchanged cells is shorter than a cursor move
+                for (int k = cur_col; k < c; ++k)
+                {
+                    const struct fb_cell *same = &g_fb.cur[(size_t)r * (size_t)g_fb.cols + (size_t)k];
+                    int color = g_use_color ? same->color : FB_COLOR_DEFAULT;
+                    if (color != cur_color)
+                    {
+                        fb_out(g_fb_color_seq[color], strlen(g_fb_color_seq[color]));
+                        cur_color = color;
+                    }
+                    fb_out(same->ch, same->len);
+                }
+            }
+            else if (r != cur_row || c != cur_col)
+                fb_out_cursor(r, c);
+            int color = g_use_color ? cell->color : FB_COLOR_DEFAULT;
+            if (color != cur_color)
+            {
+                fb_out(g_fb_color_seq[color], strlen(g_fb_color_seq[color]));
+                cur_color = color;
+            }
+            fb_out(cell->ch, cell->len);
+            g_fb.prev[i] = *cell;
+            cur_row = r;
+            cur_col = c + 1;
+        }
+    }
+    if (cur_color != FB_COLOR_DEFAULT)
+        fb_out(COLOR_RESET, strlen(COLOR_RESET));
+    if (g_fb.out_len == 0)
+        return 0;
+    return write_all(STDOUT_FILENO, g_fb.out, g_fb.out_len);
+}
+
+// Leaves the screen in a usable state: cursor below the frame and visible again
+static void fb_finish(void)
+{
+    if (g_fb.fixed && g_fb.rows > 0)
+    {
+        g_fb.out_len = 0;
+        int row = g_fb.used_rows < g_fb.rows ? g_fb.used_rows : g_fb.rows - 1;
+        fb_out_cursor(row, 0);
+        fb_out("\033[?25h", 6);
+        write_all(STDOUT_FILENO, g_fb.out, g_fb.out_len);
+    }
+    free(g_fb.cur);
+    free(g_fb.prev);
+    free(g_fb.out);
+    memset(&g_fb, 0, sizeof(g_fb));
+}
+
+// Queries the terminal size and resizes the frame accordingly
+// Called once at startup and then only on SIGWINCH.
+static void update_terminal_size(void)
+{
+    struct winsize w;
+    if (g_fb.fixed && ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0 && w.ws_col > 0 && w.ws_row > 0)
+        fb_resize(w.ws_row, w.ws_col);
+    else if (g_fb.fixed)
+        fb_resize(TERM_HEIGHT_FALLBACK, TERM_WIDTH_FALLBACK);
+    else
+        fb_resize(FB_PIPE_ROWS, TERM_WIDTH_FALLBACK);
+}
+
+// Helper function: Draw a colored progress bar for CPU usage at (row, col)
+// Draws a horizontal bar with color depending on the usage percentage. Returns the width
+int print_bar(int row, int col, float percent)
+{
+    // Calculate how many bar segments should be filled
+    int filled = (int)(percent * g_bar_width / 100.0f);
+    if (filled < 0)
+        filled = 0;
+    if (filled > g_bar_width)
+        filled = g_bar_width;
+    int color;
+    // Choose color based on usage percentage
+    if (percent < 50)
+        color = FB_COLOR_GREEN;
+    else if (percent < 80)
+        color = FB_COLOR_YELLOW;
+    else
+        color = FB_COLOR_RED;
+    fb_puts(row, col, color, "[");
+    fb_fill(row, col + 1, filled, color, "█");
+    fb_fill(row, col + 1 + filled, g_bar_width - filled, color, " ");
+    fb_puts(row, col + 1 + g_bar_width, color, "]");
+    return g_bar_width + 2;
+}
+
+// Helper function: Draw a formatted line centered in the frame at the given row
+int fb_centered(int row, int color, const char *fmt, ...)
+{
+    char buf[512];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (n < 0)
+        return -1;
+    fb_puts(row, fb_center_pad(utf8_width(buf)), color, buf);
+    return 0;
+}
+
+// Opens a /proc or /sys path read-only, below the --sysroot directory if one is set
+// openat() resolves the path relative to the root directory, so no path strings are built.
+static int open_sys_path(const char *path, int flags)
+{
+    if (g_root_fd == AT_FDCWD)
+        return open(path, O_RDONLY | O_CLOEXEC | flags);
+    return openat(g_root_fd, path + (path[0] == '/'), O_RDONLY | O_CLOEXEC | flags);
+}
+
+// Reads the complete contents of a kept-open procfs/sysfs file into its buffer
+// The file is opened on first use and re-read from offset 0 with pread() on every call;
+// the buffer grows as needed and is reused. Returns the number of bytes read, or -1 on error
+static ssize_t proc_file_read(struct proc_file *pf)
+{
+    if (pf->fd < 0)
+    {
+        pf->fd = pf->own ? open(pf->path, O_RDONLY | O_CLOEXEC) : open_sys_path(pf->path, 0);
+        if (pf->fd < 0)
+        {
+            fprintf(stderr, "Error: Could not open %s: %s\n", pf->path, strerror(errno));
+            return -1;
+        }
+    }
+    if (!pf->buf)
+    {
+        pf->buf = malloc(PROC_BUF_SIZE);
+        if (!pf->buf)
+        {
+            fprintf(stderr, "Error: Could not allocate buffer for %s\n", pf->path);
+            return -1;
+        }
+        pf->size = PROC_BUF_SIZE;
+    }
+    size_t len = 0;
+    for (;;)
+    {
+        ssize_t n = pread(pf->fd, pf->buf + len, pf->size - len, (off_t)len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error: Could not read %s: %s\n", pf->path, strerror(errno));
+            return -1;
+        }
+        if (n == 0)
+            break;
+        len += (size_t)n;
+        if (len == pf->size)
+        {
+            // Buffer is full: grow it and continue reading (happens at most a few times)
+            char *nb = realloc(pf->buf, pf->size * 2);
+            if (!nb)
+            {
+                fprintf(stderr, "Error: Could not grow buffer for %s\n", pf->path);
+                return -1;
+            }
+            pf->buf = nb;
+            pf->size *= 2;
+        }
+    }
+    return (ssize_t)len;
+}
+
+// Closes a kept-open file and releases its buffer
+static void proc_file_close(struct proc_file *pf)
+{
+    if (pf->fd >= 0)
+        close(pf->fd);
+    pf->fd = -1;
+    free(pf->buf);
+    pf->buf = NULL;
+    pf->size = 0;
+}
+
+// Allocates one snapshot as a single contiguous block of per-field arrays
+static int alloc_snapshot(struct coreusage_snapshot *snap, int n)
+{
+    void *block = malloc(coreusage_snapshot_size(n));
+    if (!block)
+        return -1;
+    coreusage_snapshot_init(snap, block, n);
+    return 0;
+}
+
+// Sizes all per-CPU storage for max_cpus possible CPUs
+// Called once at startup; nothing is reallocated while sampling.
+static int alloc_cpu_arrays(int max_cpus)
+{
+    g_max_cpus = max_cpus;
+    size_t n = (size_t)g_max_cpus;
+    if (alloc_snapshot(&g_snap[0], g_max_cpus) != 0 || alloc_snapshot(&g_snap[1], g_max_cpus) != 0)
+        return -1;
+    g_cpu_ids = calloc(n, sizeof(*g_cpu_ids));
+    g_usage = calloc(n, sizeof(*g_usage));
+    g_field_pct[0] = calloc(n * COREUSAGE_FIELDS, sizeof(*g_field_pct[0]));
+    for (int f = 1; g_field_pct[0] && f < COREUSAGE_FIELDS; ++f)
+        g_field_pct[f] = g_field_pct[0] + n * (size_t)f;
+    g_freq_khz = calloc(n, sizeof(*g_freq_khz));
+    g_cpu_package = calloc(n, sizeof(*g_cpu_package));
+    g_cpu_core = calloc(n, sizeof(*g_cpu_core));
+    g_cpu_temp_sensor = calloc(n, sizeof(*g_cpu_temp_sensor));
+    g_cpu_temp = calloc(n, sizeof(*g_cpu_temp));
+    g_cpu_node = calloc(n, sizeof(*g_cpu_node));
+    g_cpu_sibling = calloc(n, sizeof(*g_cpu_sibling));
+    g_sched.seen = calloc(n, sizeof(*g_sched.seen));
+    g_sched.delay_ns = calloc(n, sizeof(*g_sched.delay_ns));
+    g_sched.slices = calloc(n, sizeof(*g_sched.slices));
+    g_sched.d_delay_ns = calloc(n, sizeof(*g_sched.d_delay_ns));
+    g_sched.d_slices = calloc(n, sizeof(*g_sched.d_slices));
+    g_sched.wait_ns = calloc(n, sizeof(*g_sched.wait_ns));
+    if (!g_cpu_ids || !g_usage || !g_field_pct[0] || !g_freq_khz || !g_cpu_package || !g_cpu_core ||
+        !g_cpu_temp_sensor || !g_cpu_temp || !g_cpu_node || !g_cpu_sibling || !g_sched.seen || !g_sched.delay_ns || !g_sched.slices ||
+        !g_sched.d_delay_ns || !g_sched.d_slices || !g_sched.wait_ns)
+        return -1;
+    for (size_t i = 0; i < n; ++i)
+    {
+        g_cpu_package[i] = -1;
+        g_cpu_core[i] = -1;
+        g_cpu_temp_sensor[i] = -1;
+        g_cpu_temp[i] = NAN;
+        g_cpu_node[i] = -1;
+        g_cpu_sibling[i] = (int)i;
+        g_sched.wait_ns[i] = NAN;
+    }
+    // There can never be more groups than CPUs
+    for (int k = 0; k < GROUP_COUNT; ++k)
+    {
+        struct cpu_groups *g = &g_groups[k];
+        g->key = calloc(n, sizeof(*g->key));
+        g->of_cpu = calloc(n, sizeof(*g->of_cpu));
+        g->label = calloc(n, sizeof(*g->label));
+        g->usage = calloc(n, sizeof(*g->usage));
+        g->field_pct = calloc(n, sizeof(*g->field_pct));
+        g->peak = calloc(n, sizeof(*g->peak));
+        g->freq_khz = calloc(n, sizeof(*g->freq_khz));
+        g->temp = calloc(n, sizeof(*g->temp));
+        g->wait_ns = calloc(n, sizeof(*g->wait_ns));
+        g->slices = calloc(n, sizeof(*g->slices));
+        g->online = calloc(n, sizeof(*g->online));
+        if (!g->key || !g->of_cpu || !g->label || !g->usage || !g->field_pct || !g->peak || !g->freq_khz || !g->temp || !g->wait_ns ||
+            !g->slices || !g->online)
+            return -1;
+    }
+    return 0;
+}
+
+// Releases all per-CPU storage
+static void free_cpu_arrays(void)
+{
+    free(g_snap[0].field[0]);
+    free(g_snap[1].field[0]);
+    memset(g_snap, 0, sizeof(g_snap));
+    free(g_cpu_ids);
+    free(g_usage);
+    free(g_field_pct[0]);
+    memset(g_field_pct, 0, sizeof(g_field_pct));
+    free(g_freq_khz);
+    free(g_cpu_package);
+    free(g_cpu_core);
+    free(g_cpu_temp_sensor);
+    free(g_cpu_temp);
+    g_cpu_temp = NULL;
+    free(g_cpu_node);
+    free(g_cpu_sibling);
+    free(g_sched.seen);
+    free(g_sched.delay_ns);
+    free(g_sched.slices);
+    free(g_sched.d_delay_ns);
+    free(g_sched.d_slices);
+    free(g_sched.wait_ns);
+    memset(&g_sched, 0, sizeof(g_sched));
+    for (int k = 0; k < GROUP_COUNT; ++k)
+    {
+        struct cpu_groups *g = &g_groups[k];
+        free(g->key);
+        free(g->of_cpu);
+        free(g->label);
+        free(g->usage);
+        free(g->field_pct);
+        free(g->peak);
+        free(g->freq_khz);
+        free(g->temp);
+        free(g->wait_ns);
+        free(g->slices);
+        free(g->online);
+    }
+    memset(g_groups, 0, sizeof(g_groups));
+    g_cpu_ids = g_cpu_package = g_cpu_core = g_cpu_temp_sensor = g_cpu_node = g_cpu_sibling = NULL;
+    g_usage = NULL;
+    g_freq_khz = NULL;
+}
+
+// Reads a single integer from a small sysfs file, returns 0 on success
+static int read_sysfs_long(const char *path, long *out)
+{
+    int fd = open_sys_path(path, 0);
+    if (fd < 0)
+        return -1;
+    char buf[32];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    char *endp;
+    long v = strtol(buf, &endp, 10);
+    if (endp == buf)
+        return -1;
+    *out = v;
+    return 0;
+}
+
+// Reads package and core id of one CPU from sysfs (-1 when unknown)
+static void read_cpu_topology(int cpu_id)
+{
+    char path[128];
+    long v;
+    snprintf(path, sizeof(path), CPU_TOPOLOGY_FMT, cpu_id, "physical_package_id");
+    g_cpu_package[cpu_id] = read_sysfs_long(path, &v) == 0 ? (int)v : -1;
+    snprintf(path, sizeof(path), CPU_TOPOLOGY_FMT, cpu_id, "core_id");
+    g_cpu_core[cpu_id] = read_sysfs_long(path, &v) == 0 ? (int)v : -1;
+    // The sibling list starts with the lowest CPU id of the physical core ("0,64" or "0-1")
+    snprintf(path, sizeof(path), CPU_TOPOLOGY_FMT, cpu_id, "thread_siblings_list");
+    g_cpu_sibling[cpu_id] = read_sysfs_long(path, &v) == 0 ? (int)v : cpu_id;
+    if (g_cpu_package[cpu_id] >= g_num_packages)
+        g_num_packages = g_cpu_package[cpu_id] + 1;
+}
+
+static unsigned long long timespec_ns(const struct timespec *ts)
+{
+    return (unsigned long long)ts->tv_sec * 1000000000ULL + (unsigned long long)ts->tv_nsec;
+}
+
+// Closes the kept-open temperature inputs and empties the sensor table
+static void close_temp_inputs(void)
+{
+    if (g_cu)
+        coreusage_clear_temps(g_cu);
+    g_num_temps = 0;
+}
+
+// Adds one TEMP_INPUT subfeature to the sensor table
+static struct temp_sensor *add_temp_sensor(const sensors_chip_name *chip, const sensors_feature *feature)
+{
+    if (g_num_temps >= MAX_TEMP_SENSORS)
+        return NULL;
+    const sensors_subfeature *subf = sensors_get_subfeature(chip, feature, SENSORS_SUBFEATURE_TEMP_INPUT);
+    if (!subf)
+        return NULL;
+    struct temp_sensor *t = &g_temps[g_num_temps++];
+    t->chip = chip;
+    t->subfeat = subf->number;
+    t->kind = TEMP_KIND_OTHER;
+    t->package = -1;
+    t->core = -1;
+    t->value = NAN;
+    char *label = sensors_get_label(chip, feature);
+    snprintf(t->label, sizeof(t->label), "%s", label ? label : "Temp");
+    free(label);
+    // The input is read by g_cu so it can join the read batch; libsensors reads the same file
+    char path[PATH_MAX];
+    int npath = chip->path ? snprintf(path, sizeof(path), "%s/%s", chip->path, subf->name) : -1;
+    t->input = npath > 0 && npath < (int)sizeof(path) ? coreusage_add_temp(g_cu, path) : -1;
+    if (t->input < 0)
+        t->input = -1;
+    return t;
+}
+
+// Resolves all temperature inputs once and maps them onto the CPUs
+// coretemp provides "Package id N" and "Core N" sensors per package; k10temp provides
+// one Tdie/Tctl reading per package. Everything else is kept only as a fallback.
+// Called at startup and again only after a sensor read failed.
+static void resolve_cpu_temps(void)
+{
+    const sensors_chip_name *chip;
+    int chip_nr = 0;
+    int k10_chips = 0;
+    close_temp_inputs();
+    // Count k10temp chips first so they can be spread over the packages
+    while ((chip = sensors_get_detected_chips(NULL, &chip_nr)) != NULL)
+    {
+        if (chip->prefix && strcmp(chip->prefix, "k10temp") == 0)
+            k10_chips++;
+    }
+    chip_nr = 0;
+    int k10_index = 0;
+    while ((chip = sensors_get_detected_chips(NULL, &chip_nr)) != NULL)
+    {
+        int is_coretemp = chip->prefix && strcmp(chip->prefix, "coretemp") == 0;
+        int is_k10temp = chip->prefix && strcmp(chip->prefix, "k10temp") == 0;
+        int first = g_num_temps;
+        int chip_package = -1;
+        const sensors_feature *feature;
+        int feat_nr = 0;
+        while ((feature = sensors_get_features(chip, &feat_nr)) != NULL)
+        {
+            if (feature->type != SENSORS_FEATURE_TEMP)
+                continue;
+            struct temp_sensor *t = add_temp_sensor(chip, feature);
+            if (!t)
+                continue;
+            int id;
+            if (is_coretemp && sscanf(t->label, "Package id %d", &id) == 1)
+            {
+                t->kind = TEMP_KIND_PACKAGE;
+                chip_package = id;
+            }
+            else if (is_coretemp && sscanf(t->label, "Core %d", &id) == 1)
+            {
+                t->kind = TEMP_KIND_CORE;
+                t->core = id;
+            }
+            else if (is_k10temp && (strcmp(t->label, "Tdie") == 0 || strcmp(t->label, "Tctl") == 0))
+            {
+                // Prefer Tdie: Tctl carries a cooling offset on some models
+                int have_tdie = 0;
+                for (int j = first; j < g_num_temps - 1; ++j)
+                    have_tdie |= g_temps[j].kind == TEMP_KIND_PACKAGE;
+                if (!have_tdie || strcmp(t->label, "Tdie") == 0)
+                {
+                    for (int j = first; j < g_num_temps - 1; ++j)
+                        if (g_temps[j].kind == TEMP_KIND_PACKAGE)
+                            g_temps[j].kind = TEMP_KIND_OTHER;
+                    t->kind = TEMP_KIND_PACKAGE;
+                }
+            }
+        }
+        if (is_coretemp && chip_package < 0)
+            chip_package = chip->addr; // coretemp-isa-000N belongs to package N
+        if (is_k10temp)
+        {
+            int packages = g_num_packages > 0 ? g_num_packages : 1;
+            chip_package = k10_index++ * packages / k10_chips;
+        }
+        for (int j = first; j < g_num_temps; ++j)
+        {
+            if (g_temps[j].kind != TEMP_KIND_OTHER)
+                g_temps[j].package = chip_package;
+        }
+    }
+    // Map every CPU to its core sensor, or to its package sensor if there is none
+    for (int i = 0; i < g_num_cpus; ++i)
+    {
+        int cpu_id = g_cpu_ids[i];
+        int best = -1;
+        for (int j = 0; j < g_num_temps; ++j)
+        {
+            const struct temp_sensor *t = &g_temps[j];
+            if (t->package < 0 || t->package != g_cpu_package[cpu_id])
+                continue;
+            if (t->kind == TEMP_KIND_CORE && t->core == g_cpu_core[cpu_id])
+            {
+                best = j;
+                break;
+            }
+            if (t->kind == TEMP_KIND_PACKAGE && best < 0)
+                best = j;
+        }
+        g_cpu_temp_sensor[cpu_id] = best;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    g_temps_resolved_ns = timespec_ns(&ts);
+    g_temps_resolved = 1;
+}
+
+// Takes the temperatures the read batch got into inputs, reads the sensors without an input
+// file through libsensors, then maps them onto the CPUs
+// A failed read of a sensor mapped to a CPU triggers a new discovery on the next sample, at
+// most every TEMP_RESOLVE_MIN_NS; sensors no CPU uses may keep failing.
+static void finish_cpu_temps(const double inputs[])
+{
+    for (int j = 0; j < g_num_temps; ++j)
+    {
+        struct temp_sensor *t = &g_temps[j];
+        if (t->input >= 0)
+            t->value = inputs[t->input];
+        else if (sensors_get_value(t->chip, t->subfeat, &t->value) != 0)
+            t->value = NAN;
+    }
+    int lost = 0;
+    for (int i = 0; i < g_num_cpus; ++i)
+    {
+        int cpu_id = g_cpu_ids[i];
+        int j = g_cpu_temp_sensor[cpu_id];
+        g_cpu_temp[cpu_id] = j >= 0 ? g_temps[j].value : NAN;
+        lost |= j >= 0 && isnan(g_temps[j].value);
+    }
+    if (lost)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        if (timespec_ns(&ts) - g_temps_resolved_ns >= TEMP_RESOLVE_MIN_NS)
+            g_temps_resolved = 0;
+    }
+}
+
+// Reads a sample through g_cu as one batch: /proc/stat into the older snapshot slot (if stat
+// is set), the frequencies and, if inputs is not NULL, the temperature inputs for
+// finish_cpu_temps(). The previous sample stays untouched and serves as the baseline for the
+// deltas, so every frame costs exactly one read of /proc/stat. Returns -1 if it failed.
+static int read_sample(int stat, double inputs[])
+{
+    if (inputs && !g_temps_resolved)
+        resolve_cpu_temps();
+    int next = g_snap_cur ^ 1;
+    struct coreusage_read r = {
+        .snap = stat ? &g_snap[next] : NULL,
+        .cpu_ids = g_cpu_ids,
+        .online = g_snap[g_snap_cur].online,
+        .freq_khz = g_freq_khz,
+        .temp = inputs,
+    };
+    if (coreusage_read(g_cu, &r) != 0)
+        return -1;
+    if (stat)
+    {
+        g_num_cpus = r.num_online;
+        g_snap_cur = next;
+    }
+    return 0;
+}
+
+// Reads all temperature inputs (and the frequencies) without a new /proc/stat sample
+static void update_cpu_temps(void)
+{
+    double inputs[MAX_TEMP_SENSORS];
+    if (read_sample(0, inputs) == 0)
+        finish_cpu_temps(inputs);
+}
+
+// Parses a cpulist such as "0-3,8,10-11" and sets the listed CPUs in mask (n entries)
+static void parse_cpulist(const char *p, const char *end, unsigned char mask[], int n)
+{
+    unsigned long long first, last;
+    while (p < end && scan_ull(&p, end, &first))
+    {
+        last = first;
+        if (p < end && *p == '-')
+        {
+            p++;
+            if (!scan_ull(&p, end, &last))
+                last = first;
+        }
+        for (unsigned long long c = first; c <= last && c < (unsigned long long)n; ++c)
+            mask[c] = 1;
+        if (p < end && *p == ',')
+            p++;
+    }
+}
+
+// Reads the CPUs of every NUMA node from /sys/devices/system/node/node*/cpulist
+static void read_cpu_nodes(void)
+{
+    for (int cpu_id = 0; cpu_id < g_max_cpus; ++cpu_id)
+        g_cpu_node[cpu_id] = -1;
+    int dir_fd = open_sys_path(NODE_DIR, O_DIRECTORY);
+    DIR *dir = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
+    if (!dir)
+    {
+        if (dir_fd >= 0)
+            close(dir_fd);
+        return;
+    }
+    unsigned char *mask = malloc((size_t)g_max_cpus);
+    struct dirent *de;
+    while (mask && (de = readdir(dir)) != NULL)
+    {
+        if (strncmp(de->d_name, "node", 4) != 0 || !isdigit((unsigned char)de->d_name[4]))
+            continue;
+        int node = atoi(de->d_name + 4);
+        char path[300];
+        snprintf(path, sizeof(path), "%s/cpulist", de->d_name);
+        int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        char buf[4096];
+        ssize_t n = read(fd, buf, sizeof(buf));
+        close(fd);
+        if (n <= 0)
+            continue;
+        memset(mask, 0, (size_t)g_max_cpus);
+        parse_cpulist(buf, buf + n, mask, g_max_cpus);
+        for (int cpu_id = 0; cpu_id < g_max_cpus; ++cpu_id)
+            if (mask[cpu_id])
+                g_cpu_node[cpu_id] = node;
+    }
+    free(mask);
+    closedir(dir);
+}
+
+// Returns the key a CPU is grouped by
+static int cpu_group_key(int kind, int cpu_id)
+{
+    switch (kind)
+    {
+    case GROUP_CORE:
+        return g_cpu_sibling[cpu_id];
+    case GROUP_NODE:
+        return g_cpu_node[cpu_id];
+    default:
+        return g_cpu_package[cpu_id];
+    }
+}
+
+// Assigns every online CPU to its physical core, NUMA node and socket group
+// Runs at startup and after CPUs came online, never per frame.
+static void build_cpu_groups(void)
+{
+    read_cpu_nodes();
+    for (int kind = 0; kind < GROUP_COUNT; ++kind)
+    {
+        struct cpu_groups *g = &g_groups[kind];
+        g->count = 0;
+        for (int cpu_id = 0; cpu_id < g_max_cpus; ++cpu_id)
+            g->of_cpu[cpu_id] = -1;
+        for (int i = 0; i < g_num_cpus; ++i)
+        {
+            int cpu_id = g_cpu_ids[i];
+            int key = cpu_group_key(kind, cpu_id);
+            int j = 0;
+            while (j < g->count && g->key[j] != key)
+                j++;
+            char *label = g->label[j];
+            if (j == g->count)
+            {
+                g->key[j] = key;
+                g->count++;
+                if (kind == GROUP_CORE)
+                    snprintf(label, GROUP_LABEL_LEN, "CPU %d", cpu_id);
+                else if (key < 0)
+                    snprintf(label, GROUP_LABEL_LEN, "%s ?", g_group_titles[kind]);
+                else
+                    snprintf(label, GROUP_LABEL_LEN, "%s %d", g_group_titles[kind], key);
+            }
+            else if (kind == GROUP_CORE)
+            {
+                // Append the SMT sibling, or mark the label as truncated
+                size_t len = strlen(label);
+                char id[16];
+                int n = snprintf(id, sizeof(id), ",%d", cpu_id);
+                if (len + (size_t)n + 2 <= GROUP_LABEL_LEN && label[len - 1] != '+')
+                    memcpy(label + len, id, (size_t)n + 1);
+                else if (label[len - 1] != '+')
+                    memcpy(label + len, "+", 2);
+            }
+            g->of_cpu[cpu_id] = j;
+        }
+    }
+    g_groups_dirty = 0;
+}
+
+// Aggregates the last sample per group: mean usage and frequency, hottest temperature
+static void aggregate_cpu_groups(int kind)
+{
+    if (g_groups_dirty)
+        build_cpu_groups();
+    struct cpu_groups *g = &g_groups[kind];
+    for (int j = 0; j < g->count; ++j)
+    {
+        g->usage[j] = 0.0f;
+        memset(g->field_pct[j], 0, sizeof(g->field_pct[j]));
+        g->peak[j] = 0.0f;
+        g->freq_khz[j] = 0;
+        g->temp[j] = NAN;
+        g->wait_ns[j] = 0.0f;
+        g->slices[j] = 0;
+        g->online[j] = 0;
+    }
+    for (int i = 0; i < g_num_cpus; ++i)
+    {
+        int cpu_id = g_cpu_ids[i];
+        int j = g->of_cpu[cpu_id];
+        if (j < 0)
+            continue;
+        g->usage[j] += g_usage[cpu_id];
+        for (int f = 0; f < COREUSAGE_FIELDS; ++f)
+            g->field_pct[j][f] += g_field_pct[f][cpu_id];
+        if (g_sampler.running && g_sampler.peak[cpu_id] > g->peak[j])
+            g->peak[j] = g_sampler.peak[cpu_id];
+        g->freq_khz[j] += g_freq_khz[cpu_id];
+        g->online[j]++;
+        double t = g_show_temp ? g_cpu_temp[cpu_id] : NAN;
+        if (!isnan(t) && (isnan(g->temp[j]) || t > g->temp[j]))
+            g->temp[j] = t;
+        // Weighted by timeslices: the total delay over the total slices of the group
+        if (!isnan(g_sched.wait_ns[cpu_id]))
+        {
+            g->wait_ns[j] += (float)g_sched.d_delay_ns[cpu_id];
+            g->slices[j] += g_sched.d_slices[cpu_id];
+        }
+    }
+    for (int j = 0; j < g->count; ++j)
+    {
+        if (g->online[j] > 0)
+        {
+            g->usage[j] /= (float)g->online[j];
+            for (int f = 0; f < COREUSAGE_FIELDS; ++f)
+                g->field_pct[j][f] /= (float)g->online[j];
+            g->freq_khz[j] /= (unsigned long long)g->online[j];
+        }
+        g->wait_ns[j] = g->slices[j] ? g->wait_ns[j] / (float)g->slices[j] : NAN;
+    }
+}
+
+// Rebuilds the ascending list of online CPU ids from a snapshot
+static void rebuild_cpu_ids(const struct coreusage_snapshot *snap)
+{
+    g_num_cpus = 0;
+    for (int c = 0; c < g_max_cpus; ++c)
+        if (snap->online[c])
+            g_cpu_ids[g_num_cpus++] = c;
+}
+
+// Handles CPUs that came online since the previous sample
+// Their topology may have changed, so it is re-read and the sensors are re-mapped.
+static void handle_cpu_hotplug(const struct coreusage_snapshot *prev)
+{
+    int changed = 0;
+    for (int i = 0; i < g_num_cpus; ++i)
+    {
+        int cpu_id = g_cpu_ids[i];
+        if (!prev->online[cpu_id])
+        {
+            read_cpu_topology(cpu_id);
+            changed = 1;
+        }
+    }
+    if (changed)
+    {
+        g_temps_resolved = 0;
+        g_groups_dirty = 1;
+    }
+}
+
+// Allocates the statistics window for len samples of every possible CPU
+static int alloc_history(int len)
+{
+    size_t n = (size_t)g_max_cpus;
+    g_hist.values = calloc(n * (size_t)len, sizeof(*g_hist.values));
+    g_hist.min_q = calloc(n * (size_t)len, sizeof(*g_hist.min_q));
+    g_hist.max_q = calloc(n * (size_t)len, sizeof(*g_hist.max_q));
+    g_hist.min_head = calloc(n, sizeof(*g_hist.min_head));
+    g_hist.min_size = calloc(n, sizeof(*g_hist.min_size));
+    g_hist.max_head = calloc(n, sizeof(*g_hist.max_head));
+    g_hist.max_size = calloc(n, sizeof(*g_hist.max_size));
+    g_hist.bins = calloc(n * HISTORY_BINS, sizeof(*g_hist.bins));
+    g_hist.sum = calloc(n, sizeof(*g_hist.sum));
+    g_hist.p95 = calloc(n, sizeof(*g_hist.p95));
+    g_hist.below = calloc(n, sizeof(*g_hist.below));
+    if (!g_hist.values || !g_hist.min_q || !g_hist.max_q || !g_hist.min_head || !g_hist.min_size || !g_hist.max_head ||
+        !g_hist.max_size || !g_hist.bins || !g_hist.sum || !g_hist.p95 || !g_hist.below)
+        return -1;
+    g_hist.len = len;
+    return 0;
+}
+
+static void free_history(void)
+{
+    free(g_hist.values);
+    free(g_hist.min_q);
+    free(g_hist.max_q);
+    free(g_hist.min_head);
+    free(g_hist.min_size);
+    free(g_hist.max_head);
+    free(g_hist.max_size);
+    free(g_hist.bins);
+    free(g_hist.sum);
+    free(g_hist.p95);
+    free(g_hist.below);
+    memset(&g_hist, 0, sizeof(g_hist));
+}
+
+// Empties the window, e.g. after seeking in a replay
+static void reset_history(void)
+{
+    if (!g_hist.len)
+        return;
+    size_t n = (size_t)g_max_cpus;
+    memset(g_hist.min_size, 0, n * sizeof(*g_hist.min_size));
+    memset(g_hist.max_size, 0, n * sizeof(*g_hist.max_size));
+    memset(g_hist.bins, 0, n * HISTORY_BINS * sizeof(*g_hist.bins));
+    memset(g_hist.sum, 0, n * sizeof(*g_hist.sum));
+    memset(g_hist.p95, 0, n * sizeof(*g_hist.p95));
+    memset(g_hist.below, 0, n * sizeof(*g_hist.below));
+    g_hist.count = 0;
+    g_hist.next = 0;
+}
+
+// Appends the usage of the current sample to the window of every possible CPU
+static void push_history(void)
+{
+    if (!g_hist.len)
+        return;
+    int len = g_hist.len;
+    int slot = g_hist.next;
+    int full = g_hist.count == len;
+    int count = full ? len : g_hist.count + 1;
+    // Nearest-rank 95th percentile: the smallest value with at least rank samples <= it
+    int rank = (95 * count + 99) / 100;
+    for (int c = 0; c < g_max_cpus; ++c)
+    {
+        unsigned char *values = g_hist.values + (size_t)c * (size_t)len;
+        uint16_t *min_q = g_hist.min_q + (size_t)c * (size_t)len;
+        uint16_t *max_q = g_hist.max_q + (size_t)c * (size_t)len;
+        uint16_t *bins = g_hist.bins + (size_t)c * HISTORY_BINS;
+        float u = g_usage[c];
+        int v = u <= 0.0f ? 0 : u >= 100.0f ? 100 : (int)(u + 0.5f);
+        int p95 = g_hist.p95[c];
+        int below = g_hist.below[c];
+        if (full)
+        {
+            // The slot about to be overwritten holds the oldest sample; it leaves the window
+            int old = values[slot];
+            g_hist.sum[c] -= (uint32_t)old;
+            bins[old]--;
+            below -= old < p95;
+            if (g_hist.min_size[c] && min_q[g_hist.min_head[c]] == slot)
+            {
+                g_hist.min_head[c] = (uint16_t)((g_hist.min_head[c] + 1) % len);
+                g_hist.min_size[c]--;
+            }
+            if (g_hist.max_size[c] && max_q[g_hist.max_head[c]] == slot)
+            {
+                g_hist.max_head[c] = (uint16_t)((g_hist.max_head[c] + 1) % len);
+                g_hist.max_size[c]--;
+            }
+        }
+        values[slot] = (unsigned char)v;
+        g_hist.sum[c] += (uint32_t)v;
+        bins[v]++;
+        below += v < p95;
+        // Entries that can never be the extreme again are dropped from the back
+        int size = g_hist.min_size[c];
+        while (size && values[min_q[(g_hist.min_head[c] + size - 1) % len]] >= v)
+            size--;
+        min_q[(g_hist.min_head[c] + size) % len] = (uint16_t)slot;
+        g_hist.min_size[c] = (uint16_t)(size + 1);
+        size = g_hist.max_size[c];
+        while (size && values[max_q[(g_hist.max_head[c] + size - 1) % len]] <= v)
+            size--;
+        max_q[(g_hist.max_head[c] + size) % len] = (uint16_t)slot;
+        g_hist.max_size[c] = (uint16_t)(size + 1);
+        // Move the percentile to the bin that holds the rank-th smallest value
+        while (p95 > 0 && below >= rank)
+            below -= bins[--p95];
+        while (below + bins[p95] < rank)
+            below += bins[p95++];
+        g_hist.p95[c] = (unsigned char)p95;
+        g_hist.below[c] = (uint16_t)below;
+    }
+    g_hist.next = (slot + 1) % len;
+    g_hist.count = count;
+}
+
+// Returns the start time of a measured phase, 0 without --self-stats
+static unsigned long long phase_begin(void)
+{
+    if (!g_self.enabled)
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return timespec_ns(&ts);
+}
+
+// Adds the duration since start to the statistics of a phase
+static void phase_end(int phase, unsigned long long start)
+{
+    if (!g_self.enabled)
+        return;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long long ns = timespec_ns(&ts) - start;
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    g_self.hist[phase][bucket < PHASE_BUCKETS ? bucket : PHASE_BUCKETS - 1]++;
+    g_self.last_ns[phase] = ns;
+    g_self.sum_ns[phase] += ns;
+    g_self.count[phase]++;
+    if (ns > g_self.max_ns[phase])
+        g_self.max_ns[phase] = ns;
+}
+
+// Returns an upper bound of quantile q of a phase's durations from its histogram
+static unsigned long long phase_quantile(int phase, double q)
+{
+    unsigned long long rank = (unsigned long long)(q * (double)g_self.count[phase] + 0.5);
+    unsigned long long seen = 0;
+    for (int k = 0; k < PHASE_BUCKETS - 1; ++k)
+    {
+        seen += g_self.hist[phase][k];
+        if (seen >= rank && seen > 0)
+            return (1ULL << k) < g_self.max_ns[phase] ? 1ULL << k : g_self.max_ns[phase];
+    }
+    return g_self.max_ns[phase];
+}
+
+// Updates the process' own CPU time, context switches, syscalls and memory
+// getrusage() covers all threads; the syscall count comes from /proc/self/io (read and
+// write calls, which is what sampling consists of) and the resident size from /proc/self/stat.
+static void update_self_stats(void)
+{
+    struct rusage ru;
+    struct timespec ts;
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long long wall_ns = timespec_ns(&ts);
+    unsigned long long cpu_ns = ((unsigned long long)ru.ru_utime.tv_sec + (unsigned long long)ru.ru_stime.tv_sec) * 1000000000ULL +
+                                ((unsigned long long)ru.ru_utime.tv_usec + (unsigned long long)ru.ru_stime.tv_usec) * 1000ULL;
+    unsigned long long ctx = (unsigned long long)ru.ru_nvcsw + (unsigned long long)ru.ru_nivcsw;
+    long long syscalls = -1;
+    // Kernels without task I/O accounting have no such file
+    if (g_self_io_file.fd == -1 && access(SELF_IO_FILE, R_OK) != 0)
+        g_self_io_file.fd = -2;
+    ssize_t len = g_self_io_file.fd != -2 ? proc_file_read(&g_self_io_file) : -1;
+    if (len >= 0)
+    {
+        const char *end = g_self_io_file.buf + len;
+        unsigned long long r, w;
+        const char *p = strstr(g_self_io_file.buf, "syscr:");
+        const char *q = strstr(g_self_io_file.buf, "syscw:");
+        if (p && q && (p += 6, scan_ull(&p, end, &r)) && (q += 6, scan_ull(&q, end, &w)))
+            syscalls = (long long)(r + w);
+    }
+    len = proc_file_read(&g_self_stat_file);
+    const char *p = len > 0 ? memrchr(g_self_stat_file.buf, ')', (size_t)len) : NULL;
+    if (p)
+    {
+        // rss is field 24; the command name (field 2) may contain blanks, the rest does not
+        const char *end = g_self_stat_file.buf + len;
+        int field = 2;
+        for (++p; p < end && field < 24; ++p)
+            field += *p == ' ';
+        unsigned long long pages;
+        if (field == 24 && scan_ull(&p, end, &pages))
+            g_self.rss_kib = pages * (unsigned long long)sysconf(_SC_PAGESIZE) / 1024;
+    }
+    if (g_self.wall_ns)
+    {
+        g_self.cpu_pct = wall_ns > g_self.wall_ns ? 100.0 * (double)(cpu_ns - g_self.cpu_ns) / (double)(wall_ns - g_self.wall_ns) : 0.0;
+        g_self.d_ctx_switches = ctx - g_self.ctx_switches;
+        g_self.d_syscalls = syscalls >= 0 && g_self.syscalls >= 0 ? syscalls - g_self.syscalls : -1;
+    }
+    g_self.wall_ns = wall_ns;
+    g_self.cpu_ns = cpu_ns;
+    g_self.ctx_switches = ctx;
+    g_self.syscalls = syscalls;
+}
+
+// Body of the sampler thread: one snapshot per interval into the next free slot
+// Deadlines are absolute, so the rate does not drift; missed ones are skipped, not made up.
+// A full ring drops the sample rather than waiting for the main thread.
+static void *sampler_main(void *arg)
+{
+    (void)arg;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    uint64_t mask = (uint64_t)g_sampler.capacity - 1;
+    while (!atomic_load_explicit(&g_sampler.stop, memory_order_relaxed))
+    {
+        uint64_t head = atomic_load_explicit(&g_sampler.head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&g_sampler.tail, memory_order_acquire);
+        if (head - tail < (uint64_t)g_sampler.capacity)
+        {
+            size_t i = (size_t)(head & mask);
+            struct coreusage_read r = {.snap = &g_sampler.slots[i]};
+            if (coreusage_read(g_sampler.cu, &r) == 0)
+            {
+                struct timespec ts;
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                g_sampler.monotonic_ns[i] = timespec_ns(&ts);
+                clock_gettime(CLOCK_REALTIME, &ts);
+                g_sampler.realtime_ns[i] = timespec_ns(&ts);
+                atomic_store_explicit(&g_sampler.head, head + 1, memory_order_release);
+            }
+        }
+        next.tv_nsec += (long)g_sampler.interval_us * 1000L;
+        while (next.tv_nsec >= 1000000000L)
+        {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (timespec_ns(&next) < timespec_ns(&now))
+            next = now;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+    }
+    return NULL;
+}
+
+// Starts the sampler thread, pinned to g_sampler.cpu if set
+// The ring holds the peak window plus two frames worth of samples.
+static int start_sampler(int interval_us, int peak_window_ms)
+{
+    g_sampler.interval_us = interval_us;
+    g_sampler.peak_window = (peak_window_ms * 1000 + interval_us - 1) / interval_us;
+    if (g_sampler.peak_window < 1)
+        g_sampler.peak_window = 1;
+    int needed = g_sampler.peak_window + 2 * (g_interval_us / interval_us) + 2;
+    g_sampler.capacity = 2;
+    while (g_sampler.capacity < needed && g_sampler.capacity < SAMPLER_MAX_SLOTS)
+        g_sampler.capacity *= 2;
+    if (g_sampler.peak_window >= g_sampler.capacity)
+        g_sampler.peak_window = g_sampler.capacity - 1;
+    size_t n = (size_t)g_sampler.capacity;
+    g_sampler.slots = calloc(n, sizeof(*g_sampler.slots));
+    g_sampler.monotonic_ns = calloc(n, sizeof(*g_sampler.monotonic_ns));
+    g_sampler.realtime_ns = calloc(n, sizeof(*g_sampler.realtime_ns));
+    g_sampler.peak = calloc((size_t)g_max_cpus, sizeof(*g_sampler.peak));
+    g_sampler.window_usage = calloc((size_t)g_max_cpus, sizeof(*g_sampler.window_usage));
+    if (!g_sampler.slots || !g_sampler.monotonic_ns || !g_sampler.realtime_ns || !g_sampler.peak || !g_sampler.window_usage)
+        return -1;
+    // The thread reads /proc/stat through an engine of its own; a plain pread() suits its short reads
+    struct coreusage_config config = {.sysroot = g_sysroot, .io = COREUSAGE_IO_SYNC, .flags = COREUSAGE_NO_FREQ};
+    g_sampler.cu = coreusage_open(&config);
+    if (!g_sampler.cu)
+        return -1;
+    for (size_t i = 0; i < n; ++i)
+        if (alloc_snapshot(&g_sampler.slots[i], g_max_cpus) != 0)
+            return -1;
+    pthread_attr_t attr;
+    int err = pthread_attr_init(&attr);
+    if (err)
+        return errno = err, -1;
+    cpu_set_t *set = NULL;
+    size_t set_size = 0;
+    if (g_sampler.cpu >= 0)
+    {
+        // Pinning via the attributes means the thread never runs anywhere else
+        set = CPU_ALLOC((size_t)g_sampler.cpu + 1);
+        set_size = CPU_ALLOC_SIZE((size_t)g_sampler.cpu + 1);
+        if (!set)
+        {
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+        CPU_ZERO_S(set_size, set);
+        CPU_SET_S((size_t)g_sampler.cpu, set_size, set);
+        err = pthread_attr_setaffinity_np(&attr, set_size, set);
+    }
+    if (!err)
+        err = pthread_create(&g_sampler.thread, &attr, sampler_main, NULL);
+    pthread_attr_destroy(&attr);
+    CPU_FREE(set);
+    if (err)
+        return errno = err, -1;
+    g_sampler.running = 1;
+    return 0;
+}
+
+static void stop_sampler(void)
+{
+    if (g_sampler.running)
+    {
+        atomic_store_explicit(&g_sampler.stop, 1, memory_order_relaxed);
+        pthread_join(g_sampler.thread, NULL);
+        g_sampler.running = 0;
+    }
+    for (int i = 0; g_sampler.slots && i < g_sampler.capacity; ++i)
+        free(g_sampler.slots[i].field[0]);
+    free(g_sampler.slots);
+    free(g_sampler.monotonic_ns);
+    free(g_sampler.realtime_ns);
+    free(g_sampler.peak);
+    free(g_sampler.window_usage);
+    g_sampler.slots = NULL;
+    coreusage_close(g_sampler.cu);
+    g_sampler.cu = NULL;
+}
+
+// Usage of every possible CPU between two snapshots, folded into the peak
+static void fold_peak_usage(const struct coreusage_snapshot *prev, const struct coreusage_snapshot *cur)
+{
+    coreusage_delta(prev, cur, g_max_cpus, g_sampler.window_usage, NULL);
+    for (int c = 0; c < g_max_cpus; ++c)
+        if (g_sampler.window_usage[c] > g_sampler.peak[c])
+            g_sampler.peak[c] = g_sampler.window_usage[c];
+}
+
+// Takes everything the sampler produced since the last frame: the peak over every
+// sliding window that ended meanwhile, and the newest snapshot as the current sample.
+// Returns 0 if there was nothing new.
+static int drain_sampler(void)
+{
+    uint64_t head = atomic_load_explicit(&g_sampler.head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&g_sampler.tail, memory_order_relaxed);
+    if (g_sampler.next >= head)
+        return 0;
+    uint64_t mask = (uint64_t)g_sampler.capacity - 1;
+    uint64_t window = (uint64_t)g_sampler.peak_window;
+    memset(g_sampler.peak, 0, (size_t)g_max_cpus * sizeof(*g_sampler.peak));
+    // The first slot of every window is still held; only right after the start
+    // there are not enough slots for a full window yet
+    for (uint64_t k = g_sampler.next; k < head; ++k)
+        if (k >= tail + window)
+            fold_peak_usage(&g_sampler.slots[(k - window) & mask], &g_sampler.slots[k & mask]);
+    size_t latest = (size_t)((head - 1) & mask);
+    int next = g_snap_cur ^ 1;
+    memcpy(g_snap[next].field[0], g_sampler.slots[latest].field[0], coreusage_snapshot_size(g_max_cpus));
+    g_snap_cur = next;
+    rebuild_cpu_ids(&g_snap[next]);
+    g_sample_monotonic_ns = g_sampler.monotonic_ns[latest];
+    g_sample_realtime_ns = g_sampler.realtime_ns[latest];
+    g_sampler.next = head;
+    // Keep the newest window as baselines for the next frame, give the rest back
+    if (head > tail + window)
+        atomic_store_explicit(&g_sampler.tail, head - window, memory_order_release);
+    return 1;
+}
+
+// Opens a kept-open file that not every kernel (or --sysroot tree) has
+// Returns 0 if it is open, -1 if it is missing; a missing file is not looked up again.
+static int open_optional_file(struct proc_file *pf)
+{
+    if (pf->fd == -1 && (pf->fd = open_sys_path(pf->path, 0)) < 0)
+        pf->fd = -2;
+    return pf->fd >= 0 ? 0 : -1;
+}
+
+// Reads the run delay and timeslices of every CPU from /proc/schedstat and computes the
+// mean wait per timeslice over the last interval. Fields 8 and 9 of a "cpuN" line are the
+// run delay in ns and the timeslice count; the "domainN" lines in between are skipped.
+static void update_sched_stats(void)
+{
+    ssize_t len = open_optional_file(&g_schedstat_file) == 0 ? proc_file_read(&g_schedstat_file) : -1;
+    g_sched.available = len > 0;
+    if (!g_sched.available)
+        return;
+    unsigned gen = ++g_sched.generation;
+    const char *p = g_schedstat_file.buf;
+    const char *end = p + len;
+    while (p < end)
+    {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol)
+            eol = end;
+        unsigned long long id, v[9];
+        const char *s = p + 3;
+        if (eol - p > 3 && memcmp(p, "cpu", 3) == 0 && scan_ull(&s, eol, &id) && id < (unsigned long long)g_max_cpus)
+        {
+            int n = 0;
+            while (n < 9 && scan_ull(&s, eol, &v[n]))
+                n++;
+            if (n == 9)
+            {
+                // A CPU that was offline (or is new) starts with a baseline
+                int cpu_id = (int)id;
+                int had_baseline = g_sched.seen[cpu_id] == gen - 1;
+                g_sched.d_delay_ns[cpu_id] = had_baseline && v[7] >= g_sched.delay_ns[cpu_id] ? v[7] - g_sched.delay_ns[cpu_id] : 0;
+                g_sched.d_slices[cpu_id] = had_baseline && v[8] >= g_sched.slices[cpu_id] ? v[8] - g_sched.slices[cpu_id] : 0;
+                g_sched.delay_ns[cpu_id] = v[7];
+                g_sched.slices[cpu_id] = v[8];
+                g_sched.seen[cpu_id] = gen;
+                // Without any timeslice in the interval nothing waited
+                g_sched.wait_ns[cpu_id] = !had_baseline ? NAN
+                                          : g_sched.d_slices[cpu_id] ? (float)g_sched.d_delay_ns[cpu_id] / (float)g_sched.d_slices[cpu_id]
+                                                                     : 0.0f;
+            }
+        }
+        p = eol + 1;
+    }
+    for (int i = 0; i < g_num_cpus; ++i)
+        if (g_sched.seen[g_cpu_ids[i]] != gen)
+            g_sched.wait_ns[g_cpu_ids[i]] = NAN;
+}
+
+// Reads /proc/pressure/cpu and computes the stalled share of the last interval from the totals
+// Lines look like "some avg10=0.91 avg60=0.81 avg300=1.08 total=30184981" (total in µs).
+static void update_cpu_pressure(void)
+{
+    ssize_t len = open_optional_file(&g_psi_file) == 0 ? proc_file_read(&g_psi_file) : -1;
+    if (len <= 0)
+    {
+        g_psi.available = 0;
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long long now = timespec_ns(&ts);
+    // The buffer always has room for the terminator, since a full buffer is grown before returning
+    g_psi_file.buf[len] = '\0';
+    int first = !g_psi.available;
+    for (int k = 0; k < 2; ++k)
+    {
+        const char *line = strstr(g_psi_file.buf, k ? "full " : "some ");
+        const char *avg = line ? strstr(line, "avg10=") : NULL;
+        const char *p = line ? strstr(line, "total=") : NULL;
+        unsigned long long total;
+        if (!avg || !p || (p += 6, !scan_ull(&p, g_psi_file.buf + len, &total)))
+            continue;
+        unsigned long long *last = k ? &g_psi.full_us : &g_psi.some_us;
+        float *pct = k ? &g_psi.full_pct : &g_psi.some_pct;
+        float *avg10 = k ? &g_psi.full_avg10 : &g_psi.some_avg10;
+        *avg10 = strtof(avg + 6, NULL);
+        *pct = first || now <= g_psi.read_ns || total < *last ? NAN : (float)((double)(total - *last) * 1e5 / (double)(now - g_psi.read_ns));
+        *last = total;
+    }
+    g_psi.read_ns = now;
+    g_psi.available = 1;
+}
+
+// Returns the hash slot of a cgroup path: the one holding it, or the empty one it would go to
+static size_t cgroup_slot(const char *path)
+{
+    uint32_t h = 2166136261u;
+    for (const char *p = path; *p; ++p)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    size_t slot = h & g_cgroup.hash_mask;
+    while (g_cgroup.hash[slot] >= 0 && strcmp(g_cgroup.groups[g_cgroup.hash[slot]].path, path) != 0)
+        slot = (slot + 1) & g_cgroup.hash_mask;
+    return slot;
+}
+
+// Rebuilds the path hash for the current groups, at most half full
+static int cgroup_rehash(void)
+{
+    size_t size = 64;
+    while (size < (size_t)g_cgroup.count * 2 + 2)
+        size *= 2;
+    if (size - 1 != g_cgroup.hash_mask)
+    {
+        int *hash = realloc(g_cgroup.hash, size * sizeof(*hash));
+        if (!hash)
+            return -1;
+        g_cgroup.hash = hash;
+        g_cgroup.hash_mask = size - 1;
+    }
+    for (size_t k = 0; k <= g_cgroup.hash_mask; ++k)
+        g_cgroup.hash[k] = -1;
+    for (int i = 0; i < g_cgroup.count; ++i)
+        g_cgroup.hash[cgroup_slot(g_cgroup.groups[i].path)] = i;
+    return 0;
+}
+
+// Returns the index of the group at path, -1 if it is not known
+static int cgroup_find(const char *path)
+{
+    return g_cgroup.count ? g_cgroup.hash[cgroup_slot(path)] : -1;
+}
+
+// Reads cpuset.cpus.effective of a group; without the cpuset controller it has its parent's
+static void cgroup_read_cpuset(int i)
+{
+    struct cgroup *g = &g_cgroup.groups[i];
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/cpuset.cpus.effective", g->path);
+    int fd = openat(g_cgroup.root_fd, path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd >= 0 ? read(fd, g_cgroup.buf, sizeof(g_cgroup.buf) - 1) : -1;
+    if (fd >= 0)
+        close(fd);
+    while (n > 0 && (g_cgroup.buf[n - 1] == '\n' || g_cgroup.buf[n - 1] == ' '))
+        n--;
+    const char *list = NULL;
+    if (n > 0)
+    {
+        g_cgroup.buf[n] = '\0';
+        list = g_cgroup.buf;
+    }
+    else
+    {
+        const char *slash = strrchr(g->path, '/');
+        if (slash || strcmp(g->path, ".") != 0)
+        {
+            snprintf(path, sizeof(path), "%.*s", slash ? (int)(slash - g->path) : 1, slash ? g->path : ".");
+            int parent = cgroup_find(path);
+            list = parent >= 0 ? g_cgroup.groups[parent].cpuset : NULL;
+        }
+    }
+    if (g->cpuset && list && strcmp(g->cpuset, list) == 0)
+        return;
+    free(g->cpuset);
+    free(g->cpus);
+    g->cpuset = list ? strdup(list) : NULL;
+    g->cpus = g->cpuset ? calloc((size_t)g_max_cpus, 1) : NULL;
+    g->ncpus = 0;
+    if (g->cpus)
+    {
+        parse_cpulist(g->cpuset, g->cpuset + strlen(g->cpuset), g->cpus, g_max_cpus);
+        for (int c = 0; c < g_max_cpus; ++c)
+            g->ncpus += g->cpus[c];
+    }
+}
+
+// Starts tracking the group at path: keeps its cpu.stat open (within the fd limit) and
+// watches its directory for new and removed children. Returns its index, or -1
+static int cgroup_add(const char *path)
+{
+    if (g_cgroup.count == g_cgroup.cap)
+    {
+        int cap = g_cgroup.cap ? g_cgroup.cap * 2 : CGROUP_INITIAL;
+        struct cgroup *groups = realloc(g_cgroup.groups, (size_t)cap * sizeof(*groups));
+        if (!groups)
+            return -1;
+        g_cgroup.groups = groups;
+        g_cgroup.cap = cap;
+    }
+    struct cgroup *g = &g_cgroup.groups[g_cgroup.count];
+    *g = (struct cgroup){.fd = -1, .wd = -1, .seen = 1, .usage_pct = NAN, .throttled_pct = NAN};
+    g->path = strdup(path);
+    if (!g->path)
+        return -1;
+    char file[PATH_MAX];
+    if (g_cgroup.open_fds < g_cgroup.fd_limit)
+    {
+        snprintf(file, sizeof(file), "%s/cpu.stat", path);
+        g->fd = openat(g_cgroup.root_fd, file, O_RDONLY | O_CLOEXEC);
+        g_cgroup.open_fds += g->fd >= 0;
+    }
+    // inotify takes no directory fd, but the root's /proc/self/fd link resolves below --sysroot too
+    if (g_cgroup.inotify_fd >= 0)
+    {
+        snprintf(file, sizeof(file), "/proc/self/fd/%d/%s", g_cgroup.root_fd, path);
+        g->wd = inotify_add_watch(g_cgroup.inotify_fd, file, IN_CREATE | IN_DELETE | IN_ONLYDIR);
+        if (g->wd >= g_cgroup.wd_cap)
+        {
+            int cap = g->wd * 2 + 64;
+            int *wd_group = realloc(g_cgroup.wd_group, (size_t)cap * sizeof(*wd_group));
+            if (!wd_group)
+            {
+                inotify_rm_watch(g_cgroup.inotify_fd, g->wd);
+                g->wd = -1;
+            }
+            else
+            {
+                for (int k = g_cgroup.wd_cap; k < cap; ++k)
+                    wd_group[k] = -1;
+                g_cgroup.wd_group = wd_group;
+                g_cgroup.wd_cap = cap;
+            }
+        }
+        if (g->wd >= 0)
+            g_cgroup.wd_group[g->wd] = g_cgroup.count;
+    }
+    int i = g_cgroup.count++;
+    if ((size_t)g_cgroup.count * 2 + 2 > g_cgroup.hash_mask + 1)
+        cgroup_rehash();
+    else
+        g_cgroup.hash[cgroup_slot(path)] = i;
+    cgroup_read_cpuset(i);
+    return i;
+}
+
+// Visits the group at path and everything below it, adding the groups not known yet
+// Every visited group is marked as seen and has its cpuset read again.
+static void cgroup_walk(const char *path)
+{
+    int i = cgroup_find(path);
+    if (i < 0 && (i = cgroup_add(path)) < 0)
+        return;
+    if (g_cgroup.groups[i].seen != 1)
+    {
+        g_cgroup.groups[i].seen = 1;
+        cgroup_read_cpuset(i);
+    }
+    int fd = openat(g_cgroup.root_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir)
+    {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL)
+    {
+        if (de->d_name[0] == '.' || (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN))
+            continue;
+        struct stat st;
+        if (de->d_type == DT_UNKNOWN && (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(st.st_mode)))
+            continue;
+        char child[PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s/%s", path, de->d_name) >= (int)sizeof(child))
+            continue;
+        cgroup_walk(strcmp(path, ".") == 0 ? child + 2 : child);
+    }
+    closedir(dir);
+}
+
+// Stops tracking every group not marked as seen; the others keep their order
+static void cgroup_sweep(void)
+{
+    int kept = 0;
+    for (int i = 0; i < g_cgroup.count; ++i)
+    {
+        struct cgroup *g = &g_cgroup.groups[i];
+        if (!g->seen)
+        {
+            if (g->fd >= 0)
+            {
+                close(g->fd);
+                g_cgroup.open_fds--;
+            }
+            // Fails harmlessly if the directory went away with its watch
+            if (g->wd >= 0)
+            {
+                inotify_rm_watch(g_cgroup.inotify_fd, g->wd);
+                g_cgroup.wd_group[g->wd] = -1;
+            }
+            free(g->path);
+            free(g->cpuset);
+            free(g->cpus);
+            continue;
+        }
+        if (g->wd >= 0)
+            g_cgroup.wd_group[g->wd] = kept;
+        g_cgroup.groups[kept++] = *g;
+    }
+    if (kept != g_cgroup.count)
+    {
+        g_cgroup.count = kept;
+        cgroup_rehash();
+    }
+}
+
+// Walks the whole subtree again: picks up missed changes and changed cpusets
+static void cgroup_rescan(unsigned long long now)
+{
+    for (int i = 0; i < g_cgroup.count; ++i)
+        g_cgroup.groups[i].seen = 0;
+    cgroup_walk(".");
+    cgroup_sweep();
+    g_cgroup.walked_ns = now;
+}
+
+// Applies the directory changes reported by inotify since the last sample
+// Returns 1 if events were lost and the subtree has to be walked again.
+static int cgroup_apply_events(void)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int lost = 0, removed = 0;
+    ssize_t n;
+    while ((n = read(g_cgroup.inotify_fd, buf, sizeof(buf))) > 0)
+    {
+        for (const char *p = buf; p < buf + n;)
+        {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW)
+                lost = 1;
+            int parent = ev->wd >= 0 && ev->wd < g_cgroup.wd_cap ? g_cgroup.wd_group[ev->wd] : -1;
+            if (parent < 0 || !(ev->mask & IN_ISDIR) || !ev->len)
+                continue;
+            char child[PATH_MAX];
+            const char *base = g_cgroup.groups[parent].path;
+            if (strcmp(base, ".") == 0)
+                snprintf(child, sizeof(child), "%s", ev->name);
+            else
+                snprintf(child, sizeof(child), "%s/%s", base, ev->name);
+            // Children created before the watch was set up are found by the walk
+            if (ev->mask & IN_CREATE)
+                cgroup_walk(child);
+            else if (ev->mask & IN_DELETE)
+            {
+                // A group can only be removed once it has no children left
+                int i = cgroup_find(child);
+                if (i >= 0)
+                {
+                    if (!removed)
+                        for (int k = 0; k < g_cgroup.count; ++k)
+                            g_cgroup.groups[k].seen = 1;
+                    g_cgroup.groups[i].seen = 0;
+                    removed = 1;
+                }
+            }
+        }
+    }
+    if (removed)
+        cgroup_sweep();
+    return lost;
+}
+
+// Opens the --cgroup subtree and walks it once. Returns -1 if it is no cgroup v2 hierarchy
+static int cgroup_init(unsigned long long now)
+{
+    char path[PATH_MAX];
+    if (g_cgroup.dir[0] == '/')
+        snprintf(path, sizeof(path), "%s", g_cgroup.dir);
+    else
+        snprintf(path, sizeof(path), "%s/%s", CGROUP_ROOT, g_cgroup.dir);
+    g_cgroup.root_fd = open_sys_path(path, O_DIRECTORY);
+    if (g_cgroup.root_fd < 0 || faccessat(g_cgroup.root_fd, "cgroup.procs", R_OK, 0) != 0)
+    {
+        if (g_cgroup.root_fd >= 0)
+            close(g_cgroup.root_fd);
+        g_cgroup.root_fd = -2;
+        return -1;
+    }
+    // A quarter of the file descriptors at most, the rest is left to --top and everything else
+    struct rlimit rl;
+    g_cgroup.fd_limit = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur / 4 < CGROUP_FD_LIMIT ? (int)(rl.rlim_cur / 4) : CGROUP_FD_LIMIT;
+    g_cgroup.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    cgroup_walk(".");
+    g_cgroup.walked_ns = now;
+    return 0;
+}
+
+// Reads cpu.stat of every group and computes its usage and throttling over the last interval
+// Only cpu.stat is read per sample; the subtree itself is kept current by inotify events and
+// the periodic rescan.
+static void update_cgroup_stats(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long long now = timespec_ns(&ts);
+    if (g_cgroup.root_fd == -2 || (g_cgroup.root_fd == -1 && cgroup_init(now) != 0))
+        return;
+    int lost = g_cgroup.inotify_fd >= 0 && cgroup_apply_events();
+    if (lost || now - g_cgroup.walked_ns >= g_cgroup.rescan_ns)
+        cgroup_rescan(now);
+    int gone = 0;
+    for (int i = 0; i < g_cgroup.count; ++i)
+    {
+        struct cgroup *g = &g_cgroup.groups[i];
+        char *buf = g_cgroup.buf;
+        ssize_t n;
+        if (g->fd >= 0)
+            n = pread(g->fd, buf, sizeof(g_cgroup.buf) - 1, 0);
+        else
+        {
+            // Beyond the fd limit the file is opened for every read
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/cpu.stat", g->path);
+            int fd = openat(g_cgroup.root_fd, path, O_RDONLY | O_CLOEXEC);
+            n = fd >= 0 ? read(fd, buf, sizeof(g_cgroup.buf) - 1) : -1;
+            if (fd >= 0)
+                close(fd);
+        }
+        // A removed group fails with ENODEV; it goes with the next sweep
+        g->seen = n > 0;
+        gone |= n <= 0;
+        if (n <= 0)
+            continue;
+        buf[n] = '\0';
+        unsigned long long usage = 0, throttled = 0;
+        const char *p = strstr(buf, "usage_usec ");
+        if (p)
+        {
+            p += 11;
+            scan_ull(&p, buf + n, &usage);
+        }
+        p = strstr(buf, "throttled_usec ");
+        if (p)
+        {
+            p += 15;
+            scan_ull(&p, buf + n, &throttled);
+        }
+        // cpu.stat is only read while the view is shown; an older baseline would span the time away
+        int fresh = g->read_ns && now > g->read_ns && now - g->read_ns <= 2ULL * (unsigned long long)g_interval_us * 1000ULL;
+        double dt = fresh ? (double)(now - g->read_ns) : 0.0;
+        g->usage_pct = dt > 0 && usage >= g->usage_usec ? (float)((double)(usage - g->usage_usec) * 1e5 / dt) : NAN;
+        g->throttled_pct = dt > 0 && throttled >= g->throttled_usec ? (float)((double)(throttled - g->throttled_usec) * 1e5 / dt) : NAN;
+        g->usage_usec = usage;
+        g->throttled_usec = throttled;
+        g->read_ns = now;
+    }
+    if (gone)
+        cgroup_sweep();
+}
+
+// Closes every kept-open file and watch of the cgroup view
+static void cgroup_close(void)
+{
+    for (int i = 0; i < g_cgroup.count; ++i)
+    {
+        if (g_cgroup.groups[i].fd >= 0)
+            close(g_cgroup.groups[i].fd);
+        free(g_cgroup.groups[i].path);
+        free(g_cgroup.groups[i].cpuset);
+        free(g_cgroup.groups[i].cpus);
+    }
+    if (g_cgroup.inotify_fd >= 0)
+        close(g_cgroup.inotify_fd);
+    if (g_cgroup.root_fd >= 0)
+        close(g_cgroup.root_fd);
+    free(g_cgroup.groups);
+    free(g_cgroup.hash);
+    free(g_cgroup.wd_group);
+    free(g_cgroup.order);
+}
+
+// Sizes the per-CPU results of an interrupt table; the line table grows while parsing
+static int irq_table_init(struct irq_table *t)
+{
+    t->total = calloc((size_t)g_max_cpus, sizeof(*t->total));
+    t->top = malloc((size_t)g_max_cpus * (size_t)t->top_n * sizeof(*t->top));
+    t->top_rate = malloc((size_t)g_max_cpus * (size_t)t->top_n * sizeof(*t->top_rate));
+    t->col_cpu = malloc((size_t)g_max_cpus * sizeof(*t->col_cpu));
+    if (!t->total || !t->top || !t->top_rate || !t->col_cpu)
+        return -1;
+    for (size_t k = 0; k < (size_t)g_max_cpus * (size_t)t->top_n; ++k)
+        t->top[k] = -1;
+    return 0;
+}
+
+// Builds the column-to-CPU map from a header line such as "    CPU0    CPU1    CPU4"
+// Resets the line table, since its counters belong to the old columns.
+static int irq_parse_header(struct irq_table *t, const char *p, const char *eol)
+{
+    // Without the CPU header there is nothing to parse; realloc() must not get a size of 0
+    if (eol == p)
+        return -1;
+    char *copy = realloc(t->header, (size_t)(eol - p));
+    if (!copy)
+        return -1;
+    t->header = copy;
+    t->header_len = (size_t)(eol - p);
+    memcpy(t->header, p, t->header_len);
+    t->ncols = 0;
+    while ((p = memchr(p, 'C', (size_t)(eol - p))) != NULL && eol - p >= 3)
+    {
+        unsigned long long id;
+        p += 3;
+        if (p[-2] == 'P' && p[-1] == 'U' && scan_ull(&p, eol, &id) && id < (unsigned long long)g_max_cpus && t->ncols < g_max_cpus)
+            t->col_cpu[t->ncols++] = (int)id;
+    }
+    free(t->prev);
+    t->prev = NULL;
+    t->nlines = t->cap = 0;
+    t->valid = 0;
+    return 0;
+}
+
+// Makes line i of the table the one with this label, keeping its counters if it is known
+// Only needed when an interrupt line appeared or went away. Returns 1 if the line is new
+static int irq_place_line(struct irq_table *t, int i, const char *label, size_t label_len)
+{
+    size_t row = (size_t)t->ncols;
+    for (int j = i + 1; j < t->nlines; ++j)
+    {
+        if (strncmp(t->lines[j].label, label, label_len) != 0 || t->lines[j].label[label_len])
+            continue;
+        struct irq_line line = t->lines[i];
+        t->lines[i] = t->lines[j];
+        t->lines[j] = line;
+        for (size_t c = 0; c < row; ++c)
+        {
+            unsigned long long v = t->prev[(size_t)i * row + c];
+            t->prev[(size_t)i * row + c] = t->prev[(size_t)j * row + c];
+            t->prev[(size_t)j * row + c] = v;
+        }
+        return 0;
+    }
+    if (t->nlines == t->cap)
+    {
+        int cap = t->cap ? t->cap * 2 : 64;
+        struct irq_line *lines = realloc(t->lines, (size_t)cap * sizeof(*lines));
+        if (!lines)
+            return -1;
+        t->lines = lines;
+        unsigned long long *prev = realloc(t->prev, (size_t)cap * row * sizeof(*prev));
+        if (!prev)
+            return -1;
+        t->prev = prev;
+        t->cap = cap;
+    }
+    // The new line goes in front of the remaining ones
+    memmove(&t->lines[i + 1], &t->lines[i], (size_t)(t->nlines - i) * sizeof(*t->lines));
+    memmove(&t->prev[(size_t)(i + 1) * row], &t->prev[(size_t)i * row], (size_t)(t->nlines - i) * row * sizeof(*t->prev));
+    t->nlines++;
+    size_t len = label_len < sizeof(t->lines[i].label) - 1 ? label_len : sizeof(t->lines[i].label) - 1;
+    memcpy(t->lines[i].label, label, len);
+    t->lines[i].label[len] = '\0';
+    return 1;
+}
+
+// Reads /proc/interrupts or /proc/softirqs and computes the rate of every line on every CPU
+// One pass over the kept buffer: the header is only parsed when it changed, and every line
+// is matched against the table by position. Per CPU, the total and the busiest lines are kept.
+static int irq_table_update(struct irq_table *t, unsigned long long now_ns)
+{
+    ssize_t len = proc_file_read(&t->file);
+    if (len < 0)
+        return -1;
+    const char *p = t->file.buf;
+    const char *end = p + len;
+    const char *eol = memchr(p, '\n', (size_t)len);
+    if (!eol)
+        eol = end;
+    if (!t->header || (size_t)(eol - p) != t->header_len || memcmp(p, t->header, t->header_len) != 0)
+    {
+        if (irq_parse_header(t, p, eol) != 0)
+            return -1;
+    }
+    // Rates need a baseline from the previous frame
+    double dt = t->valid && now_ns > t->last_ns ? (double)(now_ns - t->last_ns) / 1e9 : 0.0;
+    int valid = dt > 0 && now_ns - t->last_ns <= 2ULL * (unsigned long long)g_interval_us * 1000ULL;
+    int n = t->top_n;
+    for (int c = 0; c < t->ncols; ++c)
+    {
+        int cpu_id = t->col_cpu[c];
+        t->total[cpu_id] = 0;
+        for (int k = 0; k < n; ++k)
+            t->top[(size_t)cpu_id * (size_t)n + (size_t)k] = -1;
+    }
+    int i = 0;
+    size_t row = (size_t)t->ncols;
+    for (p = eol + 1; p < end; p = eol + 1)
+    {
+        eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol)
+            eol = end;
+        const char *colon = memchr(p, ':', (size_t)(eol - p));
+        if (!colon)
+            continue;
+        const char *label = p;
+        while (label < colon && *label == ' ')
+            label++;
+        // Lines with a single total such as ERR and MIS are not per CPU
+        const char *s = colon + 1;
+        unsigned long long v;
+        if (t->ncols == 0 || !scan_ull(&s, eol, &v))
+            continue;
+        const char *after = s;
+        while (after < eol && *after == ' ')
+            after++;
+        if (t->ncols > 1 && (after == eol || !isdigit((unsigned char)*after)))
+            continue;
+        size_t label_len = (size_t)(colon - label);
+        int is_new = 0;
+        if (i >= t->nlines || strncmp(t->lines[i].label, label, label_len) != 0 || t->lines[i].label[label_len])
+        {
+            is_new = irq_place_line(t, i, label, label_len);
+            if (is_new < 0)
+                return -1;
+        }
+        unsigned long long *prev = &t->prev[(size_t)i * row];
+        for (int c = 0; c < t->ncols; ++c)
+        {
+            // A short line counts as no events on the remaining CPUs
+            if (c > 0 && !scan_ull(&s, eol, &v))
+                v = prev[c];
+            unsigned long long delta = v >= prev[c] ? v - prev[c] : 0;
+            prev[c] = v;
+            if (!valid || is_new || delta == 0)
+                continue;
+            float rate = (float)((double)delta / dt);
+            int cpu_id = t->col_cpu[c];
+            t->total[cpu_id] += rate;
+            int *top = &t->top[(size_t)cpu_id * (size_t)n];
+            float *top_rate = &t->top_rate[(size_t)cpu_id * (size_t)n];
+            int k = n;
+            while (k > 0 && (top[k - 1] < 0 || top_rate[k - 1] < rate))
+                k--;
+            if (k == n)
+                continue;
+            memmove(&top[k + 1], &top[k], (size_t)(n - k - 1) * sizeof(*top));
+            memmove(&top_rate[k + 1], &top_rate[k], (size_t)(n - k - 1) * sizeof(*top_rate));
+            top[k] = i;
+            top_rate[k] = rate;
+        }
+        if (is_new)
+        {
+            // Named after the device at the end of the line, or the label if there is none
+            struct irq_line *line = &t->lines[i];
+            const char *name_end = eol;
+            while (s < name_end && *s == ' ')
+                s++;
+            while (name_end > s && name_end[-1] == ' ')
+                name_end--;
+            const char *name = name_end;
+            while (name > s && name[-1] != ' ')
+                name--;
+            if (name == name_end || !isdigit((unsigned char)*label))
+                name = label, name_end = colon;
+            size_t name_len = (size_t)(name_end - name) < sizeof(line->name) - 1 ? (size_t)(name_end - name) : sizeof(line->name) - 1;
+            memcpy(line->name, name, name_len);
+            line->name[name_len] = '\0';
+        }
+        i++;
+    }
+    t->nlines = i;
+    t->last_ns = now_ns;
+    t->valid = 1;
+    t->rates_valid = valid;
+    return 0;
+}
+
+// Samples both interrupt tables for the irq view
+static void update_irq_stats(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long long now = timespec_ns(&ts);
+    for (int k = 0; k < 2; ++k)
+    {
+        struct irq_table *t = k ? &g_softirqs : &g_interrupts;
+        if (open_optional_file(&t->file) != 0 || (!t->total && irq_table_init(t) != 0))
+            continue;
+        if (irq_table_update(t, now) != 0)
+            t->valid = t->rates_valid = 0;
+    }
+}
+
+// Releases an interrupt table
+static void irq_table_free(struct irq_table *t)
+{
+    if (t->file.fd == -2)
+        t->file.fd = -1;
+    proc_file_close(&t->file);
+    free(t->header);
+    free(t->col_cpu);
+    free(t->lines);
+    free(t->prev);
+    free(t->total);
+    free(t->top);
+    free(t->top_rate);
+}
+
+// Raises the soft limit of open files to the hard limit and returns it, 0 if unknown
+static rlim_t raise_fd_limit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        return 0;
+    if (rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    return rl.rlim_cur;
+}
+
+// Opens one cpuidle file of a CPU: "time", "usage" or "name" of a state
+static int open_idle_file(int cpu_id, int state, const char *file)
+{
+    char path[96];
+    snprintf(path, sizeof(path), CPUIDLE_STATE_FMT, cpu_id, state, file);
+    return open_sys_path(path, 0);
+}
+
+// Reads an unsigned number from an open sysfs file, or opens it for this one read if fd is -1
+static int read_idle_value(int fd, int cpu_id, int state, const char *file, unsigned long long *out)
+{
+    char buf[32];
+    int own = fd < 0;
+    if (own && (fd = open_idle_file(cpu_id, state, file)) < 0)
+        return -1;
+    ssize_t n = pread(fd, buf, sizeof(buf), 0);
+    if (own)
+        close(fd);
+    const char *p = buf;
+    return n > 0 && scan_ull(&p, buf + n, out) ? 0 : -1;
+}
+
+// Closes the kept-open files of a CPU and drops its totals; it is probed again when it is online
+static void idle_forget_cpu(int cpu_id)
+{
+    int *fd = &g_idle.fd[(size_t)cpu_id * IDLE_MAX_STATES * 2];
+    for (int k = 0; k < IDLE_MAX_STATES * 2; ++k)
+    {
+        if (fd[k] >= 0)
+        {
+            close(fd[k]);
+            g_idle.open_fds--;
+        }
+        fd[k] = -1;
+    }
+    g_idle.states[cpu_id] = -1;
+    g_idle.wakeups[cpu_id] = NAN;
+    g_idle.read_ns[cpu_id] = 0;
+}
+
+// Finds the idle states of a CPU and opens their time and usage files (within the fd limit)
+// The state names are taken from the first CPU that has the state.
+static void idle_probe_cpu(int cpu_id)
+{
+    int *fd = &g_idle.fd[(size_t)cpu_id * IDLE_MAX_STATES * 2];
+    int k = 0;
+    for (; k < IDLE_MAX_STATES; ++k)
+    {
+        int time_fd = open_idle_file(cpu_id, k, "time");
+        if (time_fd < 0)
+            break;
+        int usage_fd = open_idle_file(cpu_id, k, "usage");
+        if (usage_fd < 0)
+        {
+            close(time_fd);
+            break;
+        }
+        if (!g_idle.names[k][0])
+        {
+            int name_fd = open_idle_file(cpu_id, k, "name");
+            ssize_t n = name_fd >= 0 ? read(name_fd, g_idle.names[k], sizeof(g_idle.names[k]) - 1) : -1;
+            if (name_fd >= 0)
+                close(name_fd);
+            while (n > 0 && (g_idle.names[k][n - 1] == '\n' || g_idle.names[k][n - 1] == ' '))
+                n--;
+            if (n > 0)
+                g_idle.names[k][n] = '\0';
+            else
+                snprintf(g_idle.names[k], sizeof(g_idle.names[k]), "state%d", k);
+        }
+        // Beyond the fd limit the files are opened for every read
+        if (g_idle.open_fds + 2 > g_idle.fd_limit)
+        {
+            close(time_fd);
+            close(usage_fd);
+            time_fd = usage_fd = -1;
+        }
+        else
+            g_idle.open_fds += 2;
+        fd[k * 2] = time_fd;
+        fd[k * 2 + 1] = usage_fd;
+    }
+    g_idle.states[cpu_id] = k;
+    if (k > g_idle.nstates)
+        g_idle.nstates = k;
+}
+
+// Sizes the per-CPU state of the idle view. Returns -1 without memory
+static int idle_init(void)
+{
+    size_t n = (size_t)g_max_cpus;
+    g_idle.fd = malloc(n * IDLE_MAX_STATES * 2 * sizeof(*g_idle.fd));
+    g_idle.states = malloc(n * sizeof(*g_idle.states));
+    g_idle.time_us = calloc(n * IDLE_MAX_STATES, sizeof(*g_idle.time_us));
+    g_idle.usage = calloc(n * IDLE_MAX_STATES, sizeof(*g_idle.usage));
+    g_idle.share = calloc(n * IDLE_MAX_STATES, sizeof(*g_idle.share));
+    g_idle.wakeups = calloc(n, sizeof(*g_idle.wakeups));
+    g_idle.read_ns = calloc(n, sizeof(*g_idle.read_ns));
+    if (!g_idle.fd || !g_idle.states || !g_idle.time_us || !g_idle.usage || !g_idle.share || !g_idle.wakeups || !g_idle.read_ns)
+        return -1;
+    for (size_t k = 0; k < n * IDLE_MAX_STATES * 2; ++k)
+        g_idle.fd[k] = -1;
+    for (size_t c = 0; c < n; ++c)
+        g_idle.states[c] = -1;
+    // A quarter of the file descriptors at most: cores x states x 2 grows fast
+    rlim_t limit = raise_fd_limit() / 4;
+    g_idle.fd_limit = limit < IDLE_FD_LIMIT ? (int)limit : IDLE_FD_LIMIT;
+    return 0;
+}
+
+// Reads the time and entry count of every idle state of every online CPU in one pass over
+// the kept-open files and computes each state's share of the interval and the wakeup rate
+// (entries into any state per second). The pass is timed, so its cost can be shown.
+static void update_idle_stats(void)
+{
+    if (!g_idle.fd && idle_init() != 0)
+        return;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long long now = timespec_ns(&ts);
+    int files = 0;
+    for (int i = 0; i < g_num_cpus; ++i)
+    {
+        int cpu_id = g_cpu_ids[i];
+        // A CPU that just came online has new cpuidle files
+        if (g_idle.states[cpu_id] >= 0 && !g_snap[g_snap_cur ^ 1].online[cpu_id])
+            idle_forget_cpu(cpu_id);
+        if (g_idle.states[cpu_id] < 0)
+            idle_probe_cpu(cpu_id);
+        int states = g_idle.states[cpu_id];
+        const int *fd = &g_idle.fd[(size_t)cpu_id * IDLE_MAX_STATES * 2];
+        unsigned long long *time_us = &g_idle.time_us[(size_t)cpu_id * IDLE_MAX_STATES];
+        unsigned long long *usage = &g_idle.usage[(size_t)cpu_id * IDLE_MAX_STATES];
+        float *share = &g_idle.share[(size_t)cpu_id * IDLE_MAX_STATES];
+        // Files are only read while the view is shown; a baseline from before it was left is no interval
+        unsigned long long last = g_idle.read_ns[cpu_id];
+        int fresh = last && now > last && now - last <= 2ULL * (unsigned long long)g_interval_us * 1000ULL;
+        double dt = fresh ? (double)(now - last) : 0.0;
+        unsigned long long entries = 0;
+        int failed = 0;
+        for (int k = 0; k < states; ++k)
+        {
+            unsigned long long t, u;
+            failed = read_idle_value(fd[k * 2], cpu_id, k, "time", &t) != 0 || read_idle_value(fd[k * 2 + 1], cpu_id, k, "usage", &u) != 0;
+            files += 2;
+            if (failed)
+                break;
+            share[k] = dt > 0 && t >= time_us[k] ? (float)((double)(t - time_us[k]) * 1e5 / dt) : NAN;
+            entries += u >= usage[k] ? u - usage[k] : 0;
+            time_us[k] = t;
+            usage[k] = u;
+        }
+        // The files of a CPU that went offline are gone; it starts over when it is back
+        if (failed)
+        {
+            idle_forget_cpu(cpu_id);
+            continue;
+        }
+        g_idle.wakeups[cpu_id] = dt > 0 && states > 0 ? (float)((double)entries * 1e9 / dt) : NAN;
+        g_idle.read_ns[cpu_id] = now;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    g_idle.pass_ns = timespec_ns(&ts) - now;
+    g_idle.files = files;
+}
+
+// Closes every kept-open cpuidle file
+static void idle_close(void)
+{
+    for (int c = 0; g_idle.fd && c < g_max_cpus; ++c)
+        idle_forget_cpu(c);
+    free(g_idle.fd);
+    free(g_idle.states);
+    free(g_idle.time_us);
+    free(g_idle.usage);
+    free(g_idle.share);
+    free(g_idle.wakeups);
+    free(g_idle.read_ns);
+}
+
+// Takes one new sample: usage of every core against the previous one, frequencies
+// and temperatures. The results are kept so a frame can be redrawn without sampling again.
+// Returns 1 if the sampler thread had nothing new, -1 on errors.
+static int take_sample(void)
+{
+    unsigned long long start = phase_begin();
+    if (g_sampler.running && !drain_sampler())
+        return 1;
+    // All reads of the sample go out as one batch: /proc/stat (unless the sampler thread
+    // has read it), the frequencies and the temperature inputs
+    double inputs[MAX_TEMP_SENSORS];
+    if (read_sample(!g_sampler.running, g_show_temp ? inputs : NULL) != 0)
+        return -1;
+    if (!g_sampler.running)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        g_sample_realtime_ns = timespec_ns(&ts);
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        g_sample_monotonic_ns = timespec_ns(&ts);
+    }
+    const struct coreusage_snapshot *prev = &g_snap[g_snap_cur ^ 1];
+    const struct coreusage_snapshot *cur = &g_snap[g_snap_cur];
+    handle_cpu_hotplug(prev);
+    coreusage_delta(prev, cur, g_max_cpus, g_usage, g_field_pct);
+    update_sched_stats();
+    update_cpu_pressure();
+    // The interrupt counters and cgroups are only read while they are shown
+    if (g_view == VIEW_IRQ)
+        update_irq_stats();
+    if (g_view == VIEW_CGROUP)
+        update_cgroup_stats();
+    // The mean over the frame is a window too; the peak is never below it
+    for (int c = 0; g_sampler.running && c < g_max_cpus; ++c)
+        if (g_usage[c] > g_sampler.peak[c])
+            g_sampler.peak[c] = g_usage[c];
+    phase_end(PHASE_STAT, start);
+    if (g_show_temp)
+    {
+        start = phase_begin();
+        finish_cpu_temps(inputs);
+        phase_end(PHASE_TEMP, start);
+    }
+    if (g_view == VIEW_IDLE)
+    {
+        start = phase_begin();
+        update_idle_stats();
+        phase_end(PHASE_IDLE, start);
+    }
+    return 0;
+}
+
+// Opens the kept-open /proc directory for --top and sizes the task table
+// The soft fd limit is raised to the hard one, so that many task files can stay open.
+static int top_init(void)
+{
+    g_top.proc_fd = open_sys_path("/proc", O_DIRECTORY);
+    int dir_fd = g_top.proc_fd >= 0 ? dup(g_top.proc_fd) : -1;
+    g_top.proc_dir = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
+    if (!g_top.proc_dir)
+    {
+        fprintf(stderr, "Error: Could not open /proc: %s\n", strerror(errno));
+        return -1;
+    }
+    rlim_t limit = raise_fd_limit();
+    g_top.fd_limit = limit > TOP_FD_RESERVE * 2 ? (int)(limit < INT_MAX ? limit : INT_MAX) - TOP_FD_RESERVE : 0;
+    g_top.hz = sysconf(_SC_CLK_TCK);
+    if (g_top.hz <= 0)
+        g_top.hz = 100;
+    g_top.top = malloc((size_t)g_max_cpus * (size_t)g_top.n * sizeof(*g_top.top));
+    if (!g_top.top)
+    {
+        fprintf(stderr, "Error: Could not allocate the task table.\n");
+        return -1;
+    }
+    for (size_t k = 0; k < (size_t)g_max_cpus * (size_t)g_top.n; ++k)
+        g_top.top[k] = -1;
+    return 0;
+}
+
+// Returns the hash slot of tid: the one holding it, or the empty one it would go to
+static size_t top_slot(int tid)
+{
+    size_t h = ((unsigned)tid * 2654435761u) & g_top.hash_mask;
+    while (g_top.hash[h] >= 0 && g_top.tasks[g_top.hash[h]].tid != tid)
+        h = (h + 1) & g_top.hash_mask;
+    return h;
+}
+
+// Doubles the task table and rebuilds the hash (open addressing, at most half full)
+static int top_grow(void)
+{
+    int cap = g_top.cap ? g_top.cap * 2 : TOP_INITIAL_TASKS;
+    struct task *tasks = realloc(g_top.tasks, (size_t)cap * sizeof(*tasks));
+    if (!tasks)
+        return -1;
+    g_top.tasks = tasks;
+    int *hash = realloc(g_top.hash, (size_t)cap * 2 * sizeof(*hash));
+    if (!hash)
+        return -1;
+    g_top.hash = hash;
+    g_top.cap = cap;
+    g_top.hash_mask = (size_t)cap * 2 - 1;
+    for (size_t h = 0; h <= g_top.hash_mask; ++h)
+        g_top.hash[h] = -1;
+    for (int i = 0; i < g_top.count; ++i)
+        g_top.hash[top_slot(g_top.tasks[i].tid)] = i;
+    return 0;
+}
+
+// Opens the stat file of a task relative to the cached /proc directory
+static int top_open_task(int pid, int tid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "%d/task/%d/stat", pid, tid);
+    return openat(g_top.proc_fd, path, O_RDONLY | O_CLOEXEC);
+}
+
+// Reads the stat file of a task: command name, utime + stime and the CPU it last ran on
+// The usage is the tick increase since the previous read. Returns -1 if the task is gone
+static int top_read_task(struct task *t, unsigned long long now)
+{
+    char *buf = g_top.buf;
+    ssize_t n;
+    if (t->fd >= 0)
+        n = pread(t->fd, buf, sizeof(g_top.buf) - 1, 0);
+    else
+    {
+        // Beyond the fd limit the file is opened for every read
+        int fd = top_open_task(t->pid, t->tid);
+        if (fd < 0)
+            return -1;
+        n = read(fd, buf, sizeof(g_top.buf) - 1);
+        close(fd);
+    }
+    if (n <= 0)
+        return -1;
+    const char *end = buf + n;
+    const char *lp = memchr(buf, '(', (size_t)n);
+    const char *rp = memrchr(buf, ')', (size_t)n);
+    if (!lp || !rp || rp < lp)
+        return -1;
+    size_t len = (size_t)(rp - lp - 1) < sizeof(t->comm) - 1 ? (size_t)(rp - lp - 1) : sizeof(t->comm) - 1;
+    memcpy(t->comm, lp + 1, len);
+    t->comm[len] = '\0';
+    // The command name is field 2; utime is field 14, stime 15 and processor 39
+    unsigned long long utime = 0, stime = 0, cpu = 0;
+    int field = 2;
+    for (const char *p = rp + 1; p < end && field < 39;)
+    {
+        if (*p++ != ' ')
+            continue;
+        field++;
+        if (field == 14)
+            scan_ull(&p, end, &utime);
+        else if (field == 15)
+            scan_ull(&p, end, &stime);
+        else if (field == 39)
+            scan_ull(&p, end, &cpu);
+    }
+    if (field < 39)
+        return -1;
+    unsigned long long ticks = utime + stime;
+    // Falling ticks belong to a new task with a reused tid: its read is the new baseline
+    if (t->read_ns && now > t->read_ns && ticks >= t->ticks)
+        t->pct = (float)(100.0 * (double)(ticks - t->ticks) * 1e9 / (double)g_top.hz / (double)(now - t->read_ns));
+    else if (ticks < t->ticks)
+        t->pct = NAN;
+    t->ticks = ticks;
+    t->read_ns = now;
+    t->cpu = (int)cpu;
+    return 0;
+}
+
+// Starts tracking a task; its first read is the baseline
+static void top_add(int pid, int tid, unsigned long long now)
+{
+    if (g_top.count == g_top.cap && top_grow() != 0)
+        return;
+    struct task *t = &g_top.tasks[g_top.count];
+    *t = (struct task){.tid = tid, .pid = pid, .fd = -1, .cpu = -1, .pct = NAN};
+    if (g_top.open_fds < g_top.fd_limit && (t->fd = top_open_task(pid, tid)) >= 0)
+        g_top.open_fds++;
+    if (top_read_task(t, now) != 0)
+    {
+        if (t->fd >= 0)
+        {
+            close(t->fd);
+            g_top.open_fds--;
+        }
+        return;
+    }
+    g_top.hash[top_slot(tid)] = g_top.count++;
+}
+
+// Stops tracking task i; the last task takes its place
+static void top_remove(int i)
+{
+    struct task *t = &g_top.tasks[i];
+    if (t->fd >= 0)
+    {
+        close(t->fd);
+        g_top.open_fds--;
+    }
+    // Backward-shift deletion keeps every probe sequence intact without tombstones
+    size_t hole = top_slot(t->tid);
+    for (size_t j = (hole + 1) & g_top.hash_mask; g_top.hash[j] >= 0; j = (j + 1) & g_top.hash_mask)
+    {
+        size_t home = ((unsigned)g_top.tasks[g_top.hash[j]].tid * 2654435761u) & g_top.hash_mask;
+        if (((j - home) & g_top.hash_mask) >= ((j - hole) & g_top.hash_mask))
+        {
+            g_top.hash[hole] = g_top.hash[j];
+            hole = j;
+        }
+    }
+    g_top.hash[hole] = -1;
+    int last = --g_top.count;
+    if (i != last)
+    {
+        g_top.tasks[i] = g_top.tasks[last];
+        g_top.hash[top_slot(g_top.tasks[i].tid)] = i;
+    }
+}
+
+// Continues the walk through /proc and starts tracking the tasks not seen before
+// Costs one unit per task directory listed and per new task; the walk starts over at its end.
+// A process with more new threads than the budget is listed over several frames.
+static int top_discover(int budget, unsigned long long now)
+{
+    int cost = 0;
+    while (cost < budget)
+    {
+        if (!g_top.task_dir)
+        {
+            struct dirent *de = readdir(g_top.proc_dir);
+            if (!de)
+            {
+                rewinddir(g_top.proc_dir);
+                break;
+            }
+            if (!isdigit((unsigned char)de->d_name[0]))
+                continue;
+            int pid = atoi(de->d_name);
+            char path[32];
+            snprintf(path, sizeof(path), "%d/task", pid);
+            int fd = openat(g_top.proc_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            cost++;
+            g_top.task_dir = fd >= 0 ? fdopendir(fd) : NULL;
+            if (!g_top.task_dir)
+            {
+                if (fd >= 0)
+                    close(fd);
+                continue;
+            }
+            g_top.task_pid = pid;
+        }
+        for (;;)
+        {
+            if (cost >= budget)
+                return cost;
+            struct dirent *de = readdir(g_top.task_dir);
+            if (!de)
+                break;
+            if (!isdigit((unsigned char)de->d_name[0]))
+                continue;
+            int tid = atoi(de->d_name);
+            if (g_top.cap && g_top.hash[top_slot(tid)] >= 0)
+                continue;
+            top_add(g_top.task_pid, tid, now);
+            cost++;
+        }
+        closedir(g_top.task_dir);
+        g_top.task_dir = NULL;
+    }
+    return cost;
+}
+
+// One incremental scan per frame within the budget of stat reads: known tasks are re-read
+// round-robin through their kept-open files, the rest of the budget walks /proc for new ones.
+// Then the busiest tasks of every CPU are ranked.
+static void top_scan(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long long now = timespec_ns(&ts);
+    // A quarter of the budget is always left for discovery
+    int refresh = g_top.budget - g_top.budget / 4;
+    if (refresh > g_top.count)
+        refresh = g_top.count;
+    for (int done = 0; done < refresh && g_top.count > 0; ++done)
+    {
+        if (g_top.next >= g_top.count)
+            g_top.next = 0;
+        // A removed task is replaced by the last one, which is read next
+        if (top_read_task(&g_top.tasks[g_top.next], now) != 0)
+            top_remove(g_top.next);
+        else
+            g_top.next++;
+    }
+    top_discover(g_top.budget - refresh, now);
+    int n = g_top.n;
+    for (size_t k = 0; k < (size_t)g_max_cpus * (size_t)n; ++k)
+        g_top.top[k] = -1;
+    for (int i = 0; i < g_top.count; ++i)
+    {
+        const struct task *t = &g_top.tasks[i];
+        if (!(t->pct > 0) || t->cpu < 0 || t->cpu >= g_max_cpus || now - t->read_ns > TOP_MAX_AGE_NS)
+            continue;
+        int *top = &g_top.top[(size_t)t->cpu * (size_t)n];
+        int k = n;
+        while (k > 0 && (top[k - 1] < 0 || g_top.tasks[top[k - 1]].pct < t->pct))
+            k--;
+        if (k == n)
+            continue;
+        memmove(&top[k + 1], &top[k], (size_t)(n - k - 1) * sizeof(*top));
+        top[k] = i;
+    }
+}
+
+// Closes every kept-open file of the task scan
+static void top_close(void)
+{
+    for (int i = 0; i < g_top.count; ++i)
+        if (g_top.tasks[i].fd >= 0)
+            close(g_top.tasks[i].fd);
+    if (g_top.task_dir)
+        closedir(g_top.task_dir);
+    if (g_top.proc_dir)
+        closedir(g_top.proc_dir);
+    if (g_top.proc_fd >= 0)
+        close(g_top.proc_fd);
+    free(g_top.tasks);
+    free(g_top.hash);
+    free(g_top.top);
+}
+
+// Prints a bar stacked from the time fields (percent each) at row/col, returns its width
+// Segment ends are rounded from the running sum, so the bar length matches the total.
+// A peak beyond the filled part is marked with a tick (NAN for none).
+static int print_stacked_bar(int row, int col, const float pct[], float peak)
+{
+    int colored = g_use_color && g_fb.fixed;
+    fb_puts(row, col, FB_COLOR_DEFAULT, "[");
+    float sum = 0.0f;
+    int filled = 0;
+    for (int k = 0; k < BAR_SEGMENT_COUNT; ++k)
+    {
+        sum += pct[g_bar_segments[k].field];
+        int end = (int)(sum * g_bar_width / 100.0f + 0.5f);
+        if (end > g_bar_width)
+            end = g_bar_width;
+        if (end > filled)
+        {
+            fb_fill(row, col + 1 + filled, end - filled, g_bar_segments[k].color, colored ? "█" : g_bar_segments[k].letter);
+            filled = end;
+        }
+    }
+    fb_fill(row, col + 1 + filled, g_bar_width - filled, FB_COLOR_DEFAULT, " ");
+    int tick = isnan(peak) ? 0 : (int)(peak * g_bar_width / 100.0f + 0.5f);
+    if (tick > filled)
+    {
+        tick = tick > g_bar_width ? g_bar_width : tick;
+        fb_puts(row, col + tick, peak < 80 ? FB_COLOR_YELLOW : FB_COLOR_RED, "|");
+    }
+    fb_puts(row, col + 1 + g_bar_width, FB_COLOR_DEFAULT, "]");
+    return g_bar_width + 2;
+}
+
+// Prints the time fields (percent each) as numbers at row/col, returns their width
+static int print_field_columns(int row, int col, const float pct[])
+{
+    for (int k = 0; k < FIELD_COLUMN_COUNT; ++k)
+    {
+        int f = g_field_columns[k];
+        float v = f == COREUSAGE_GUEST ? pct[COREUSAGE_GUEST] + pct[COREUSAGE_GUEST_NICE] : pct[f];
+        fb_printf(row, col + k * FIELD_COLUMN_WIDTH, FB_COLOR_DEFAULT, "%*.1f", FIELD_COLUMN_WIDTH, v);
+    }
+    return FIELD_COLUMN_COUNT * FIELD_COLUMN_WIDTH;
+}
+
+// Explains the segments of the stacked bar in one centered line. Returns the next free row
+static int print_bar_legend(int row)
+{
+    if (g_bars != BARS_STACKED)
+        return row;
+    int colored = g_use_color && g_fb.fixed;
+    int width = 0;
+    for (int k = 0; k < BAR_SEGMENT_COUNT; ++k)
+        width += (k ? 2 : 0) + 2 + (int)strlen(g_bar_segments[k].name);
+    int col = fb_center_pad(width);
+    row++;
+    for (int k = 0; k < BAR_SEGMENT_COUNT; ++k)
+    {
+        if (k)
+            col += fb_puts(row, col, FB_COLOR_DEFAULT, "  ");
+        col += fb_puts(row, col, g_bar_segments[k].color, colored ? "█" : g_bar_segments[k].letter);
+        col += fb_printf(row, col, FB_COLOR_DEFAULT, " %s", g_bar_segments[k].name);
+    }
+    return row + 1;
+}
+
+// Draws min, avg, max and p95 of the window and a sparkline of the last samples of one CPU
+static void draw_history_stats(int row, int col, int cpu_id)
+{
+    static const char *const spark[8] = {"▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
+    if (g_hist.count == 0)
+        return;
+    int len = g_hist.len;
+    const unsigned char *values = g_hist.values + (size_t)cpu_id * (size_t)len;
+    int min = values[g_hist.min_q[(size_t)cpu_id * (size_t)len + g_hist.min_head[cpu_id]]];
+    int max = values[g_hist.max_q[(size_t)cpu_id * (size_t)len + g_hist.max_head[cpu_id]]];
+    col += fb_printf(row, col, FB_COLOR_DEFAULT, "  %4d %4.0f %4d %4d  ", min, (double)g_hist.sum[cpu_id] / g_hist.count, max,
+                     g_hist.p95[cpu_id]);
+    // Oldest first; columns without a sample yet stay empty
+    int shown = g_spark_width < g_hist.count ? g_spark_width : g_hist.count;
+    col += g_spark_width - shown;
+    for (int k = shown; k > 0; --k)
+    {
+        int v = values[(g_hist.next + len - k) % len];
+        int color = v < 50 ? FB_COLOR_GREEN : v < 80 ? FB_COLOR_YELLOW : FB_COLOR_RED;
+        col += fb_puts(row, col, color, spark[v * 8 / HISTORY_BINS]);
+    }
+}
+
+// Returns the layout shared by all table rows: label, usage, frequency, bar and temperature
+static struct row_layout table_layout(int label_width, int has_temps, int stats)
+{
+    struct row_layout l;
+    l.label_width = label_width;
+    l.has_temps = has_temps;
+    l.load_width = g_bars == BARS_FIELDS ? FIELD_COLUMN_COUNT * FIELD_COLUMN_WIDTH : g_bar_width + 2;
+    l.stats_width = stats && g_hist.len ? STATS_COLUMN_WIDTH + 2 + g_spark_width : 0;
+    l.peak_width = g_sampler.running ? PEAK_COLUMN_WIDTH : 0;
+    l.wait_width = g_sched.available ? WAIT_COLUMN_WIDTH : 0;
+    l.pad = fb_center_pad(label_width + ROW_VALUES_WIDTH + l.peak_width + l.wait_width + l.load_width +
+                          (has_temps ? TEMP_COLUMN_WIDTH : 0) + l.stats_width);
+    return l;
+}
+
+// Returns the column where the statistics start
+static int stats_column(const struct row_layout *l)
+{
+    return l->pad + l->label_width + ROW_VALUES_WIDTH + l->peak_width + l->wait_width + l->load_width +
+           (l->has_temps ? TEMP_COLUMN_WIDTH : 0);
+}
+
+// Draws the centered title and the column header of a table. Returns the next free row
+static int draw_table_header(int row, const struct row_layout *l, const char *title, const char *label_title)
+{
+    row++;
+    fb_centered(row++, FB_COLOR_DEFAULT, "=== %s ===", title);
+    row++;
+    int col = l->pad;
+    col += fb_printf(row, col, FB_COLOR_DEFAULT, "%-*s %7s", l->label_width, label_title, "Usage");
+    if (l->peak_width)
+        col += fb_printf(row, col, FB_COLOR_DEFAULT, " %7s", "Peak");
+    if (l->wait_width)
+        col += fb_printf(row, col, FB_COLOR_DEFAULT, " %7s", "Wait");
+    col += fb_printf(row, col, FB_COLOR_DEFAULT, "  %12s  ", "Frequency");
+    if (g_bars == BARS_FIELDS)
+    {
+        for (int k = 0; k < FIELD_COLUMN_COUNT; ++k)
+            col += fb_printf(row, col, FB_COLOR_DEFAULT, "%*s", FIELD_COLUMN_WIDTH, g_field_titles[k]);
+    }
+    else
+        fb_puts(row, col + (l->load_width - 4) / 2, FB_COLOR_DEFAULT, "Load");
+    if (l->stats_width)
+        fb_printf(row, stats_column(l), FB_COLOR_DEFAULT, "  %4s %4s %4s %4s  %s", "min", "avg", "max", "p95", g_spark_width ? "History" : "");
+    return row + 1;
+}
+
+// Formats a run delay in at most 7 characters: "35us", "1.2ms", "2.5s", "-" if unknown
+static void format_wait(char *buf, size_t n, float wait_ns)
+{
+    if (isnan(wait_ns))
+        snprintf(buf, n, "-");
+    else if (wait_ns < 1e6f)
+        snprintf(buf, n, "%.0fus", wait_ns / 1e3f);
+    else if (wait_ns < 1e9f)
+        snprintf(buf, n, "%.1fms", wait_ns / 1e6f);
+    else
+        snprintf(buf, n, "%.1fs", wait_ns / 1e9f);
+}
+
+// Draws one table row: label, usage, run delay, frequency, usage bar and optional temperature
+// The run delay per timeslice tells a saturated CPU with waiting tasks from a merely busy one.
+static void draw_usage_row(int row, const struct row_layout *l, const char *label, float usage, float peak, float wait_ns,
+                           const float pct[], unsigned int freq_khz, double temp)
+{
+    int col = l->pad;
+    col += fb_printf(row, col, FB_COLOR_DEFAULT, "%-*s %6.1f%%", l->label_width, label, usage);
+    if (l->peak_width)
+    {
+        int color = peak < 50 ? FB_COLOR_DEFAULT : peak < 80 ? FB_COLOR_YELLOW : FB_COLOR_RED;
+        col += fb_printf(row, col, color, " %6.1f%%", peak);
+    }
+    if (l->wait_width)
+    {
+        char wait[16];
+        format_wait(wait, sizeof(wait), wait_ns);
+        int color = !(wait_ns >= WAIT_WARN_NS) ? FB_COLOR_DEFAULT : wait_ns < WAIT_CRIT_NS ? FB_COLOR_YELLOW : FB_COLOR_RED;
+        col += fb_printf(row, col, color, " %7s", wait);
+    }
+    if (g_freq_source == COREUSAGE_FREQ_NONE)
+        col += fb_printf(row, col, FB_COLOR_DEFAULT, "  %8s MHz  ", "n/a");
+    else
+        col += fb_printf(row, col, FB_COLOR_DEFAULT, "  %8.2f MHz  ", freq_khz / 1000.0f);
+    if (g_bars == BARS_FIELDS)
+        col += print_field_columns(row, col, pct);
+    else
+        col += print_stacked_bar(row, col, pct, l->peak_width ? peak : NAN);
+    // Temperature goes after the bar
+    if (!isnan(temp))
+        fb_printf(row, col, FB_COLOR_DEFAULT, " %3.0f°C", temp);
+}
+
+// Returns the number of digits needed for the highest possible CPU id (at least 3)
+static int cpu_id_width(void)
+{
+    int id_width = 3;
+    for (int n = g_max_cpus - 1; n >= 1000; n /= 10)
+        id_width++;
+    return id_width;
+}
+
+// Draws one row per online CPU. Returns the next free row
+static int draw_cpu_rows(int row)
+{
+    int has_temps = 0;
+    for (int i = 0; i < g_num_cpus && g_show_temp && !has_temps; ++i)
+        has_temps = !isnan(g_cpu_temp[g_cpu_ids[i]]);
+    int id_width = cpu_id_width();
+    struct row_layout l = table_layout(4 + id_width, has_temps, g_show_stats);
+    row = draw_table_header(row, &l, "CPU Usage & Frequency per Core", "Core");
+    for (int i = 0; i < g_num_cpus; ++i)
+    {
+        // Rows below the visible area are not drawn at all
+        if (g_fb.fixed && row >= g_fb.rows)
+            break;
+        int cpu_id = g_cpu_ids[i];
+        char label[24];
+        snprintf(label, sizeof(label), "CPU %d", cpu_id);
+        float pct[COREUSAGE_FIELDS];
+        for (int f = 0; f < COREUSAGE_FIELDS; ++f)
+            pct[f] = g_field_pct[f][cpu_id];
+        float peak = g_sampler.running ? g_sampler.peak[cpu_id] : NAN;
+        draw_usage_row(row, &l, label, g_usage[cpu_id], peak, g_sched.wait_ns[cpu_id], pct, g_freq_khz[cpu_id],
+                       g_show_temp ? g_cpu_temp[cpu_id] : NAN);
+        if (l.stats_width)
+            draw_history_stats(row, stats_column(&l), cpu_id);
+        row++;
+    }
+    return row;
+}
+
+// Draws one aggregated row per group (physical core, NUMA node or socket). Returns the next free row
+static int draw_group_rows(int row, int kind, const char *title)
+{
+    const struct cpu_groups *g = &g_groups[kind];
+    aggregate_cpu_groups(kind);
+    int label_width = 7;
+    int has_temps = 0;
+    for (int j = 0; j < g->count; ++j)
+    {
+        int w = utf8_width(g->label[j]);
+        if (w > label_width)
+            label_width = w;
+        has_temps |= !isnan(g->temp[j]);
+    }
+    struct row_layout l = table_layout(label_width, has_temps, 0);
+    row = draw_table_header(row, &l, title, g_group_titles[kind]);
+    for (int j = 0; j < g->count; ++j)
+    {
+        if (g_fb.fixed && row >= g_fb.rows)
+            break;
+        // Groups whose CPUs are all offline are skipped
+        if (g->online[j] == 0)
+            continue;
+        draw_usage_row(row++, &l, g->label[j], g->usage[j], g->peak[j], g->wait_ns[j], g->field_pct[j], (unsigned int)g->freq_khz[j],
+                       g->temp[j]);
+    }
+    return row;
+}
+
+// Draws a dense grid with the usage of every online CPU, as many per line as fit
+// Each line starts with the id of its first CPU. Returns the next free row
+static int draw_heat_grid(int row)
+{
+    int id_width = cpu_id_width();
+    int label_width = id_width + 2;
+    int per_row = (g_fb.cols - label_width) / HEAT_CELL_WIDTH;
+    // Multiples of 8 keep the line starts at easy-to-read ids
+    if (per_row >= 8)
+        per_row -= per_row % 8;
+    if (per_row < 1)
+        per_row = 1;
+    row++;
+    fb_centered(row++, FB_COLOR_DEFAULT, "=== Usage per CPU ===");
+    row++;
+    int pad = fb_center_pad(label_width + per_row * HEAT_CELL_WIDTH);
+    for (int i = 0; i < g_num_cpus; i += per_row)
+    {
+        if (g_fb.fixed && row >= g_fb.rows)
+            break;
+        int col = pad + fb_printf(row, pad, FB_COLOR_DEFAULT, "%*d: ", id_width, g_cpu_ids[i]);
+        for (int k = i; k < g_num_cpus && k < i + per_row; ++k)
+        {
+            float usage = g_usage[g_cpu_ids[k]];
+            int color = usage < HEAT_IDLE_PERCENT ? FB_COLOR_GRAY : usage < 50 ? FB_COLOR_GREEN : usage < 80 ? FB_COLOR_YELLOW : FB_COLOR_RED;
+            col += fb_printf(row, col, color, "%3.0f ", usage);
+        }
+        row++;
+    }
+    return row;
+}
+
+// Formats events per second in at most 6 characters: "950", "12.3k", "1.2M"
+static void format_rate(char *buf, size_t n, float rate)
+{
+    if (rate < 10000.0f)
+        snprintf(buf, n, "%.0f", rate);
+    else if (rate < 1e6f)
+        snprintf(buf, n, "%.1fk", rate / 1e3f);
+    else
+        snprintf(buf, n, "%.1fM", rate / 1e6f);
+}
+
+// Draws up to shown of the busiest lines of one CPU in an interrupt table, one every entry_width + 2 columns
+static void draw_irq_top(int row, int col, const struct irq_table *t, int cpu_id, int shown, int name_width, int entry_width)
+{
+    if (!t->rates_valid)
+        return;
+    const int *top = &t->top[(size_t)cpu_id * (size_t)t->top_n];
+    const float *top_rate = &t->top_rate[(size_t)cpu_id * (size_t)t->top_n];
+    for (int k = 0; k < shown && top[k] >= 0; ++k)
+    {
+        char rate[16];
+        format_rate(rate, sizeof(rate), top_rate[k]);
+        fb_printf(row, col + k * (entry_width + 2), FB_COLOR_DEFAULT, "%-*.*s %6s", name_width, name_width, t->lines[top[k]].name, rate);
+    }
+}
+
+// Draws one row per online CPU with its interrupt and softirq time, the event rates of
+// /proc/interrupts and /proc/softirqs and the busiest interrupt lines and softirq types.
+// Returns the next free row
+static int draw_irq_rows(int row)
+{
+    int id_width = cpu_id_width();
+    int label_width = 4 + id_width;
+    // Label, usage, irq and softirq time, the two rates, then as many of the busiest lines as fit
+    int irq_col = label_width + 44;
+    int room = g_fb.cols - irq_col;
+    int irq_shown = (room - SOFTIRQ_ENTRY_WIDTH - 2) / (IRQ_ENTRY_WIDTH + 2);
+    irq_shown = irq_shown < 1 ? 1 : irq_shown > IRQ_TOP ? IRQ_TOP : irq_shown;
+    int softirq_col = irq_col + irq_shown * (IRQ_ENTRY_WIDTH + 2);
+    int softirq_shown = (g_fb.cols - softirq_col) / (SOFTIRQ_ENTRY_WIDTH + 2);
+    softirq_shown = softirq_shown < 0 ? 0 : softirq_shown > SOFTIRQ_TOP ? SOFTIRQ_TOP : softirq_shown;
+    int pad = fb_center_pad(softirq_col + softirq_shown * (SOFTIRQ_ENTRY_WIDTH + 2));
+    row++;
+    fb_centered(row++, FB_COLOR_DEFAULT, "=== Interrupts & Softirqs per Core ===");
+    row++;
+    if (g_interrupts.file.fd < 0 && g_softirqs.file.fd < 0)
+    {
+        // Replays, attached viewers and hosts without the files have no counters
+        fb_centered(row, FB_COLOR_GRAY, "Interrupt counters are only read while sampling a host that has %s", INTERRUPTS_FILE);
+        return row + 1;
+    }
+    fb_printf(row, pad, FB_COLOR_DEFAULT, "%-*s %7s %6s %6s %9s %9s", label_width, "Core", "Usage", "irq", "sirq", "IRQ/s",
+              "Softirq/s");
+    fb_puts(row, pad + irq_col, FB_COLOR_DEFAULT, "Top IRQs");
+    if (softirq_shown)
+        fb_puts(row, pad + softirq_col, FB_COLOR_DEFAULT, "Top softirqs");
+    row++;
+    for (int i = 0; i < g_num_cpus; ++i)
+    {
+        if (g_fb.fixed && row >= g_fb.rows)
+            break;
+        int cpu_id = g_cpu_ids[i];
+        char irqs[16] = "-", softirqs[16] = "-";
+        if (g_interrupts.rates_valid)
+            format_rate(irqs, sizeof(irqs), g_interrupts.total[cpu_id]);
+        if (g_softirqs.rates_valid)
+            format_rate(softirqs, sizeof(softirqs), g_softirqs.total[cpu_id]);
+        float irq_pct = g_field_pct[COREUSAGE_IRQ][cpu_id];
+        float softirq_pct = g_field_pct[COREUSAGE_SOFTIRQ][cpu_id];
+        int col = pad + fb_printf(row, pad, FB_COLOR_DEFAULT, "CPU %-*d %6.1f%%", id_width, cpu_id, g_usage[cpu_id]);
+        // Interrupt time is drawn in the colors of its bar segments once it is noticeable
+        col += fb_printf(row, col, irq_pct >= 1.0f ? FB_COLOR_MAGENTA : FB_COLOR_DEFAULT, " %5.1f%%", irq_pct);
+        col += fb_printf(row, col, softirq_pct >= 1.0f ? FB_COLOR_YELLOW : FB_COLOR_DEFAULT, " %5.1f%%", softirq_pct);
+        fb_printf(row, col, FB_COLOR_DEFAULT, " %9s %9s", irqs, softirqs);
+        draw_irq_top(row, pad + irq_col, &g_interrupts, cpu_id, irq_shown, 14, IRQ_ENTRY_WIDTH);
+        draw_irq_top(row, pad + softirq_col, &g_softirqs, cpu_id, softirq_shown, 8, SOFTIRQ_ENTRY_WIDTH);
+        row++;
+    }
+    return row;
+}
+
+// Formats a percentage with one decimal, "-" if unknown
+static void format_percent(char *buf, size_t n, float pct)
+{
+    if (isnan(pct))
+        snprintf(buf, n, "-");
+    else
+        snprintf(buf, n, "%.1f%%", pct);
+}
+
+// Draws the busiest cgroups of the subtree, one row each: CPU time, its share of the cpuset,
+// the mean usage of the cpuset's CPUs (all tenants), throttling and the cpuset itself.
+// Returns the next free row
+static int draw_cgroup_rows(int row)
+{
+    row++;
+    fb_centered(row++, FB_COLOR_DEFAULT, "=== CPU Usage per Cgroup ===");
+    row++;
+    if (g_cgroup.root_fd < 0)
+    {
+        // Replays, attached viewers and hosts without cgroup v2 there have no groups
+        fb_centered(row, FB_COLOR_GRAY, "Cgroups are only read while sampling a host with cgroup v2 at %s", g_cgroup.dir);
+        return row + 1;
+    }
+    int rows = g_fb.fixed ? g_fb.rows - row - 6 : CGROUP_MAX_ROWS;
+    rows = rows < 1 ? 1 : rows > g_cgroup.count ? g_cgroup.count : rows;
+    int *order = realloc(g_cgroup.order, (size_t)(rows > 0 ? rows : 1) * sizeof(*order));
+    if (!order)
+        return row;
+    g_cgroup.order = order;
+    // Partial insertion sort: only the shown groups are ranked
+    int shown = 0;
+    for (int i = 0; i < g_cgroup.count; ++i)
+    {
+        float usage = g_cgroup.groups[i].usage_pct;
+        if (isnan(usage))
+            usage = -1.0f;
+        int k = shown < rows ? shown++ : rows;
+        while (k > 0 && !(g_cgroup.groups[order[k - 1]].usage_pct >= usage))
+        {
+            if (k < rows)
+                order[k] = order[k - 1];
+            k--;
+        }
+        if (k < rows)
+            order[k] = i;
+    }
+    int name_width = 6;
+    for (int k = 0; k < shown; ++k)
+    {
+        int len = (int)strlen(g_cgroup.groups[order[k]].path);
+        name_width = len > name_width ? len : name_width;
+    }
+    name_width = name_width < CGROUP_NAME_MAX ? name_width : CGROUP_NAME_MAX;
+    int pad = fb_center_pad(name_width + 48 + 16);
+    fb_printf(row++, pad, FB_COLOR_DEFAULT, "%-*s %8s %5s %7s %7s %9s  %s", name_width, "Cgroup", "Usage", "CPUs", "Share", "Cores",
+              "Throttled", "Cpuset");
+    const unsigned char *online = g_snap[g_snap_cur].online;
+    for (int k = 0; k < shown; ++k)
+    {
+        const struct cgroup *g = &g_cgroup.groups[order[k]];
+        // Long paths keep their end, which names the container
+        const char *name = g->path;
+        size_t len = strlen(name);
+        char short_name[CGROUP_NAME_MAX + 1];
+        if (len > (size_t)name_width)
+        {
+            snprintf(short_name, sizeof(short_name), "...%s", name + len - (size_t)(name_width - 3));
+            name = short_name;
+        }
+        // How busy the pinned CPUs are, including everyone else running there
+        // Without a known cpuset that is every CPU
+        float sum = 0.0f;
+        int n = 0;
+        for (int c = 0; c < g_max_cpus; ++c)
+            if ((!g->cpus || g->cpus[c]) && online[c])
+            {
+                sum += g_usage[c];
+                n++;
+            }
+        float cores = n ? sum / (float)n : NAN;
+        int ncpus = g->ncpus ? g->ncpus : g_num_cpus;
+        float share = g->usage_pct / (float)ncpus;
+        int color = !(share >= 50) ? FB_COLOR_DEFAULT : share < 80 ? FB_COLOR_YELLOW : FB_COLOR_RED;
+        char usage_text[16], share_text[16], cores_text[16], throttled_text[16];
+        format_percent(usage_text, sizeof(usage_text), g->usage_pct);
+        format_percent(share_text, sizeof(share_text), share);
+        format_percent(cores_text, sizeof(cores_text), cores);
+        format_percent(throttled_text, sizeof(throttled_text), g->throttled_pct);
+        int col = pad + fb_printf(row, pad, FB_COLOR_DEFAULT, "%-*s", name_width, name);
+        col += fb_printf(row, col, color, " %8s %5d %7s", usage_text, ncpus, share_text);
+        col += fb_printf(row, col, FB_COLOR_DEFAULT, " %7s", cores_text);
+        color = !(g->throttled_pct >= 1) ? FB_COLOR_DEFAULT : g->throttled_pct < 10 ? FB_COLOR_YELLOW : FB_COLOR_RED;
+        col += fb_printf(row, col, color, " %9s", throttled_text);
+        fb_printf(row, col, FB_COLOR_DEFAULT, "  %.16s", g->cpuset ? g->cpuset : "all");
+        row++;
+    }
+    if (g_cgroup.count > shown)
+        fb_centered(row++, FB_COLOR_GRAY, "... and %d more of %d cgroups", g_cgroup.count - shown, g_cgroup.count);
+    return row;
+}
+
+// Draws one row per online CPU with its usage, the wakeup rate and the share of the interval
+// spent in each idle state, shallow to deep, followed by the cost of reading them.
+// Returns the next free row
+static int draw_idle_rows(int row)
+{
+    row++;
+    fb_centered(row++, FB_COLOR_DEFAULT, "=== Idle States per Core ===");
+    row++;
+    if (!g_idle.fd || !g_idle.nstates)
+    {
+        // Replays, attached viewers, virtual machines and hosts without a cpuidle driver have no states
+        fb_centered(row, FB_COLOR_GRAY, "Idle states are only read while sampling a host with cpuidle in sysfs");
+        return row + 1;
+    }
+    int id_width = cpu_id_width();
+    int label_width = 4 + id_width;
+    int fixed_width = label_width + 8 + IDLE_WAKEUP_WIDTH;
+    int shown = (g_fb.cols - fixed_width) / IDLE_COLUMN_WIDTH;
+    shown = shown < 1 ? 1 : shown > g_idle.nstates ? g_idle.nstates : shown;
+    int pad = fb_center_pad(fixed_width + shown * IDLE_COLUMN_WIDTH);
+    int col = pad + fb_printf(row, pad, FB_COLOR_DEFAULT, "%-*s %7s %8s", label_width, "Core", "Usage", "Wakeup/s");
+    for (int k = 0; k < shown; ++k)
+        col += fb_printf(row, col, FB_COLOR_DEFAULT, " %6.6s", g_idle.names[k]);
+    row++;
+    for (int i = 0; i < g_num_cpus; ++i)
+    {
+        if (g_fb.fixed && row >= g_fb.rows - 1)
+            break;
+        int cpu_id = g_cpu_ids[i];
+        const float *share = &g_idle.share[(size_t)cpu_id * IDLE_MAX_STATES];
+        int states = g_idle.states[cpu_id];
+        char wakeups[16] = "-";
+        if (!isnan(g_idle.wakeups[cpu_id]))
+            format_rate(wakeups, sizeof(wakeups), g_idle.wakeups[cpu_id]);
+        col = pad + fb_printf(row, pad, FB_COLOR_DEFAULT, "CPU %-*d %6.1f%% %8s", id_width, cpu_id, g_usage[cpu_id], wakeups);
+        for (int k = 0; k < shown; ++k)
+        {
+            char text[16];
+            format_percent(text, sizeof(text), k < states ? share[k] : NAN);
+            col += fb_printf(row, col, FB_COLOR_DEFAULT, " %6s", text);
+        }
+        row++;
+    }
+    // The pass reads two files per CPU and state, so its cost grows with both
+    fb_centered(row++, FB_COLOR_GRAY, "cpuidle: %d files read in %.0f µs, %d kept open", g_idle.files, (double)g_idle.pass_ns / 1e3,
+                g_idle.open_fds);
+    return row;
+}
+
+// Draws the table of the selected view
+// Uses the values collected by the last call to take_sample(). Returns the next free row
+int print_core_usage_bars(int row)
+{
+    switch (g_view)
+    {
+    case VIEW_CORE:
+        row = draw_group_rows(row, GROUP_CORE, "CPU Usage & Frequency per Physical Core");
+        break;
+    case VIEW_NODE:
+        row = draw_group_rows(row, GROUP_NODE, "CPU Usage & Frequency per NUMA Node");
+        break;
+    case VIEW_SOCKET:
+        row = draw_group_rows(row, GROUP_SOCKET, "CPU Usage & Frequency per Socket");
+        break;
+    case VIEW_COMPACT:
+        row = draw_group_rows(row, GROUP_SOCKET, "CPU Usage & Frequency per Socket");
+        row = draw_group_rows(row, GROUP_NODE, "CPU Usage & Frequency per NUMA Node");
+        row = draw_heat_grid(row);
+        break;
+    case VIEW_IRQ:
+        // No load bars here, so no legend either
+        return draw_irq_rows(row);
+    case VIEW_CGROUP:
+        return draw_cgroup_rows(row);
+    case VIEW_IDLE:
+        return draw_idle_rows(row);
+    default:
+        row = draw_cpu_rows(row);
+        break;
+    }
+    return print_bar_legend(row);
+}
+
+// Lists the busiest tasks of every CPU at or above TOP_HOT_PERCENT. Returns the next free row
+// A task counts for the CPU it last ran on.
+static int print_top_tasks(int row)
+{
+    int shown = 0, hot = 0;
+    for (int i = 0; i < g_num_cpus; ++i)
+        hot += g_usage[g_cpu_ids[i]] >= TOP_HOT_PERCENT;
+    if (!hot)
+    {
+        fb_centered(row, FB_COLOR_GRAY, "Top tasks: no CPU at or above %d%%", TOP_HOT_PERCENT);
+        return row + 1;
+    }
+    fb_centered(row++, FB_COLOR_DEFAULT, "Top tasks of the CPUs at or above %d%%:", TOP_HOT_PERCENT);
+    for (int i = 0; i < g_num_cpus && shown < TOP_MAX_ROWS; ++i)
+    {
+        int cpu_id = g_cpu_ids[i];
+        if (g_usage[cpu_id] < TOP_HOT_PERCENT)
+            continue;
+        char line[256];
+        int len = snprintf(line, sizeof(line), "CPU %*d %5.1f%%:", cpu_id_width(), cpu_id, g_usage[cpu_id]);
+        const int *top = &g_top.top[(size_t)cpu_id * (size_t)g_top.n];
+        for (int k = 0; k < g_top.n && top[k] >= 0 && len < (int)sizeof(line); ++k)
+        {
+            const struct task *t = &g_top.tasks[top[k]];
+            if (t->tid == t->pid)
+                len += snprintf(line + len, sizeof(line) - (size_t)len, "  %s[%d] %.1f%%", t->comm, t->pid, t->pct);
+            else
+                len += snprintf(line + len, sizeof(line) - (size_t)len, "  %s[%d/%d] %.1f%%", t->comm, t->pid, t->tid, t->pct);
+        }
+        if (top[0] < 0 && len < (int)sizeof(line))
+            snprintf(line + len, sizeof(line) - (size_t)len, "  (not found yet)");
+        fb_centered(row++, FB_COLOR_DEFAULT, "%s", line);
+        shown++;
+    }
+    if (hot > shown)
+        fb_centered(row++, FB_COLOR_GRAY, "... and %d more", hot - shown);
+    return row;
+}
+
+// Helper function: Draws the CPU temperature line
+// Shows the hottest package sensor, or the first temperature found if there is none.
+// Returns the next free row
+int print_cpu_temperature(int row)
+{
+    int found = 0;
+    double temp_value = 0.0;
+    // A replay or an attached viewer has no sensor table, only the per-CPU values
+    for (int i = 0; g_num_temps == 0 && i < g_num_cpus; ++i)
+    {
+        double t = g_cpu_temp[g_cpu_ids[i]];
+        if (!isnan(t) && (!found || t > temp_value))
+            temp_value = t;
+        found |= !isnan(t);
+    }
+    for (int pass = 0; pass < 2 && !found; ++pass)
+    {
+        for (int j = 0; j < g_num_temps; ++j)
+        {
+            const struct temp_sensor *t = &g_temps[j];
+            if (isnan(t->value) || (pass == 0 && t->kind != TEMP_KIND_PACKAGE))
+                continue;
+            if (!found || t->value > temp_value)
+                temp_value = t->value;
+            found = 1;
+            if (pass == 1)
+                break;
+        }
+    }
+    row++;
+    if (found)
+    {
+        // Build temperature line exactly like a core line
+        char line[64];
+        snprintf(line, sizeof(line), "CPU Temp: %3.1f°C ", temp_value);
+        int col = fb_center_pad(utf8_width(line) + g_bar_width + 2);
+        col += fb_puts(row, col, FB_COLOR_DEFAULT, line);
+        // Normalize temperature to 0-100% (when >100°C, the bar is full)
+        float percent = temp_value;
+        if (percent < 0)
+            percent = 0;
+        if (percent > 100)
+            percent = 100;
+        print_bar(row, col, percent);
+    }
+    else
+    {
+        fb_centered(row, FB_COLOR_DEFAULT, "CPU temperature: not available");
+    }
+    return row + 1;
+}
+
+// Draws the CPU pressure line: the share of the last interval in which tasks were stalled
+// waiting for a CPU, and the kernel's 10 s averages. Returns the next free row
+static int print_cpu_pressure(int row)
+{
+    float some = g_psi.some_pct;
+    int color = !(some >= PSI_WARN_PERCENT) ? FB_COLOR_DEFAULT : some < PSI_CRIT_PERCENT ? FB_COLOR_YELLOW : FB_COLOR_RED;
+    if (isnan(some))
+        fb_centered(row, color, "CPU pressure: some - full -  (avg10 some %.2f%% full %.2f%%)", g_psi.some_avg10, g_psi.full_avg10);
+    else
+        fb_centered(row, color, "CPU pressure: some %.1f%% full %.1f%%  (avg10 some %.2f%% full %.2f%%)", some, g_psi.full_pct,
+                    g_psi.some_avg10, g_psi.full_avg10);
+    return row + 1;
+}
+
+// Formats a duration with three significant digits and a fitting unit
+static void format_duration(char *buf, size_t n, unsigned long long ns)
+{
+    if (ns < 1000)
+        snprintf(buf, n, "%llu ns", ns);
+    else if (ns < 1000000)
+        snprintf(buf, n, "%.3g µs", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(buf, n, "%.3g ms", ns / 1e6);
+    else
+        snprintf(buf, n, "%.3g s", ns / 1e9);
+}
+
+// Draws the cost of coreusage itself: own resource usage over the last interval and
+// last, mean, median, p99 and maximum duration of every phase. Returns the next free row
+static int print_self_stats(int row)
+{
+    enum { NAME_WIDTH = 7, VALUE_WIDTH = 10 };
+    static const char *const titles[] = {"last", "mean", "p50", "p99", "max"};
+    char syscalls[32] = "n/a";
+    if (g_self.d_syscalls >= 0)
+        snprintf(syscalls, sizeof(syscalls), "%lld", g_self.d_syscalls);
+    fb_centered(row++, FB_COLOR_DEFAULT, "Self: %.2f%% CPU, %s syscalls and %llu context switches per sample, RSS %.1f MiB",
+                g_self.cpu_pct, syscalls, g_self.d_ctx_switches, g_self.rss_kib / 1024.0);
+    int col = fb_center_pad(NAME_WIDTH + 5 * VALUE_WIDTH);
+    fb_puts(row, col, FB_COLOR_DEFAULT, "Phase");
+    for (int i = 0; i < 5; ++i)
+        fb_puts(row, col + NAME_WIDTH + (i + 1) * VALUE_WIDTH - (int)strlen(titles[i]), FB_COLOR_DEFAULT, titles[i]);
+    row++;
+    for (int phase = 0; phase < PHASE_COUNT; ++phase)
+    {
+        if (!g_self.count[phase])
+            continue;
+        unsigned long long values[5] = {
+            g_self.last_ns[phase],
+            g_self.sum_ns[phase] / g_self.count[phase],
+            phase_quantile(phase, 0.5),
+            phase_quantile(phase, 0.99),
+            g_self.max_ns[phase],
+        };
+        fb_puts(row, col, FB_COLOR_DEFAULT, g_phase_names[phase]);
+        for (int i = 0; i < 5; ++i)
+        {
+            char buf[32];
+            format_duration(buf, sizeof(buf), values[i]);
+            fb_puts(row, col + NAME_WIDTH + (i + 1) * VALUE_WIDTH - utf8_width(buf), FB_COLOR_DEFAULT, buf);
+        }
+        row++;
+    }
+    return row;
+}
+
+// Appends the decimal representation of v without stdio formatting
+static char *fmt_u64(char *p, unsigned long long v)
+{
+    char tmp[20];
+    int n = 0;
+    do
+    {
+        tmp[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    while (n)
+        *p++ = tmp[--n];
+    return p;
+}
+
+// Appends v / 10^decimals with exactly `decimals` fraction digits; v may be negative
+static char *fmt_fixed(char *p, long long v, int decimals)
+{
+    if (v < 0)
+    {
+        *p++ = '-';
+        v = -v;
+    }
+    unsigned long long scale = 1;
+    for (int i = 0; i < decimals; ++i)
+        scale *= 10;
+    p = fmt_u64(p, (unsigned long long)v / scale);
+    if (decimals > 0)
+    {
+        unsigned long long frac = (unsigned long long)v % scale;
+        *p++ = '.';
+        for (scale /= 10; scale > 0; scale /= 10)
+        {
+            *p++ = (char)('0' + frac / scale);
+            frac %= scale;
+        }
+    }
+    return p;
+}
+
+// Appends a string literal
+static char *fmt_str(char *p, const char *s)
+{
+    while (*s)
+        *p++ = *s++;
+    return p;
+}
+
+// Rounds a value to an integer number of 1/scale units
+static long long scaled_round(double v, int scale)
+{
+    v *= scale;
+    return (long long)(v < 0 ? v - 0.5 : v + 0.5);
+}
+
+// Stores little-endian integers independent of the host byte order
+static void put_le16(unsigned char *p, uint16_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    put_le16(p, (uint16_t)v);
+    put_le16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+    put_le32(p, (uint32_t)v);
+    put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+// Allocates the record buffer once; its size only depends on the number of possible CPUs
+static int init_record_output(void)
+{
+    g_record_cap = RECORD_HEADER_BYTES + RECORD_SELF_BYTES + (size_t)g_max_cpus * RECORD_BYTES_PER_CPU;
+    g_record_buf = malloc(g_record_cap);
+    if (!g_record_buf)
+        return -1;
+    if (g_output == OUTPUT_CSV)
+    {
+        // Header line: one column triple for every possible CPU, so hotplug keeps the layout
+        int fd = STDOUT_FILENO;
+        char *p = fmt_str(g_record_buf, "timestamp");
+        for (int cpu_id = 0; cpu_id < g_max_cpus; ++cpu_id)
+        {
+            if ((size_t)(p - g_record_buf) + RECORD_BYTES_PER_CPU > g_record_cap)
+            {
+                if (write_all(fd, g_record_buf, (size_t)(p - g_record_buf)) != 0)
+                    return -1;
+                p = g_record_buf;
+            }
+            p = fmt_str(p, ",cpu");
+            p = fmt_u64(p, (unsigned)cpu_id);
+            p = fmt_str(p, "_usage,cpu");
+            p = fmt_u64(p, (unsigned)cpu_id);
+            p = fmt_str(p, "_mhz,cpu");
+            p = fmt_u64(p, (unsigned)cpu_id);
+            p = fmt_str(p, "_temp");
+        }
+        if (g_self.enabled)
+        {
+            p = fmt_str(p, ",self_cpu_pct,self_syscalls,self_ctx_switches,self_rss_kib");
+            for (int phase = 0; phase < PHASE_COUNT; ++phase)
+            {
+                p = fmt_str(p, ",self_");
+                p = fmt_str(p, g_phase_names[phase]);
+                p = fmt_str(p, "_ns");
+            }
+        }
+        *p++ = '\n';
+        return write_all(fd, g_record_buf, (size_t)(p - g_record_buf));
+    }
+    return 0;
+}
+
+// Appends the --self-stats values in record order: own CPU in percent, syscalls (sep_null
+// if unknown), context switches, resident size in KiB, then the latest duration of every phase
+static char *format_self_values(char *p, const char *const names[], const char *sep_null)
+{
+    long long values[4 + PHASE_COUNT] = {scaled_round(g_self.cpu_pct, 100), g_self.d_syscalls,
+                                         (long long)g_self.d_ctx_switches, (long long)g_self.rss_kib};
+    for (int phase = 0; phase < PHASE_COUNT; ++phase)
+        values[4 + phase] = (long long)g_self.last_ns[phase];
+    for (int i = 0; i < 4 + PHASE_COUNT; ++i)
+    {
+        p = fmt_str(p, names[i]);
+        if (i == 0)
+            p = fmt_fixed(p, values[i], 2);
+        else if (values[i] < 0)
+            p = fmt_str(p, sep_null);
+        else
+            p = fmt_u64(p, (unsigned long long)values[i]);
+    }
+    return p;
+}
+
+// Writes one JSON Lines record of the current sample into buf, returns its end
+// {"ts":<unix seconds>,"cpu":[ids],"usage":[%],"mhz":[MHz|null],"temp":[°C|null]}
+// With --self-stats a "self" object follows the arrays.
+static char *format_jsonl_record(char *p)
+{
+    p = fmt_str(p, "{\"ts\":");
+    p = fmt_fixed(p, (long long)(g_sample_realtime_ns / 1000), 6);
+    p = fmt_str(p, ",\"cpu\":[");
+    for (int i = 0; i < g_num_cpus; ++i)
+    {
+        if (i)
+            *p++ = ',';
+        p = fmt_u64(p, (unsigned)g_cpu_ids[i]);
+    }
+    p = fmt_str(p, "],\"usage\":[");
+    for (int i = 0; i < g_num_cpus; ++i)
+    {
+        if (i)
+            *p++ = ',';
+        p = fmt_fixed(p, scaled_round(g_usage[g_cpu_ids[i]], 10), 1);
+    }
+    p = fmt_str(p, "],\"mhz\":[");
+    for (int i = 0; i < g_num_cpus; ++i)
+    {
+        if (i)
+            *p++ = ',';
+        if (g_freq_source == COREUSAGE_FREQ_NONE)
+            p = fmt_str(p, "null");
+        else
+            p = fmt_fixed(p, g_freq_khz[g_cpu_ids[i]], 3);
+    }
+    p = fmt_str(p, "],\"temp\":[");
+    for (int i = 0; i < g_num_cpus; ++i)
+    {
+        if (i)
+            *p++ = ',';
+        double t = g_show_temp ? g_cpu_temp[g_cpu_ids[i]] : NAN;
+        if (isnan(t))
+            p = fmt_str(p, "null");
+        else
+            p = fmt_fixed(p, scaled_round(t, 10), 1);
+    }
+    *p++ = ']';
+    if (g_self.enabled)
+    {
+        // ,"self":{"cpu_pct":..,"syscalls":..,"ctx_switches":..,"rss_kib":..,"ns":{"stat":..,..}}
+        static const char *const names[4 + PHASE_COUNT] = {
+            ",\"self\":{\"cpu_pct\":", ",\"syscalls\":", ",\"ctx_switches\":", ",\"rss_kib\":",
+            ",\"ns\":{\"stat\":", ",\"temp\":", ",\"idle\":", ",\"top\":", ",\"render\":", ",\"output\":",
+        };
+        p = format_self_values(p, names, "null");
+        p = fmt_str(p, "}}");
+    }
+    return fmt_str(p, "}\n");
+}
+
+// Writes one CSV row of the current sample: timestamp, then usage, MHz and °C per possible CPU,
+// then the --self-stats columns. Offline CPUs and missing values are left empty.
+static char *format_csv_record(char *p)
+{
+    p = fmt_fixed(p, (long long)(g_sample_realtime_ns / 1000), 6);
+    const unsigned char *online = g_snap[g_snap_cur].online;
+    for (int cpu_id = 0; cpu_id < g_max_cpus; ++cpu_id)
+    {
+        *p++ = ',';
+        if (!online[cpu_id])
+        {
+            p = fmt_str(p, ",,");
+            continue;
+        }
+        p = fmt_fixed(p, scaled_round(g_usage[cpu_id], 10), 1);
+        *p++ = ',';
+        if (g_freq_source != COREUSAGE_FREQ_NONE)
+            p = fmt_fixed(p, g_freq_khz[cpu_id], 3);
+        *p++ = ',';
+        double t = g_show_temp ? g_cpu_temp[cpu_id] : NAN;
+        if (!isnan(t))
+            p = fmt_fixed(p, scaled_round(t, 10), 1);
+    }
+    if (g_self.enabled)
+    {
+        static const char *const names[4 + PHASE_COUNT] = {",", ",", ",", ",", ",", ",", ",", ",", ",", ","};
+        p = format_self_values(p, names, "");
+    }
+    *p++ = '\n';
+    return p;
+}
+
+// Writes one packed little-endian binary record of the current sample
+// Header (24 bytes): magic "CUB1", u16 version, u16 header size, u32 CPU count,
+// u32 record size, u64 wall-clock time in ns. Then per possible CPU (8 bytes):
+// u16 usage in 1/100 % (0xFFFF = offline), i16 temperature in 1/10 °C
+// (INT16_MIN = unknown), u32 frequency in kHz (0 = unknown).
+static char *format_bin_record(char *p)
+{
+    unsigned char *b = (unsigned char *)p;
+    uint32_t size = BIN_HEADER_SIZE + (uint32_t)g_max_cpus * BIN_CPU_SIZE;
+    put_le32(b, BIN_MAGIC);
+    put_le16(b + 4, BIN_VERSION);
+    put_le16(b + 6, BIN_HEADER_SIZE);
+    put_le32(b + 8, (uint32_t)g_max_cpus);
+    put_le32(b + 12, size);
+    put_le64(b + 16, g_sample_realtime_ns);
+    b += BIN_HEADER_SIZE;
+    const unsigned char *online = g_snap[g_snap_cur].online;
+    for (int cpu_id = 0; cpu_id < g_max_cpus; ++cpu_id, b += BIN_CPU_SIZE)
+    {
+        double t = g_show_temp && online[cpu_id] ? g_cpu_temp[cpu_id] : NAN;
+        put_le16(b, online[cpu_id] ? (uint16_t)scaled_round(g_usage[cpu_id], 100) : BIN_USAGE_OFFLINE);
+        put_le16(b + 2, isnan(t) ? (uint16_t)BIN_TEMP_UNKNOWN : (uint16_t)(int16_t)scaled_round(t, 10));
+        put_le32(b + 4, online[cpu_id] ? g_freq_khz[cpu_id] : 0);
+    }
+    return (char *)b;
+}
+
+// Emits one record of the current sample in the selected format with a single write()
+static int write_record(void)
+{
+    char *end;
+    if (g_output == OUTPUT_CSV)
+        end = format_csv_record(g_record_buf);
+    else if (g_output == OUTPUT_BIN)
+        end = format_bin_record(g_record_buf);
+    else
+        end = format_jsonl_record(g_record_buf);
+    return write_all(STDOUT_FILENO, g_record_buf, (size_t)(end - g_record_buf));
+}
+
+// Set terminal to non-canonical mode for non-blocking input
+// If enable is 1, set non-blocking mode; if 0, restore previous settings
+void set_nonblocking_terminal(int enable)
+{
+    static struct termios oldt, newt;
+    if (enable)
+    {
+        // Save current terminal settings
+        if (tcgetattr(STDIN_FILENO, &oldt) == -1)
+        {
+            perror("Error: tcgetattr failed");
+            exit(EXIT_FAILURE);
+        }
+        newt = oldt;
+        // Disable canonical mode and echo
+        newt.c_lflag &= ~(ICANON | ECHO);
+        if (tcsetattr(STDIN_FILENO, TCSANOW, &newt) == -1)
+        {
+            perror("Error: tcsetattr failed");
+            exit(EXIT_FAILURE);
+        }
+        // Set non-blocking input
+        if (fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK) == -1)
+        {
+            perror("Error: fcntl (O_NONBLOCK) failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        // Restore old settings
+        if (tcsetattr(STDIN_FILENO, TCSANOW, &oldt) == -1)
+        {
+            perror("Error: tcsetattr (restore) failed");
+            exit(EXIT_FAILURE);
+        }
+        if (fcntl(STDIN_FILENO, F_SETFL, 0) == -1)
+        {
+            perror("Error: fcntl (restore) failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
 
-// Helper function: Print a colored progress bar for CPU usage
-// Prints a horizontal bar with color depending on the usage percentage.
-void print_bar(float percent)
+static void restore_terminal(void)
 {
-    // Calculate how many bar segments should be filled
-    int filled = (int)(percent * g_bar_width / 100.0f);
-    int tty = isatty(STDOUT_FILENO);
-    const char *color;
-    // Choose color based on usage percentage
-    if (percent < 50)
-        color = COLOR_GREEN;
-    else if (percent < 80)
-        color = COLOR_YELLOW;
-    else
-        color = COLOR_RED;
-    if (g_use_color && tty)
-        printf("%s[", color);
-    else
-        printf("[");
-    for (int i = 0; i < g_bar_width; ++i)
+    if (terminal_modified && isatty(STDIN_FILENO))
     {
-        if (i < filled)
-            printf("█");
-        else
-            printf(" ");
+        set_nonblocking_terminal(0);
+        terminal_modified = 0;
     }
-    if (g_use_color && tty)
-        printf("]%s", COLOR_RESET);
-    else
-        printf("]");
 }
 
-// Helper function: Print a formatted line centered in the terminal
-// Uses variable arguments to format the string, then centers it based on terminal width.
-int print_centered(const char *fmt, ...)
+// Blocks the handled signals and returns a signalfd that delivers them instead
+// SIGINT, SIGTERM and SIGHUP terminate the program, SIGWINCH triggers a redraw.
+static int setup_signalfd(void)
 {
-    struct winsize w;
-    // Try to get terminal width; fall back silently if not a TTY
-    int width;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1)
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGWINCH);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        return -1;
+    return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+// (Re)arms a sample timer with the given period
+static int set_sample_timer(int fd, int interval_us)
+{
+    struct itimerspec its;
+    its.it_interval.tv_sec = interval_us / 1000000;
+    its.it_interval.tv_nsec = (interval_us % 1000000) * 1000L;
+    its.it_value = its.it_interval;
+    return timerfd_settime(fd, 0, &its, NULL);
+}
+
+// Creates a periodic CLOCK_MONOTONIC timer that fires once per sample interval
+// The kernel keeps the period, so frames do not drift with rendering time.
+static int setup_sample_timer(int interval_us)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    if (set_sample_timer(fd, interval_us) == -1)
     {
-        width = TERM_WIDTH_FALLBACK;
+        close(fd);
+        return -1;
     }
-    else
+    return fd;
+}
+
+// Lays out one ring slot for n possible CPUs and returns its size
+// [struct ring_slot][snapshot block][pad][u32 kHz per CPU][i16 1/10 °C per CPU][pad]
+static size_t ring_slot_layout(int n)
+{
+    size_t off = sizeof(struct ring_slot) + coreusage_snapshot_size(n);
+    off = (off + 7) & ~(size_t)7;
+    g_ring.freq_offset = off;
+    off += (size_t)n * sizeof(uint32_t);
+    g_ring.temp_offset = off;
+    off += (size_t)n * sizeof(int16_t);
+    return (off + 7) & ~(size_t)7;
+}
+
+static struct ring_slot *ring_slot(uint64_t index)
+{
+    uint64_t i = index % g_ring.hdr->capacity;
+    return (struct ring_slot *)(g_ring.map + RING_HEADER_SIZE + i * g_ring.hdr->slot_size);
+}
+
+// Maps a ring file and checks that its header describes a usable ring
+static int ring_map(int fd, size_t size, int prot)
+{
+    void *map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    g_ring.map = map;
+    g_ring.map_size = size;
+    g_ring.hdr = map;
+    return 0;
+}
+
+// Returns 1 if the mapped header is a ring of this version that fits into the file
+static int ring_header_valid(size_t file_size)
+{
+    const struct ring_header *h = g_ring.hdr;
+    if (file_size < RING_HEADER_SIZE || memcmp(h->magic, RING_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != RING_VERSION || h->header_size != RING_HEADER_SIZE || h->max_cpus == 0 ||
+        h->max_cpus > RING_MAX_CPUS || h->capacity == 0)
+        return 0;
+    if (h->slot_size != ring_slot_layout((int)h->max_cpus))
+        return 0;
+    return h->capacity <= (file_size - RING_HEADER_SIZE) / h->slot_size;
+}
+
+// Opens or creates the ring file for --record with room for size_mib MiB of samples
+// An existing ring with the same geometry is continued, anything else is reinitialized.
+// The whole file is allocated up front, so a full disk cannot hit the recorder later.
+static int ring_open_record(const char *path, long size_mib)
+{
+    size_t slot_size = ring_slot_layout(g_max_cpus);
+    uint64_t capacity = ((uint64_t)size_mib << 20) / slot_size;
+    if (capacity < 2)
     {
-        width = w.ws_col > 0 ? w.ws_col : TERM_WIDTH_FALLBACK;
+        fprintf(stderr, "Error: --record-size is too small for %d CPUs.\n", g_max_cpus);
+        return -1;
     }
-    char buf[512];
-    va_list args;
-    va_start(args, fmt);
-    // Format the string
-    int n = vsnprintf(buf, sizeof(buf), fmt, args);
-    va_end(args);
-    if (n < 0)
+    size_t size = RING_HEADER_SIZE + (size_t)capacity * slot_size;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
     {
-        fprintf(stderr, "Error: Formatting failed.\n");
+        fprintf(stderr, "Error: Could not open %s: %s\n", path, strerror(errno));
         return -1;
     }
-    int len = strlen(buf);
-    int pad = (width - len) / 2;
-    // Print padding and then the string
-    if (pad > 0)
-        printf("%*s%s", pad, "", buf);
-    else
-        printf("%s", buf);
+    // Two recorders on one file would overwrite each other's slots
+    struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+    if (fcntl(fd, F_SETLK, &lock) == -1)
+    {
+        fprintf(stderr, "Error: %s is already being recorded to.\n", path);
+        close(fd);
+        return -1;
+    }
+    struct stat st;
+    int err = fstat(fd, &st) == -1 ? errno : 0;
+    if (!err && (size_t)st.st_size != size && ftruncate(fd, (off_t)size) == -1)
+        err = errno;
+    if (!err)
+    {
+        err = posix_fallocate(fd, 0, (off_t)size);
+        // Some file systems cannot preallocate; the ring still works there
+        if (err == EOPNOTSUPP || err == EINVAL)
+            err = 0;
+    }
+    if (err || ring_map(fd, size, PROT_READ | PROT_WRITE) != 0)
+    {
+        fprintf(stderr, "Error: Could not set up ring file %s: %s\n", path, strerror(err ? err : errno));
+        close(fd);
+        return -1;
+    }
+    g_ring.fd = fd;
+    struct ring_header *h = g_ring.hdr;
+    if (!ring_header_valid(size) || h->max_cpus != (uint32_t)g_max_cpus || h->capacity != capacity)
+    {
+        memset(h, 0, RING_HEADER_SIZE);
+        memcpy(h->magic, RING_MAGIC, sizeof(h->magic));
+        h->version = RING_VERSION;
+        h->header_size = RING_HEADER_SIZE;
+        h->slot_size = (uint32_t)slot_size;
+        h->max_cpus = (uint32_t)g_max_cpus;
+        h->capacity = capacity;
+        atomic_store_explicit(&h->head, 0, memory_order_release);
+    }
+    h->interval_us = (uint32_t)g_interval_us;
+    h->freq_source = (uint32_t)g_freq_source;
     return 0;
 }
 
-// Reads CPU usage statistics per core from /proc/stat
-// If cpu_ids is NULL or *num_cpus == 0, it initializes cpu_ids and returns the number of CPUs
-// Otherwise, it updates the usage values for the given cpu_ids
-int read_cpu_stats(unsigned long long user[], unsigned long long nice[], unsigned long long system[], unsigned long long idle[], unsigned long long total[], int cpu_ids[], int *num_cpus)
+// Appends the current sample to the ring: plain stores into the mapping, no system call
+// The slot's sequence number is cleared while it is written, so a concurrent
+// replay never uses a half-written slot.
+static void ring_append(void)
+{
+    struct ring_header *h = g_ring.hdr;
+    uint64_t index = atomic_load_explicit(&h->head, memory_order_relaxed);
+    struct ring_slot *slot = ring_slot(index);
+    unsigned char *data = (unsigned char *)slot;
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->monotonic_ns = g_sample_monotonic_ns;
+    slot->realtime_ns = g_sample_realtime_ns;
+    const struct coreusage_snapshot *cur = &g_snap[g_snap_cur];
+    memcpy(data + sizeof(*slot), cur->field[0], coreusage_snapshot_size(g_max_cpus));
+    uint32_t *freq = (uint32_t *)(data + g_ring.freq_offset);
+    int16_t *temp = (int16_t *)(data + g_ring.temp_offset);
+    for (int c = 0; c < g_max_cpus; ++c)
+    {
+        double t = g_show_temp && cur->online[c] ? g_cpu_temp[c] : NAN;
+        freq[c] = cur->online[c] ? g_freq_khz[c] : 0;
+        temp[c] = isnan(t) ? RING_TEMP_UNKNOWN : (int16_t)scaled_round(t, 10);
+    }
+    atomic_store_explicit(&slot->seq, index + 1, memory_order_release);
+    atomic_store_explicit(&h->head, index + 1, memory_order_release);
+}
+
+// Opens a ring file read-only for --replay and sizes the per-CPU storage from it
+// The file may still be written by a running recorder.
+static int ring_open_replay(const char *path)
 {
-    // Open /proc/stat for reading
-    FILE *fp = fopen(STAT_FILE, "r");
-    if (!fp)
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
     {
-        fprintf(stderr, "Error: Could not open %s: %s\n", STAT_FILE, strerror(errno));
+        fprintf(stderr, "Error: Could not open %s: %s\n", path, strerror(errno));
+        if (fd != -1)
+            close(fd);
         return -1;
     }
-    char line[256];
-    if (cpu_ids == NULL || *num_cpus == 0)
+    if ((size_t)st.st_size < RING_HEADER_SIZE || ring_map(fd, (size_t)st.st_size, PROT_READ) != 0 ||
+        !ring_header_valid((size_t)st.st_size))
     {
-        int found_cpus = 0;
-        // Read each line and parse CPU stats
-        while (fgets(line, sizeof(line), fp))
-        {
-            // Only consider lines starting with "cpu" followed by a digit
-            if (strncmp(line, "cpu", 3) != 0 || !isdigit(line[3]))
-                continue;
-            int cpu_id;
-            unsigned long long u = 0, n = 0, s = 0, idl = 0, iw = 0, irq = 0, soft = 0, steal = 0, guest = 0, guest_nice = 0;
-            // Parse CPU stats (accept variable field count)
-            int matched = sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
-                                 &cpu_id, &u, &n, &s, &idl, &iw, &irq, &soft, &steal, &guest, &guest_nice);
-            if (matched >= 5 && found_cpus < MAX_CPUS)
-            {
-                cpu_ids[found_cpus] = cpu_id;
-                user[found_cpus] = u;
-                nice[found_cpus] = n;
-                system[found_cpus] = s;
-                // Treat idle as idle + iowait when available
-                unsigned long long idle_agg = idl + (matched >= 6 ? iw : 0);
-                idle[found_cpus] = idle_agg;
-                // Total is sum of available fields
-                unsigned long long t = u + n + s + idl + (matched >= 6 ? iw : 0) + (matched >= 7 ? irq : 0) +
-                                      (matched >= 8 ? soft : 0) + (matched >= 9 ? steal : 0) +
-                                      (matched >= 10 ? guest : 0) + (matched >= 11 ? guest_nice : 0);
-                total[found_cpus] = t;
-                found_cpus++;
-            }
-        }
-        *num_cpus = found_cpus;
+        fprintf(stderr, "Error: %s is not a coreusage ring file.\n", path);
+        close(fd);
+        return -1;
     }
-    else
+    g_ring.fd = fd;
+    if (alloc_cpu_arrays((int)g_ring.hdr->max_cpus) != 0)
+    {
+        fprintf(stderr, "Error: Could not allocate per-CPU storage.\n");
+        return -1;
+    }
+    g_freq_source = (int)g_ring.hdr->freq_source;
+    return 0;
+}
+
+static void ring_close(void)
+{
+    if (g_ring.map)
+        munmap(g_ring.map, g_ring.map_size);
+    if (g_ring.fd != -1)
+        close(g_ring.fd);
+    g_ring.map = NULL;
+    g_ring.hdr = NULL;
+    g_ring.fd = -1;
+}
+
+// Returns the range [*first, *last] of sample indices still held by the ring, -1 if it is empty
+static int ring_window(uint64_t *first, uint64_t *last)
+{
+    uint64_t head = atomic_load_explicit(&g_ring.hdr->head, memory_order_acquire);
+    if (head == 0)
+        return -1;
+    // The oldest slot may be overwritten next, so it is not offered while recording
+    uint64_t capacity = g_ring.hdr->capacity;
+    *first = head > capacity - 1 ? head - (capacity - 1) : 0;
+    *last = head - 1;
+    return 0;
+}
+
+// Copies sample index of the ring into snap; with extras also its timestamps,
+// frequencies and temperatures. Returns -1 if the slot was overwritten meanwhile.
+static int ring_read_slot(uint64_t index, struct coreusage_snapshot *snap, int extras)
+{
+    const struct ring_slot *slot = ring_slot(index);
+    const unsigned char *data = (const unsigned char *)slot;
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != index + 1)
+        return -1;
+    memcpy(snap->field[0], data + sizeof(*slot), coreusage_snapshot_size(g_max_cpus));
+    if (extras)
     {
-        int found = 0;
-        // Update stats for known CPUs
-        while (fgets(line, sizeof(line), fp))
+        g_sample_monotonic_ns = slot->monotonic_ns;
+        g_sample_realtime_ns = slot->realtime_ns;
+        const uint32_t *freq = (const uint32_t *)(data + g_ring.freq_offset);
+        const int16_t *temp = (const int16_t *)(data + g_ring.temp_offset);
+        for (int c = 0; c < g_max_cpus; ++c)
         {
-            if (strncmp(line, "cpu", 3) != 0 || !isdigit(line[3]))
-                continue;
-            int cpu_id;
-            unsigned long long u = 0, n = 0, s = 0, idl = 0, iw = 0, irq = 0, soft = 0, steal = 0, guest = 0, guest_nice = 0;
-            int matched = sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
-                                 &cpu_id, &u, &n, &s, &idl, &iw, &irq, &soft, &steal, &guest, &guest_nice);
-            if (matched >= 5)
-            {
-                for (int i = 0; i < *num_cpus; ++i)
-                {
-                    if (cpu_id == cpu_ids[i])
-                    {
-                        user[i] = u;
-                        nice[i] = n;
-                        system[i] = s;
-                        unsigned long long idle_agg = idl + (matched >= 6 ? iw : 0);
-                        idle[i] = idle_agg;
-                        unsigned long long t = u + n + s + idl + (matched >= 6 ? iw : 0) + (matched >= 7 ? irq : 0) +
-                                              (matched >= 8 ? soft : 0) + (matched >= 9 ? steal : 0) +
-                                              (matched >= 10 ? guest : 0) + (matched >= 11 ? guest_nice : 0);
-                        total[i] = t;
-                        found++;
-                        break;
-                    }
-                }
-                if (found == *num_cpus)
-                    break;
-            }
+            g_freq_khz[c] = freq[c];
+            g_cpu_temp[c] = temp[c] == RING_TEMP_UNKNOWN ? NAN : temp[c] / 10.0;
         }
     }
-    // Close the file
-    if (fclose(fp) != 0)
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->seq, memory_order_relaxed) == index + 1 ? 0 : -1;
+}
+
+// Makes sample index of the ring the current one, clamped to the samples still held
+// The sample before it is the baseline, exactly as in live sampling.
+static int replay_seek(int64_t index)
+{
+    for (int attempt = 0; attempt < 3; ++attempt)
+    {
+        uint64_t first, last;
+        if (ring_window(&first, &last) != 0 || last == first)
+            return -1;
+        uint64_t k = index < (int64_t)first + 1 ? first + 1 : (uint64_t)index > last ? last : (uint64_t)index;
+        struct coreusage_snapshot *prev = &g_snap[0];
+        struct coreusage_snapshot *cur = &g_snap[1];
+        if (ring_read_slot(k - 1, prev, 0) != 0 || ring_read_slot(k, cur, 1) != 0)
+            continue;
+        g_snap_cur = 1;
+        g_replay.pos = k;
+        rebuild_cpu_ids(cur);
+        handle_cpu_hotplug(prev);
+        coreusage_delta(prev, cur, g_max_cpus, g_usage, g_field_pct);
+        return 0;
+    }
+    return -1;
+}
+
+// Arms the timer for the current replay speed
+// Faster than one sample per REPLAY_MIN_TICK_US skips samples instead of ticking faster.
+static int replay_set_speed(int timer_fd)
+{
+    long long tick_us = g_ring.hdr->interval_us ? g_ring.hdr->interval_us : TIME_BETWEEN_SAMPLES_US;
+    if (g_replay.speed_log2 >= 0)
+        tick_us >>= g_replay.speed_log2;
+    else
+        tick_us <<= -g_replay.speed_log2;
+    if (tick_us < 1)
+        tick_us = 1;
+    g_replay.step = tick_us < REPLAY_MIN_TICK_US ? (int)((REPLAY_MIN_TICK_US + tick_us - 1) / tick_us) : 1;
+    return set_sample_timer(timer_fd, (int)(tick_us * g_replay.step));
+}
+
+// Writes every sample held by the ring as records of the selected format
+static int replay_export(void)
+{
+    uint64_t first, last;
+    if (ring_window(&first, &last) != 0)
+        return 0;
+    for (uint64_t k = first + 1; k <= last; ++k)
     {
-        fprintf(stderr, "Error: Could not close %s: %s\n", STAT_FILE, strerror(errno));
+        if (replay_seek((int64_t)k) != 0 || g_replay.pos != k)
+            continue;
+        if (write_record() != 0)
+            return -1;
     }
     return 0;
 }
 
-// For each core, print frequency, usage and progress bar in one centered line
-// Reads CPU stats twice to calculate usage, then prints a line for each core with usage and frequency
-void print_core_usage_bars()
+// Handles a key of the replay controls, returns 1 if the frame must be redrawn
+static int replay_key(char key, int timer_fd)
 {
-    unsigned long long user1[MAX_CPUS], nice1[MAX_CPUS], system1[MAX_CPUS], idle1[MAX_CPUS], total1[MAX_CPUS];
-    unsigned long long user2[MAX_CPUS], nice2[MAX_CPUS], system2[MAX_CPUS], idle2[MAX_CPUS], total2[MAX_CPUS];
-    int cpu_ids[MAX_CPUS];
-    int num_cpus = 0;
-    // First read: get initial CPU stats and core IDs
-    if (read_cpu_stats(user1, nice1, system1, idle1, total1, cpu_ids, &num_cpus) != 0)
+    uint64_t first, last;
+    if (ring_window(&first, &last) != 0)
+        return 0;
+    int64_t pos = (int64_t)g_replay.pos;
+    int64_t tenth = (int64_t)(last - first) / 10 + 1;
+    switch (key)
     {
-        fprintf(stderr, "Error: Could not read CPU statistics.\n");
-        return;
+    case ' ':
+        g_replay.paused = !g_replay.paused;
+        return 1;
+    case '+':
+    case '-':
+        g_replay.speed_log2 += key == '+' ? 1 : -1;
+        if (g_replay.speed_log2 < REPLAY_SPEED_MIN_LOG2)
+            g_replay.speed_log2 = REPLAY_SPEED_MIN_LOG2;
+        if (g_replay.speed_log2 > REPLAY_SPEED_MAX_LOG2)
+            g_replay.speed_log2 = REPLAY_SPEED_MAX_LOG2;
+        replay_set_speed(timer_fd);
+        return 1;
+    case KEY_RIGHT:
+        pos += REPLAY_SEEK_SAMPLES;
+        break;
+    case KEY_LEFT:
+        pos -= REPLAY_SEEK_SAMPLES;
+        break;
+    case '>':
+        pos += tenth;
+        break;
+    case '<':
+        pos -= tenth;
+        break;
+    case 'g':
+        pos = 0;
+        break;
+    case 'G':
+        pos = (int64_t)last;
+        break;
+    default:
+        return 0;
     }
-    // Wait for the next sample
-    struct timespec ts = {0, g_interval_us * 1000};
-    if (nanosleep(&ts, NULL) != 0)
+    // The statistics window only covers consecutive samples
+    if (replay_seek(pos) == 0)
     {
-        if (errno != EINTR)
-            fprintf(stderr, "Error: nanosleep failed: %s\n", strerror(errno));
-        // even if interrupted, continue with second read
+        reset_history();
+        push_history();
     }
-    // Second read: get updated CPU stats
-    if (read_cpu_stats(user2, nice2, system2, idle2, total2, cpu_ids, &num_cpus) != 0)
+    return 1;
+}
+
+// Draws the replay position, time and speed below the display. Returns the next free row
+static int print_replay_status(int row)
+{
+    uint64_t first = 0, last = 0;
+    ring_window(&first, &last);
+    char when[32] = "";
+    time_t secs = (time_t)(g_sample_realtime_ns / 1000000000ULL);
+    struct tm tm;
+    if (localtime_r(&secs, &tm))
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    char speed[16];
+    if (g_replay.speed_log2 >= 0)
+        snprintf(speed, sizeof(speed), "%dx", 1 << g_replay.speed_log2);
+    else
+        snprintf(speed, sizeof(speed), "1/%dx", 1 << -g_replay.speed_log2);
+    fb_centered(row++, FB_COLOR_DEFAULT, "Replay %s.%01llu  sample %llu/%llu  speed %s%s", when,
+                g_sample_realtime_ns / 100000000ULL % 10, (unsigned long long)(g_replay.pos - first),
+                (unsigned long long)(last - first), speed, g_replay.paused ? "  [paused]" : "");
+    fb_centered(row++, FB_COLOR_DEFAULT, "space pause, ←/→ seek, </> jump 10%%, g/G start/end, +/- speed");
+    return row;
+}
+
+// Creates the shared-memory segment for --daemon and fills in its header
+// Only one daemon may publish under a name; the lock goes away with the process.
+static int shm_open_daemon(const char *name)
+{
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
     {
-        fprintf(stderr, "Error: Could not read CPU statistics (second measurement).\n");
-        return;
+        fprintf(stderr, "Error: Could not create shared memory %s: %s\n", name, strerror(errno));
+        return -1;
     }
-    printf("\n");
-    struct winsize w;
-    // Get terminal width for centering
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1)
+    struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+    if (fcntl(fd, F_SETLK, &lock) == -1)
+    {
+        fprintf(stderr, "Error: Another coreusage daemon already publishes %s.\n", name);
+        close(fd);
+        return -1;
+    }
+    size_t size = sizeof(struct coreusage_shm_header) + (size_t)g_max_cpus * sizeof(struct coreusage_shm_cpu);
+    // Truncating first clears whatever an earlier daemon left behind
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, 0) == 0 && ftruncate(fd, (off_t)size) == 0)
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
     {
-        w.ws_col = TERM_WIDTH_FALLBACK;
+        fprintf(stderr, "Error: Could not set up shared memory %s: %s\n", name, strerror(errno));
+        close(fd);
+        return -1;
     }
-    int width = w.ws_col > 0 ? w.ws_col : TERM_WIDTH_FALLBACK;
-    char line_template[256];
-    int n = snprintf(line_template, sizeof(line_template), "CPU %-3d %6.1f%%  %8.2f MHz  ", 0, 0.0, 0.0);
-    if (n < 0 || n >= (int)sizeof(line_template))
+    g_shm.map = map;
+    g_shm.fd = fd;
+    g_shm.size = size;
+    g_shm.name = name;
+    g_shm.daemon = 1;
+    struct coreusage_shm_header *h = g_shm.map;
+    h->magic = COREUSAGE_SHM_MAGIC;
+    h->version = COREUSAGE_SHM_VERSION;
+    h->header_size = sizeof(struct coreusage_shm_header);
+    h->cpu_size = sizeof(struct coreusage_shm_cpu);
+    h->max_cpus = (uint32_t)g_max_cpus;
+    h->interval_us = (uint32_t)g_interval_us;
+    h->pid = (uint32_t)getpid();
+    h->freq_source = (uint32_t)g_freq_source;
+    h->state = COREUSAGE_SHM_RUNNING;
+    return 0;
+}
+
+// Publishes the current sample: plain stores between two increments of the seqlock
+static void shm_publish(void)
+{
+    struct coreusage_shm_header *h = g_shm.map;
+    struct coreusage_shm_cpu *cpus = (struct coreusage_shm_cpu *)((unsigned char *)g_shm.map + h->header_size);
+    const struct coreusage_snapshot *cur = &g_snap[g_snap_cur];
+    uint64_t seq = h->seq;
+    __atomic_store_n(&h->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    h->samples++;
+    h->monotonic_ns = g_sample_monotonic_ns;
+    h->realtime_ns = g_sample_realtime_ns;
+    h->num_online = (uint32_t)g_num_cpus;
+    for (int c = 0; c < g_max_cpus; ++c)
     {
-        fprintf(stderr, "Error: snprintf failed.\n");
-        return;
+        struct coreusage_shm_cpu *e = &cpus[c];
+        for (int f = 0; f < COREUSAGE_FIELDS; ++f)
+        {
+            e->ticks[f] = cur->field[f][c];
+            e->field_pct[f] = g_field_pct[f][c];
+        }
+        double t = g_show_temp && cur->online[c] ? g_cpu_temp[c] : NAN;
+        e->usage = g_usage[c];
+        e->freq_khz = cur->online[c] ? g_freq_khz[c] : 0;
+        e->temp = isnan(t) ? COREUSAGE_SHM_TEMP_UNKNOWN : (int16_t)scaled_round(t, 10);
+        e->online = cur->online[c];
+    }
+    __atomic_store_n(&h->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Maps a published segment read-only for --attach and sizes the per-CPU storage from it
+static int shm_attach(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        fprintf(stderr, "Error: Could not open shared memory %s: %s (is a coreusage --daemon running?)\n", name, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
     }
-    int len = strlen(line_template) + g_bar_width + strlen(COLOR_RESET) + 2;
-    int pad = (width - len) / 2;
-    if (pad < 0)
-        pad = 0;
-    if (print_centered("=== CPU Usage & Frequency per Core ===\n\n") == -1)
+    size_t size = (size_t)st.st_size;
+    void *map = size >= sizeof(struct coreusage_shm_header) ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    const struct coreusage_shm_header *h = map;
+    if (map == MAP_FAILED || h->magic != COREUSAGE_SHM_MAGIC || h->version != COREUSAGE_SHM_VERSION ||
+        h->header_size < sizeof(*h) || h->cpu_size < sizeof(struct coreusage_shm_cpu) || h->max_cpus == 0 ||
+        h->header_size + (size_t)h->max_cpus * h->cpu_size > size)
     {
-        fprintf(stderr, "Error: Could not print centered title.\n");
+        fprintf(stderr, "Error: %s is not a compatible coreusage segment.\n", name);
+        if (map != MAP_FAILED)
+            munmap(map, size);
+        close(fd);
+        return -1;
+    }
+    g_shm.fd = fd;
+    g_shm.map = map;
+    g_shm.size = size;
+    g_shm.name = name;
+    g_shm.copy = malloc(h->header_size + (size_t)h->max_cpus * h->cpu_size);
+    if (!g_shm.copy || alloc_cpu_arrays((int)h->max_cpus) != 0)
+    {
+        fprintf(stderr, "Error: Could not allocate per-CPU storage.\n");
+        return -1;
+    }
+    g_freq_source = (int)h->freq_source;
+    return 0;
+}
+
+// Copies the latest published sample into the display state
+// Returns 0 for a new sample, 1 if the daemon has not published since, -1 if it stopped.
+static int shm_read_sample(void)
+{
+    const struct coreusage_shm_header *h = g_shm.map;
+    size_t size = h->header_size + (size_t)h->max_cpus * h->cpu_size;
+    const struct coreusage_shm_header *copy = (const struct coreusage_shm_header *)g_shm.copy;
+    unsigned long long start = phase_begin();
+    int attempt = 0;
+    uint64_t seq;
+    do
+    {
+        // A daemon killed while writing leaves the lock odd forever
+        if (++attempt > SHM_READ_ATTEMPTS)
+            return h->state == COREUSAGE_SHM_RUNNING ? 1 : -1;
+        seq = coreusage_shm_read_begin(h);
+        memcpy(g_shm.copy, h, size);
+    } while (coreusage_shm_read_retry(h, seq));
+    if (copy->samples == g_shm.samples)
+        return copy->state == COREUSAGE_SHM_RUNNING ? 1 : -1;
+    g_shm.samples = copy->samples;
+    int next = g_snap_cur ^ 1;
+    struct coreusage_snapshot *cur = &g_snap[next];
+    for (int c = 0; c < g_max_cpus; ++c)
+    {
+        const struct coreusage_shm_cpu *e = (const struct coreusage_shm_cpu *)(g_shm.copy + copy->header_size + (size_t)c * copy->cpu_size);
+        for (int f = 0; f < COREUSAGE_FIELDS; ++f)
+        {
+            cur->field[f][c] = e->ticks[f];
+            g_field_pct[f][c] = e->field_pct[f];
+        }
+        cur->online[c] = e->online;
+        g_usage[c] = e->usage;
+        g_freq_khz[c] = e->freq_khz;
+        g_cpu_temp[c] = e->temp == COREUSAGE_SHM_TEMP_UNKNOWN ? NAN : e->temp / 10.0;
+    }
+    g_snap_cur = next;
+    rebuild_cpu_ids(cur);
+    handle_cpu_hotplug(&g_snap[next ^ 1]);
+    g_sample_monotonic_ns = copy->monotonic_ns;
+    g_sample_realtime_ns = copy->realtime_ns;
+    phase_end(PHASE_STAT, start);
+    return 0;
+}
+
+// Unmaps the segment; a daemon marks it stopped and removes the name
+static void shm_close(void)
+{
+    if (!g_shm.map)
         return;
+    if (g_shm.daemon)
+    {
+        struct coreusage_shm_header *h = g_shm.map;
+        uint64_t seq = h->seq;
+        __atomic_store_n(&h->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        h->state = COREUSAGE_SHM_STOPPED;
+        __atomic_store_n(&h->seq, seq + 2, __ATOMIC_RELEASE);
+        shm_unlink(g_shm.name);
     }
-    // Print table header
-    printf("%*s%-7s %-8s %-12s %-s\n", pad, "", "Core", "   Usage", "  Frequency", "                   Load");
-    for (int i = 0; i < num_cpus; ++i)
-    {
-        int cpu_id = cpu_ids[i];
-        // Calculate usage deltas
-        unsigned long long idle_diff = idle2[i] - idle1[i];
-        unsigned long long total_diff = total2[i] - total1[i];
-        float usage = total_diff ? 100.0f * (total_diff - idle_diff) / total_diff : 0.0f;
-        // Read current frequency from sysfs
-        char path[128], buf[64];
-        int npath = snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq", cpu_id);
-        if (npath < 0 || npath >= (int)sizeof(path))
-        {
-            fprintf(stderr, "Error: snprintf failed for path.\n");
-            continue;
+    munmap(g_shm.map, g_shm.size);
+    close(g_shm.fd);
+    free(g_shm.copy);
+    g_shm.map = NULL;
+    g_shm.copy = NULL;
+}
+
+// Opens the listening socket for --export: a path containing '/' is a unix socket,
+// anything else host:port, [v6-host]:port or :port for all addresses
+static int export_listen(const char *addr)
+{
+    int fd = -1;
+    if (strchr(addr, '/'))
+    {
+        struct sockaddr_un sa = {.sun_family = AF_UNIX};
+        if (strlen(addr) >= sizeof(sa.sun_path))
+        {
+            fprintf(stderr, "Error: Socket path %s is too long.\n", addr);
+            return -1;
         }
-        FILE *fp = fopen(path, "r");
-        if (!fp)
+        strcpy(sa.sun_path, addr);
+        // A socket left behind by an exporter that died is replaced, a live one is not
+        struct stat st;
+        if (lstat(addr, &st) == 0 && S_ISSOCK(st.st_mode))
         {
-            fprintf(stderr, "Error: Could not open %s: %s\n", path, strerror(errno));
-            continue;
+            int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            int live = probe != -1 && connect(probe, (struct sockaddr *)&sa, sizeof(sa)) == 0;
+            if (probe != -1)
+                close(probe);
+            if (live)
+            {
+                fprintf(stderr, "Error: Another process already serves %s.\n", addr);
+                return -1;
+            }
+            unlink(addr);
         }
-        float freq_mhz = 0.0f;
-        // Read frequency value
-        if (fgets(buf, sizeof(buf), fp))
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 || listen(fd, SOMAXCONN) == -1)
         {
-            int freq_khz = atoi(buf);
-            freq_mhz = freq_khz / 1000.0f;
+            fprintf(stderr, "Error: Could not listen on %s: %s\n", addr, strerror(errno));
+            if (fd != -1)
+                close(fd);
+            return -1;
         }
-        else
+        g_export.unix_path = addr;
+    }
+    else
+    {
+        const char *colon = strrchr(addr, ':');
+        char host[256];
+        size_t host_len = colon ? (size_t)(colon - addr) : 0;
+        if (!colon || !colon[1] || host_len >= sizeof(host))
         {
-            fprintf(stderr, "Error: Could not read frequency from %s: %s\n", path, strerror(errno));
-            fclose(fp);
-            continue;
+            fprintf(stderr, "Error: Invalid export address '%s' (use host:port, :port or a socket path).\n", addr);
+            return -1;
         }
-        if (fclose(fp) != 0)
+        // Brackets only separate an IPv6 address from the port
+        const char *host_start = addr;
+        if (host_len >= 2 && addr[0] == '[' && addr[host_len - 1] == ']')
         {
-            fprintf(stderr, "Error: Could not close %s: %s\n", path, strerror(errno));
+            host_start++;
+            host_len -= 2;
         }
-        // Prepare the line for this core
-        char line[256];
-        int nline = snprintf(line, sizeof(line), "CPU %-3d %6.1f%%  %8.2f MHz  ", cpu_id, usage, freq_mhz);
-        if (nline < 0 || nline >= (int)sizeof(line))
+        memcpy(host, host_start, host_len);
+        host[host_len] = '\0';
+        struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE};
+        struct addrinfo *res;
+        int rc = getaddrinfo(host_len ? host : NULL, colon + 1, &hints, &res);
+        if (rc != 0)
         {
-            fprintf(stderr, "Error: snprintf failed for line.\n");
-            continue;
+            fprintf(stderr, "Error: Could not resolve export address '%s': %s\n", addr, gai_strerror(rc));
+            return -1;
         }
-        // Compute padding using previously determined terminal width
-        int len2 = strlen(line) + g_bar_width + strlen(COLOR_RESET) + 2;
-        int pad2 = (width - len2) / 2;
-        // Print the line centered
-        if (pad2 > 0)
-            printf("%*s%s", pad2, "", line);
-        else
-            printf("%s", line);
-        print_bar(usage);
-        printf("\n");
-    }
-}
-
-// Helper function: Prints the CPU temperature
-void print_cpu_temperature()
-{
-    const sensors_chip_name *chip;
-    int chip_nr = 0;
-    int found = 0;
-    double temp_value = 0.0;
-    char label_buf[128] = "";
-    // Iterate over all chips
-    while ((chip = sensors_get_detected_chips(NULL, &chip_nr)) != NULL)
-    {
-        const sensors_feature *feature;
-        int feat_nr = 0;
-        // Iterate over all features of the chip
-        while ((feature = sensors_get_features(chip, &feat_nr)) != NULL)
+        int err = 0;
+        for (struct addrinfo *ai = res; ai && fd == -1; ai = ai->ai_next)
         {
-            if (feature->type == SENSORS_FEATURE_TEMP)
+            int one = 1;
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd != -1 && (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+                             bind(fd, ai->ai_addr, ai->ai_addrlen) == -1 || listen(fd, SOMAXCONN) == -1))
             {
-                const sensors_subfeature *subf = sensors_get_subfeature(chip, feature, SENSORS_SUBFEATURE_TEMP_INPUT);
-                if (subf)
-                {
-                    double value = 0.0;
-                    if (sensors_get_value(chip, subf->number, &value) == 0)
-                    {
-                        // Get label
-                        const char *label = sensors_get_label(chip, feature);
-                        if (label)
-                        {
-                            snprintf(label_buf, sizeof(label_buf), "%s", label);
-                        }
-                        else
-                        {
-                            snprintf(label_buf, sizeof(label_buf), "Temp");
-                        }
-                        temp_value = value;
-                        found = 1;
-                        break;
-                    }
-                }
+                err = errno;
+                close(fd);
+                fd = -1;
             }
         }
-        if (found)
-            break;
+        freeaddrinfo(res);
+        if (fd == -1)
+        {
+            fprintf(stderr, "Error: Could not listen on %s: %s\n", addr, strerror(err ? err : errno));
+            return -1;
+        }
     }
-    if (found)
+    // Both response buffers are allocated once; their size only depends on the number of possible CPUs
+    g_export.cap = EXPORT_HEAD_RESERVE + EXPORT_FIXED_BYTES + (size_t)g_max_cpus * EXPORT_BYTES_PER_CPU;
+    g_export.buf[0] = malloc(g_export.cap);
+    g_export.buf[1] = malloc(g_export.cap);
+    if (!g_export.buf[0] || !g_export.buf[1])
     {
-        // Build temperature line exactly like a core line
-        struct winsize w;
-        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1)
-            w.ws_col = TERM_WIDTH_FALLBACK;
-        int width = w.ws_col > 0 ? w.ws_col : TERM_WIDTH_FALLBACK;
-        // Dummy-Label and dummy frequency for harmonic line
-        char line[256];
-        snprintf(line, sizeof(line), "CPU Temp: %3.1f°C ", temp_value);
-        int len = strlen(line) + g_bar_width + strlen(COLOR_RESET) + 2;
-        int pad = (width - len) / 2;
-        if (pad < 0)
-            pad = 0;
-        if (pad > 0)
-            printf("\n%*s%s", pad, "", line);
-        else
-            printf("\n%s", line);
-        // Normalize temperature to 0-100% (when >100°C, the bar is full)
-        float percent = temp_value;
-        if (percent < 0)
-            percent = 0;
-        if (percent > 100)
-            percent = 100;
-        print_bar(percent);
-        printf("\n");
+        fprintf(stderr, "Error: Could not allocate the export buffers.\n");
+        close(fd);
+        return -1;
     }
-    else
+    for (int i = 0; i < EXPORT_MAX_CLIENTS; ++i)
     {
-        print_centered("CPU temperature: not available\n");
+        g_export.client[i].fd = -1;
+        g_export.client[i].buf = -1;
     }
+    g_export.fd = fd;
+    return 0;
 }
 
-// Set terminal to non-canonical mode for non-blocking input
-// If enable is 1, set non-blocking mode; if 0, restore previous settings
-void set_nonblocking_terminal(int enable)
+// Appends the HELP, TYPE and optional UNIT lines of a metric family
+static char *export_family(char *p, const char *name, const char *type, const char *unit, const char *help)
 {
-    static struct termios oldt, newt;
-    if (enable)
+    p = fmt_str(p, "# HELP ");
+    p = fmt_str(p, name);
+    *p++ = ' ';
+    p = fmt_str(p, help);
+    p = fmt_str(p, "\n# TYPE ");
+    p = fmt_str(p, name);
+    *p++ = ' ';
+    p = fmt_str(p, type);
+    *p++ = '\n';
+    if (unit)
     {
-        // Save current terminal settings
-        if (tcgetattr(STDIN_FILENO, &oldt) == -1)
-        {
-            perror("Error: tcgetattr failed");
-            exit(EXIT_FAILURE);
-        }
-        newt = oldt;
-        // Disable canonical mode and echo
-        newt.c_lflag &= ~(ICANON | ECHO);
-        if (tcsetattr(STDIN_FILENO, TCSANOW, &newt) == -1)
+        p = fmt_str(p, "# UNIT ");
+        p = fmt_str(p, name);
+        *p++ = ' ';
+        p = fmt_str(p, unit);
+        *p++ = '\n';
+    }
+    return p;
+}
+
+// Appends the start of a per-CPU sample: name{cpu="id"
+static char *export_sample(char *p, const char *name, int cpu_id)
+{
+    p = fmt_str(p, name);
+    p = fmt_str(p, "{cpu=\"");
+    p = fmt_u64(p, (unsigned)cpu_id);
+    *p++ = '"';
+    return p;
+}
+
+// Renders the current sample as a complete HTTP response in OpenMetrics text format
+// The metrics are written behind room for the response head, which is put in front
+// once the length is known, so the response is one contiguous block.
+static void export_render(void)
+{
+    static const char *const mode_names[COREUSAGE_FIELDS] = {
+        "user", "nice", "system", "idle", "iowait", "irq", "softirq", "steal", "guest", "guest_nice",
+    };
+    // Never overwrite a buffer that is still being sent; both busy only skips this sample
+    int b = g_export.cur ^ 1;
+    if (g_export.cur < 0)
+        b = 0;
+    else if (g_export.users[b] > 0)
+        return;
+    long hz = sysconf(_SC_CLK_TCK);
+    if (hz <= 0)
+        hz = 100;
+    const struct coreusage_snapshot *cur = &g_snap[g_snap_cur];
+    char *body = g_export.buf[b] + EXPORT_HEAD_RESERVE;
+    char *p = export_family(body, "coreusage_cpu_usage_ratio", "gauge", "ratio",
+                            "Share of the last interval spent in user, nice and system time.");
+    for (int i = 0; i < g_num_cpus; ++i)
+    {
+        p = export_sample(p, "coreusage_cpu_usage_ratio", g_cpu_ids[i]);
+        p = fmt_str(p, "} ");
+        p = fmt_fixed(p, scaled_round(g_usage[g_cpu_ids[i]], 100), 4);
+        *p++ = '\n';
+    }
+    p = export_family(p, "coreusage_cpu_mode_ratio", "gauge", "ratio",
+                      "Share of the last interval spent in each /proc/stat mode; guest is part of user.");
+    for (int i = 0; i < g_num_cpus; ++i)
+    {
+        for (int f = 0; f < COREUSAGE_FIELDS; ++f)
         {
-            perror("Error: tcsetattr failed");
-            exit(EXIT_FAILURE);
+            p = export_sample(p, "coreusage_cpu_mode_ratio", g_cpu_ids[i]);
+            p = fmt_str(p, ",mode=\"");
+            p = fmt_str(p, mode_names[f]);
+            p = fmt_str(p, "\"} ");
+            p = fmt_fixed(p, scaled_round(g_field_pct[f][g_cpu_ids[i]], 100), 4);
+            *p++ = '\n';
         }
-        // Set non-blocking input
-        if (fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK) == -1)
+    }
+    p = export_family(p, "coreusage_cpu_seconds", "counter", "seconds", "Time spent in each /proc/stat mode since boot.");
+    for (int i = 0; i < g_num_cpus; ++i)
+    {
+        for (int f = 0; f < COREUSAGE_FIELDS; ++f)
         {
-            perror("Error: fcntl (O_NONBLOCK) failed");
-            exit(EXIT_FAILURE);
+            p = export_sample(p, "coreusage_cpu_seconds_total", g_cpu_ids[i]);
+            p = fmt_str(p, ",mode=\"");
+            p = fmt_str(p, mode_names[f]);
+            p = fmt_str(p, "\"} ");
+            p = fmt_fixed(p, (long long)(cur->field[f][g_cpu_ids[i]] * 100 / (unsigned long long)hz), 2);
+            *p++ = '\n';
         }
     }
-    else
+    if (g_freq_source != COREUSAGE_FREQ_NONE)
     {
-        // Restore old settings
-        if (tcsetattr(STDIN_FILENO, TCSANOW, &oldt) == -1)
+        p = export_family(p, "coreusage_cpu_frequency_hertz", "gauge", "hertz", "Current clock frequency.");
+        for (int i = 0; i < g_num_cpus; ++i)
         {
-            perror("Error: tcsetattr (restore) failed");
-            exit(EXIT_FAILURE);
+            p = export_sample(p, "coreusage_cpu_frequency_hertz", g_cpu_ids[i]);
+            p = fmt_str(p, "} ");
+            p = fmt_u64(p, (unsigned long long)g_freq_khz[g_cpu_ids[i]] * 1000);
+            *p++ = '\n';
         }
-        if (fcntl(STDIN_FILENO, F_SETFL, 0) == -1)
+    }
+    if (g_show_temp)
+    {
+        // CPUs without a matching sensor have no sample
+        p = export_family(p, "coreusage_cpu_temperature_celsius", "gauge", "celsius", "Temperature of the sensor mapped to the CPU.");
+        for (int i = 0; i < g_num_cpus; ++i)
         {
-            perror("Error: fcntl (restore) failed");
-            exit(EXIT_FAILURE);
+            double t = g_cpu_temp[g_cpu_ids[i]];
+            if (isnan(t))
+                continue;
+            p = export_sample(p, "coreusage_cpu_temperature_celsius", g_cpu_ids[i]);
+            p = fmt_str(p, "} ");
+            p = fmt_fixed(p, scaled_round(t, 10), 1);
+            *p++ = '\n';
         }
     }
+    p = export_family(p, "coreusage_cpus_online", "gauge", NULL, "Number of online CPUs.");
+    p = fmt_str(p, "coreusage_cpus_online ");
+    p = fmt_u64(p, (unsigned)g_num_cpus);
+    *p++ = '\n';
+    p = export_family(p, "coreusage_sample_timestamp_seconds", "gauge", "seconds", "Wall-clock time of the sample.");
+    p = fmt_str(p, "coreusage_sample_timestamp_seconds ");
+    p = fmt_fixed(p, (long long)(g_sample_realtime_ns / 1000), 6);
+    p = fmt_str(p, "\n# EOF\n");
+    char head[EXPORT_HEAD_RESERVE];
+    char *h = fmt_str(head, "HTTP/1.1 200 OK\r\n"
+                            "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                            "Content-Length: ");
+    h = fmt_u64(h, (unsigned long long)(p - body));
+    h = fmt_str(h, "\r\nConnection: close\r\n\r\n");
+    size_t head_len = (size_t)(h - head);
+    memcpy(body - head_len, head, head_len);
+    g_export.resp[b] = body - head_len;
+    g_export.resp_len[b] = (size_t)(p - body) + head_len;
+    g_export.cur = b;
 }
 
-static void restore_terminal(void)
+// Closes a connection and frees its slot
+static void export_drop(struct export_client *c)
 {
-    if (terminal_modified && isatty(STDIN_FILENO))
+    if (c->buf >= 0)
+        g_export.users[c->buf]--;
+    close(c->fd);
+    c->fd = -1;
+    c->buf = -1;
+    c->out = NULL;
+    c->req_len = 0;
+    c->sent = 0;
+}
+
+// Sends as much of the response as the socket takes; done connections are closed
+// A scrape normally completes with this single call.
+static void export_send(struct export_client *c)
+{
+    while (c->sent < c->out_len)
     {
-        set_nonblocking_terminal(0);
-        terminal_modified = 0;
+        ssize_t n = send(c->fd, c->out + c->sent, c->out_len - c->sent, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EAGAIN)
+            return;
+        if (n <= 0)
+            break;
+        c->sent += (size_t)n;
+    }
+    export_drop(c);
+}
+
+// Reads the request head and starts the matching response
+// Only "GET /metrics" is served; the query string and all headers are ignored.
+static void export_read(struct export_client *c)
+{
+    ssize_t n = recv(c->fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len, 0);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0)
+    {
+        export_drop(c);
+        return;
+    }
+    c->req_len += (size_t)n;
+    c->req[c->req_len] = '\0';
+    int full = c->req_len == sizeof(c->req) - 1;
+    if (!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n") && !full)
+        return;
+    const char *path = c->req + 4;
+    size_t path_len = strcspn(path, " ?\r\n");
+    if (full)
+        c->out = "HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: close\r\n\r\n";
+    else if (strncmp(c->req, "GET ", 4) != 0)
+        c->out = "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET\r\nConnection: close\r\n\r\n";
+    else if (path_len != 8 || memcmp(path, "/metrics", 8) != 0)
+        c->out = "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain; charset=utf-8\r\nConnection: close\r\n\r\nOnly /metrics is served.\n";
+    else if (g_export.cur < 0)
+        c->out = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
+    else
+    {
+        c->buf = g_export.cur;
+        g_export.users[c->buf]++;
+        c->out = g_export.resp[c->buf];
+        c->out_len = g_export.resp_len[c->buf];
     }
+    if (c->buf < 0)
+        c->out_len = strlen(c->out);
+    export_send(c);
 }
 
-static void signal_handler(int sig)
+// Fills the poll entries of the listening socket and of every connection slot
+// The listening socket is only watched while a slot is free.
+static void export_poll_setup(struct pollfd *listen_pfd, struct pollfd clients[])
 {
-    if (sig == SIGWINCH)
+    int free_slot = 0;
+    for (int i = 0; i < EXPORT_MAX_CLIENTS; ++i)
     {
-        g_winch = 1;
+        const struct export_client *c = &g_export.client[i];
+        clients[i].fd = c->fd;
+        clients[i].events = c->out ? POLLOUT : POLLIN;
+        clients[i].revents = 0;
+        free_slot |= c->fd == -1;
+    }
+    listen_pfd->fd = g_export.fd;
+    listen_pfd->events = free_slot ? POLLIN : 0;
+    listen_pfd->revents = 0;
+}
+
+// Serves the connections poll() reported ready, accepts new ones and drops stale ones
+static void export_serve(const struct pollfd *listen_pfd, const struct pollfd clients[])
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long long now = timespec_ns(&ts);
+    for (int i = 0; i < EXPORT_MAX_CLIENTS; ++i)
+    {
+        struct export_client *c = &g_export.client[i];
+        if (c->fd == -1)
+            continue;
+        if (clients[i].revents & POLLNVAL)
+            export_drop(c);
+        else if (c->out && (clients[i].revents & (POLLOUT | POLLERR | POLLHUP)))
+            export_send(c);
+        else if (!c->out && (clients[i].revents & (POLLIN | POLLERR | POLLHUP)))
+            export_read(c);
+        else if (now - c->since_ns > EXPORT_TIMEOUT_NS)
+            export_drop(c);
+    }
+    if (!(listen_pfd->revents & POLLIN))
         return;
+    for (int i = 0; i < EXPORT_MAX_CLIENTS; ++i)
+    {
+        struct export_client *c = &g_export.client[i];
+        if (c->fd != -1)
+            continue;
+        c->fd = accept4(g_export.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (c->fd == -1)
+            return;
+        c->since_ns = now;
     }
-    g_should_terminate = 1;
 }
 
-static int setup_signal_handlers(void)
+// Closes the endpoint and all connections
+static void export_close(void)
 {
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = signal_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGINT, &sa, NULL) == -1)
-        return -1;
-    if (sigaction(SIGTERM, &sa, NULL) == -1)
+    if (g_export.fd == -1)
+        return;
+    for (int i = 0; i < EXPORT_MAX_CLIENTS; ++i)
+        if (g_export.client[i].fd != -1)
+            export_drop(&g_export.client[i]);
+    close(g_export.fd);
+    g_export.fd = -1;
+    if (g_export.unix_path)
+        unlink(g_export.unix_path);
+    free(g_export.buf[0]);
+    free(g_export.buf[1]);
+}
+
+// Renders one complete frame from the most recent sample
+// The frame is built off-screen and only the changed cells are written out.
+static int render_frame(void)
+{
+    fb_begin_frame();
+    // Draw CPU usage and frequency for all cores
+    int row = print_core_usage_bars(0);
+    if (g_top.enabled)
+        row = print_top_tasks(row + 1);
+    // Draw CPU temperature (optional)
+    if (g_show_temp)
+        row = print_cpu_temperature(row);
+    if (g_psi.available)
+        row = print_cpu_pressure(g_show_temp ? row : row + 1);
+    if (g_self.enabled)
+        row = print_self_stats(row + 1);
+    if (g_replay_path)
+        row = print_replay_status(row + 1) - 1;
+    // Draw quit message centered
+    fb_centered(row + 1, FB_COLOR_DEFAULT, "View: %s - press 'v' to switch, 'b' for %s, 's' for stats, 'q' or ESC to quit.",
+                g_view_names[g_view], g_bars_names[(g_bars + 1) % BARS_COUNT]);
+    if (fb_flush() != 0)
+    {
+        perror("Error: Could not write frame");
         return -1;
-    if (sigaction(SIGHUP, &sa, NULL) == -1)
+    }
+    return 0;
+}
+
+// Measures the read batch of a sample (/proc/stat and the frequencies) on both paths, pread()
+// and io_uring if the kernel has it, each through an engine of its own, and prints the reads,
+// system calls and time per sample
+static void bench_io(int iterations)
+{
+    printf("%-8s %12s %12s %12s %12s\n", "io", "reads", "syscalls", "us/sample", "ns/core");
+    struct coreusage_snapshot *scratch = &g_snap[g_snap_cur ^ 1];
+    for (int uring = 0; uring < 2; ++uring)
+    {
+        struct coreusage_config config = {.sysroot = g_sysroot, .io = uring ? COREUSAGE_IO_URING : COREUSAGE_IO_SYNC};
+        struct coreusage *cu = coreusage_open(&config);
+        if (!cu)
+            break;
+        struct coreusage_stats before, after;
+        unsigned long long ns = 0;
+        for (int it = -1; it < iterations; ++it)
+        {
+            // The first batch registers the files and is not counted
+            if (it == 0)
+                coreusage_get_stats(cu, &before);
+            struct coreusage_read r = {.snap = scratch, .freq_khz = g_freq_khz};
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            coreusage_read(cu, &r);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            if (it >= 0)
+                ns += timespec_ns(&t1) - timespec_ns(&t0);
+        }
+        coreusage_get_stats(cu, &after);
+        coreusage_close(cu);
+        printf("%-8s %12.0f %12.1f %12.1f %12.1f\n", uring ? "uring" : "sync", (double)(after.reads - before.reads) / iterations,
+               (double)(after.syscalls - before.syscalls) / iterations, (double)ns / iterations / 1000.0,
+               (double)ns / iterations / g_num_cpus);
+    }
+}
+
+// Measures what one frame costs per online CPU: reading and parsing /proc/stat through
+// libcoreusage, computing the deltas, reading the scheduler statistics and pressure, reading and parsing the
+// interrupt counters of the irq view (if the tree has them) and rendering, and prints the mean and best time in ns per core. Meant for the
+// synthetic trees of bench/mkfixture.sh (--sysroot). The frames are diffed as on a terminal
+// large enough for every CPU and written to /dev/null.
+static int run_bench(int iterations)
+{
+    enum { BENCH_STAT, BENCH_DELTA, BENCH_SCHED, BENCH_IRQ, BENCH_IDLE, BENCH_RENDER, BENCH_COUNT };
+    static const char *const names[BENCH_COUNT] = {"stat", "delta", "sched", "irq", "idle", "render"};
+    unsigned long long sum[BENCH_COUNT] = {0};
+    unsigned long long best[BENCH_COUNT];
+    for (int k = 0; k < BENCH_COUNT; ++k)
+        best[k] = ~0ULL;
+    int out_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (out_fd == -1 || null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1)
+    {
+        fprintf(stderr, "Error: Could not redirect the frames to /dev/null: %s\n", strerror(errno));
         return -1;
-    if (sigaction(SIGWINCH, &sa, NULL) == -1)
+    }
+    close(null_fd);
+    g_fb.fixed = 1;
+    fb_resize(g_num_cpus + FB_PIPE_ROWS, BENCH_COLS);
+    // The fixture never changes, so every parsed sample is moved forward by a varying load
+    int prev_idx = g_snap_cur;
+    const struct coreusage_snapshot *prev = &g_snap[prev_idx];
+    struct coreusage_snapshot *cur = &g_snap[prev_idx ^ 1];
+    g_snap_cur = prev_idx ^ 1;
+    int ok = 1;
+    for (int it = 0; it < iterations && ok; ++it)
+    {
+        unsigned long long ns[BENCH_COUNT];
+        struct timespec t0, t1;
+        struct coreusage_read r = {.snap = cur, .cpu_ids = g_cpu_ids};
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int err = coreusage_read(g_cu, &r);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns[BENCH_STAT] = timespec_ns(&t1) - timespec_ns(&t0);
+        if (err != 0)
+        {
+            ok = 0;
+            break;
+        }
+        g_num_cpus = r.num_online;
+        for (int i = 0; i < g_num_cpus; ++i)
+        {
+            int c = g_cpu_ids[i];
+            for (int f = 0; f < CPU_TIME_FIELDS; ++f)
+                cur->field[f][c] = prev->field[f][c] + (unsigned long long)((c * 7 + it * 13 + f * 3) % 20);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        coreusage_delta(prev, cur, g_max_cpus, g_usage, g_field_pct);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns[BENCH_DELTA] = timespec_ns(&t1) - timespec_ns(&t0);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        update_sched_stats();
+        update_cpu_pressure();
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns[BENCH_SCHED] = timespec_ns(&t1) - timespec_ns(&t0);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        update_irq_stats();
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns[BENCH_IRQ] = timespec_ns(&t1) - timespec_ns(&t0);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        update_idle_stats();
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns[BENCH_IDLE] = timespec_ns(&t1) - timespec_ns(&t0);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        ok = render_frame() == 0;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns[BENCH_RENDER] = timespec_ns(&t1) - timespec_ns(&t0);
+        for (int k = 0; k < BENCH_COUNT; ++k)
+        {
+            sum[k] += ns[k];
+            if (ns[k] < best[k])
+                best[k] = ns[k];
+        }
+    }
+    dup2(out_fd, STDOUT_FILENO);
+    close(out_fd);
+    if (!ok || g_num_cpus == 0)
+    {
+        fprintf(stderr, "Error: Could not read CPU statistics.\n");
         return -1;
+    }
+    printf("coreusage bench: %d CPUs, %d iterations\n", g_num_cpus, iterations);
+    printf("%-8s %12s %12s %12s\n", "phase", "ns/core", "best", "us/frame");
+    for (int k = 0; k < BENCH_COUNT; ++k)
+    {
+        if ((k == BENCH_SCHED && !g_sched.available && !g_psi.available) || (k == BENCH_IRQ && g_interrupts.file.fd < 0) ||
+            (k == BENCH_IDLE && !g_idle.nstates))
+            continue;
+        printf("%-8s %12.1f %12.1f %12.1f\n", names[k], (double)sum[k] / iterations / g_num_cpus,
+               (double)best[k] / g_num_cpus, (double)sum[k] / iterations / 1000.0);
+    }
+    bench_io(iterations);
     return 0;
 }
 
@@ -487,9 +5420,42 @@ int main(int argc, char **argv)
         {"bar-width", required_argument, 0, 'w'},
         {"no-color", no_argument, 0, 'c'},
         {"no-temp", no_argument, 0, 't'},
+        {"view", required_argument, 0, 'v'},
+        {"bars", required_argument, 0, 'b'},
+        {"sample-interval", required_argument, 0, 'I'},
+        {"sampler-cpu", required_argument, 0, 'P'},
+        {"peak-window", required_argument, 0, 'W'},
+        {"stats", no_argument, 0, 'S'},
+        {"history", required_argument, 0, 'H'},
+        {"sparkline", required_argument, 0, 'k'},
+        {"format", required_argument, 0, 'f'},
+        {"record", required_argument, 0, 'r'},
+        {"record-size", required_argument, 0, 's'},
+        {"replay", required_argument, 0, 'p'},
+        {"daemon", optional_argument, 0, 'D'},
+        {"attach", optional_argument, 0, 'A'},
+        {"export", required_argument, 0, 'E'},
+        {"self-stats", no_argument, 0, 'O'},
+        {"sysroot", required_argument, 0, 'R'},
+        {"top", optional_argument, 0, 'T'},
+        {"top-budget", required_argument, 0, 'U'},
+        {"bench", optional_argument, 0, 'B'},
+        {"cgroup", optional_argument, 0, 'G'},
+        {"cgroup-rescan", required_argument, 0, 'Z'},
+        {"io", required_argument, 0, 'o'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
+    long record_mib = RING_DEFAULT_MIB;
+    int history_len = HISTORY_DEFAULT;
+    int sample_interval_us = 0;
+    int peak_window_ms = PEAK_WINDOW_DEFAULT_MS;
+    const char *daemon_name = NULL;
+    const char *attach_name = NULL;
+    const char *export_addr = NULL;
+    int bench_iterations = 0;
+    int cgroup_view = 0;
+    int view_set = 0;
     int opt;
     while ((opt = getopt_long(argc, argv, "", long_opts, NULL)) != -1)
     {
@@ -515,6 +5481,170 @@ int main(int argc, char **argv)
         case 't':
             g_show_temp = 0;
             break;
+        case 'v':
+        {
+            view_set = 1;
+            int v = 0;
+            while (v < VIEW_COUNT && strcmp(optarg, g_view_names[v]) != 0)
+                v++;
+            if (v == VIEW_COUNT)
+            {
+                fprintf(stderr, "Error: Unknown view '%s' (use cpu, core, node, socket, compact, irq, cgroup or idle).\n", optarg);
+                return EXIT_FAILURE;
+            }
+            g_view = v;
+            break;
+        }
+        case 'b':
+        {
+            int b = 0;
+            while (b < BARS_COUNT && strcmp(optarg, g_bars_names[b]) != 0)
+                b++;
+            if (b == BARS_COUNT)
+            {
+                fprintf(stderr, "Error: Unknown bar mode '%s' (use stacked or fields).\n", optarg);
+                return EXIT_FAILURE;
+            }
+            g_bars = b;
+            break;
+        }
+        case 'I':
+        {
+            long ms = strtol(optarg, NULL, 10);
+            if (ms > 0 && ms <= 1000)
+                sample_interval_us = (int)ms * 1000;
+            break;
+        }
+        case 'P':
+        {
+            char *end;
+            long cpu = strtol(optarg, &end, 10);
+            if (end == optarg || *end || cpu < 0 || cpu >= CPU_SETSIZE * 64)
+            {
+                fprintf(stderr, "Error: Invalid sampler CPU '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            g_sampler.cpu = (int)cpu;
+            break;
+        }
+        case 'W':
+        {
+            long ms = strtol(optarg, NULL, 10);
+            if (ms > 0 && ms <= 10000)
+                peak_window_ms = (int)ms;
+            break;
+        }
+        case 'S':
+            g_show_stats = 1;
+            break;
+        case 'H':
+        {
+            long n = strtol(optarg, NULL, 10);
+            if (n >= 2 && n <= HISTORY_MAX)
+                history_len = (int)n;
+            break;
+        }
+        case 'k':
+        {
+            long n = strtol(optarg, NULL, 10);
+            if (n >= 0 && n <= 200)
+                g_spark_width = (int)n;
+            break;
+        }
+        case 'f':
+        {
+            int f = OUTPUT_JSONL;
+            while (f < OUTPUT_COUNT && strcmp(optarg, g_output_names[f]) != 0)
+                f++;
+            if (f == OUTPUT_COUNT)
+            {
+                fprintf(stderr, "Error: Unknown format '%s' (use jsonl, csv or bin).\n", optarg);
+                return EXIT_FAILURE;
+            }
+            g_output = f;
+            break;
+        }
+        case 'r':
+            g_record_path = optarg;
+            break;
+        case 's':
+        {
+            long mib = strtol(optarg, NULL, 10);
+            if (mib > 0 && mib <= 1048576)
+                record_mib = mib;
+            break;
+        }
+        case 'p':
+            g_replay_path = optarg;
+            break;
+        case 'D':
+            daemon_name = optarg ? optarg : COREUSAGE_SHM_NAME;
+            break;
+        case 'A':
+            attach_name = optarg ? optarg : COREUSAGE_SHM_NAME;
+            break;
+        case 'E':
+            export_addr = optarg;
+            break;
+        case 'O':
+            g_self.enabled = 1;
+            break;
+        case 'T':
+        {
+            long n = optarg ? strtol(optarg, NULL, 10) : TOP_DEFAULT;
+            g_top.n = n >= 1 && n <= 10 ? (int)n : TOP_DEFAULT;
+            g_top.enabled = 1;
+            break;
+        }
+        case 'U':
+        {
+            long n = strtol(optarg, NULL, 10);
+            if (n >= 16 && n <= 10000000)
+                g_top.budget = (int)n;
+            break;
+        }
+        case 'G':
+            if (optarg)
+                g_cgroup.dir = optarg;
+            cgroup_view = 1;
+            break;
+        case 'Z':
+        {
+            long s = strtol(optarg, NULL, 10);
+            if (s >= 1 && s <= 86400)
+                g_cgroup.rescan_ns = (unsigned long long)s * 1000000000ULL;
+            break;
+        }
+        case 'o':
+        {
+            int m = 0;
+            while (m < IO_MODE_COUNT && strcmp(optarg, g_io_mode_names[m]) != 0)
+                m++;
+            if (m == IO_MODE_COUNT)
+            {
+                fprintf(stderr, "Error: Unknown io mode '%s' (use auto, uring or sync).\n", optarg);
+                return EXIT_FAILURE;
+            }
+            g_io_mode = m;
+            break;
+        }
+        case 'R':
+            g_root_fd = open(optarg, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (g_root_fd == -1)
+            {
+                fprintf(stderr, "Error: Could not open sysroot %s: %s\n", optarg, strerror(errno));
+                return EXIT_FAILURE;
+            }
+            g_sysroot = optarg;
+            // libsensors always reads the live /sys
+            g_show_temp = 0;
+            break;
+        case 'B':
+        {
+            long n = optarg ? strtol(optarg, NULL, 10) : BENCH_DEFAULT_ITERATIONS;
+            bench_iterations = n > 0 && n <= 10000000 ? (int)n : BENCH_DEFAULT_ITERATIONS;
+            break;
+        }
         case 'h':
         default:
             printf("coreusage v.%s\n", VERSION);
@@ -523,95 +5653,379 @@ int main(int argc, char **argv)
             printf("  --bar-width <n>   Width of the bar (default %d)\n", BAR_WIDTH);
             printf("  --no-color        Disable ANSI colors\n");
             printf("  --no-temp         Hide temperature line\n");
+            printf("  --view <name>     Layout: cpu, core, node, socket, compact, irq, cgroup or idle (default cpu)\n");
+            printf("  --bars <mode>     Load column: stacked or fields (default stacked)\n");
+            printf("  --sample-interval <ms> Sample in a separate thread this often and show peaks\n");
+            printf("  --sampler-cpu <n> Pin the sampler thread to CPU n\n");
+            printf("  --peak-window <ms> Length of the windows the peak is taken over (default %d)\n", PEAK_WINDOW_DEFAULT_MS);
+            printf("  --stats           Show min/avg/max/p95 and a sparkline per CPU\n");
+            printf("  --history <n>     Samples in the statistics window (default %d)\n", HISTORY_DEFAULT);
+            printf("  --sparkline <n>   Samples in the sparkline, 0 to hide it (default %d)\n", SPARK_DEFAULT);
+            printf("  --format <fmt>    Write one record per sample instead: jsonl, csv or bin\n");
+            printf("  --record <file>   Record samples into a ring file without display\n");
+            printf("  --self-stats      Show what coreusage itself costs (also in --format records)\n");
+            printf("  --top[=n]         Show the n busiest tasks of every CPU above %d%% (default %d)\n", TOP_HOT_PERCENT, TOP_DEFAULT);
+            printf("  --top-budget <n>  Task stat reads per frame (default %d)\n", TOP_BUDGET_DEFAULT);
+            printf("  --cgroup[=dir]    Start in the cgroup view, for the subtree dir (default %s)\n", CGROUP_ROOT);
+            printf("  --cgroup-rescan <s> Full walk of the cgroup subtree every s seconds (default %d)\n", CGROUP_RESCAN_DEFAULT_S);
+            printf("  --io <mode>       Issue the reads of a sample: auto, uring or sync (default auto)\n");
+            printf("  --sysroot <dir>   Read /proc and /sys below dir (no temperatures)\n");
+            printf("  --bench[=n]       Measure read, parse, delta and render in ns per core and exit\n");
+            printf("  --record-size <n> Size of the ring file in MiB (default %d)\n", RING_DEFAULT_MIB);
+            printf("  --replay <file>   Show a recorded ring file (with --format: export it)\n");
+            printf("  --daemon[=name]   Publish samples in shared memory without display (default %s)\n", COREUSAGE_SHM_NAME);
+            printf("  --attach[=name]   Show the samples published by a daemon\n");
+            printf("  --export <addr>   Serve OpenMetrics on host:port or a unix socket path without display\n");
             return 0;
         }
     }
-    // Set up signal handlers and terminal cleanup
-    if (setup_signal_handlers() == -1)
+    if (cgroup_view && !view_set)
+        g_view = VIEW_CGROUP;
+    if (g_record_path && g_replay_path)
+    {
+        fprintf(stderr, "Error: --record and --replay cannot be combined.\n");
+        return EXIT_FAILURE;
+    }
+    if (!!daemon_name + !!attach_name + !!g_replay_path > 1)
+    {
+        fprintf(stderr, "Error: --daemon, --attach and --replay cannot be combined.\n");
+        return EXIT_FAILURE;
+    }
+    if (bench_iterations && (g_replay_path || attach_name))
+    {
+        fprintf(stderr, "Error: --bench measures sampling and cannot be combined with --replay or --attach.\n");
+        return EXIT_FAILURE;
+    }
+    if (g_top.enabled && g_replay_path)
     {
-        fprintf(stderr, "Error: Could not set signal handlers: %s\n", strerror(errno));
+        fprintf(stderr, "Error: --top reads the tasks of this host and cannot be combined with --replay.\n");
+        return EXIT_FAILURE;
+    }
+    if (export_addr && g_replay_path)
+    {
+        fprintf(stderr, "Error: --export and --replay cannot be combined.\n");
+        return EXIT_FAILURE;
+    }
+    // Route signals through a signalfd and set up terminal cleanup
+    int sig_fd = setup_signalfd();
+    if (sig_fd == -1)
+    {
+        fprintf(stderr, "Error: Could not set up signal handling: %s\n", strerror(errno));
         return EXIT_FAILURE;
     }
     atexit(restore_terminal);
-    if (isatty(STDIN_FILENO))
+    // Machine-readable output, recording, the daemon and the exporter never touch the terminal
+    int tui = g_output == OUTPUT_TUI && !g_record_path && !daemon_name && !export_addr && !bench_iterations;
+    if (tui && isatty(STDIN_FILENO))
     {
         set_nonblocking_terminal(1);
         terminal_modified = 1;
     }
+    // A replay takes everything from the ring file; only the topology comes from this host
+    if (g_replay_path)
+    {
+        if (ring_open_replay(g_replay_path) != 0)
+            return EXIT_FAILURE;
+        for (int cpu_id = 0; cpu_id < g_max_cpus; ++cpu_id)
+            read_cpu_topology(cpu_id);
+        uint64_t first, last;
+        if (ring_window(&first, &last) == 0)
+            replay_seek(tui ? (int64_t)first + 1 : (int64_t)last);
+    }
+    // A viewer attached to a daemon reads nothing else either
+    else if (attach_name)
+    {
+        if (shm_attach(attach_name) != 0)
+            return EXIT_FAILURE;
+        for (int cpu_id = 0; cpu_id < g_max_cpus; ++cpu_id)
+            read_cpu_topology(cpu_id);
+    }
     // Initialize libsensors once
-    if (sensors_init(NULL) != 0)
+    else if (sensors_init(NULL) != 0)
     {
         fprintf(stderr, "Error: Could not initialize libsensors: %s\n", sensors_strerror(errno));
         return EXIT_FAILURE;
     }
-    int quit = 0;
-    while (!quit)
+    // Open the sampling engine, which opens and sizes everything it reads
+    else if (!(g_cu = coreusage_open(&(struct coreusage_config){.sysroot = g_sysroot, .io = g_io_mode})))
     {
-        if (g_should_terminate)
-        {
-            quit = 1;
-            break;
-        }
-        // If terminal size changed, just clear and continue
-        if (g_winch)
+        if (errno == ENOSYS)
+            fprintf(stderr, "Error: io_uring with IORING_OP_READ is not available (Linux 5.6 or later, not blocked by seccomp or kernel.io_uring_disabled).\n");
+        else
+            fprintf(stderr, "Error: Could not read CPU statistics: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    // Size the per-CPU storage, then take the baseline sample; every frame afterwards needs only one more read
+    else if (alloc_cpu_arrays(coreusage_max_cpus(g_cu)) != 0)
+    {
+        fprintf(stderr, "Error: Could not allocate per-CPU storage.\n");
+        return EXIT_FAILURE;
+    }
+    else if (read_sample(1, NULL) != 0)
+    {
+        fprintf(stderr, "Error: Could not read CPU statistics.\n");
+        return EXIT_FAILURE;
+    }
+    if (tui || bench_iterations)
+    {
+        g_fb.fixed = isatty(STDOUT_FILENO);
+        update_terminal_size();
+        // The statistics window is only kept for the display
+        if (alloc_history(history_len) != 0)
         {
-            g_winch = 0;
+            fprintf(stderr, "Error: Could not allocate the statistics window.\n");
+            return EXIT_FAILURE;
         }
-        // Clear screen using ANSI escape codes
-        printf("\033[H\033[J");
-        // Print CPU usage and frequency for all cores
-        print_core_usage_bars();
-        // Print CPU temperature (optional)
+        if (g_replay_path)
+            push_history();
+    }
+    else if (g_output != OUTPUT_TUI && init_record_output() != 0)
+    {
+        fprintf(stderr, "Error: Could not set up %s output: %s\n", g_output_names[g_output], strerror(errno));
+        return EXIT_FAILURE;
+    }
+    int sampling = !g_replay_path && !attach_name;
+    if (sampling)
+    {
+        g_freq_source = coreusage_freq_source(g_cu);
+        for (int i = 0; i < g_num_cpus; ++i)
+            read_cpu_topology(g_cpu_ids[i]);
         if (g_show_temp)
-            print_cpu_temperature();
-        // Print quit message centered
-        if (print_centered("\nPress 'q' or ESC to quit.\n") == -1)
-        {
-            fprintf(stderr, "Error: Could not print centered quit message.\n");
+            update_cpu_temps();
+        update_sched_stats();
+        update_cpu_pressure();
+        if (g_view == VIEW_IRQ)
+            update_irq_stats();
+        if (g_view == VIEW_CGROUP)
+            update_cgroup_stats();
+        if (g_view == VIEW_IDLE)
+            update_idle_stats();
+    }
+    // The task attribution is only shown in the display
+    g_top.enabled = g_top.enabled && tui;
+    if (g_top.enabled)
+    {
+        if (top_init() != 0)
             return EXIT_FAILURE;
-        }
-        // Flush output before entering input polling (important for non-tty stdout)
-        if (fflush(stdout) == EOF)
+        top_scan();
+    }
+    if (bench_iterations)
+        return run_bench(bench_iterations) == 0 ? 0 : EXIT_FAILURE;
+    if (g_record_path && ring_open_record(g_record_path, record_mib) != 0)
+        return EXIT_FAILURE;
+    if (daemon_name && shm_open_daemon(daemon_name) != 0)
+        return EXIT_FAILURE;
+    if (export_addr && export_listen(export_addr) != 0)
+        return EXIT_FAILURE;
+    // Counters are valid from the baseline on; a viewer has nothing before the first sample
+    if (export_addr && sampling)
+        export_render();
+    if (sample_interval_us && sampling && start_sampler(sample_interval_us, peak_window_ms) != 0)
+    {
+        fprintf(stderr, "Error: Could not start the sampler thread: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    int timer_fd = setup_sample_timer(g_interval_us);
+    if (timer_fd == -1 || (g_replay_path && replay_set_speed(timer_fd) == -1))
+    {
+        fprintf(stderr, "Error: Could not create sample timer: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    // Event loop: sleep until the timer fires, a signal arrives, a key is pressed or a scrape comes in
+    // Unused entries have fd -1, which poll() skips.
+    enum { PFD_TIMER, PFD_SIGNAL, PFD_STDIN, PFD_EXPORT, PFD_CLIENTS, PFD_COUNT = PFD_CLIENTS + EXPORT_MAX_CLIENTS };
+    struct pollfd pfds[PFD_COUNT] = {
+        [PFD_TIMER] = {.fd = timer_fd, .events = POLLIN},
+        [PFD_SIGNAL] = {.fd = sig_fd, .events = POLLIN},
+        [PFD_STDIN] = {.fd = tui && isatty(STDIN_FILENO) ? STDIN_FILENO : -1, .events = POLLIN},
+        [PFD_EXPORT] = {.fd = -1},
+    };
+    nfds_t nfds = export_addr ? PFD_COUNT : PFD_EXPORT;
+    int have_frame = 0;
+    int quit = 0;
+    // Exporting a ring file writes all of it at once
+    if (g_replay_path && !tui)
+    {
+        replay_export();
+        quit = 1;
+    }
+    else if (g_replay_path)
+    {
+        // The first frame shows the start of the recording right away
+        have_frame = 1;
+        if (render_frame() != 0)
+            return EXIT_FAILURE;
+    }
+    while (!quit)
+    {
+        if (export_addr)
+            export_poll_setup(&pfds[PFD_EXPORT], &pfds[PFD_CLIENTS]);
+        if (poll(pfds, nfds, -1) == -1)
         {
-            perror("Error: fflush failed");
+            if (errno == EINTR)
+                continue;
+            perror("Error: poll failed");
+            break;
         }
-        // Poll for user input every 50ms, up to 1 second
-        for (int i = 0; i < 10; ++i)
+        int redraw = 0;
+        if (pfds[PFD_SIGNAL].revents & POLLIN)
         {
-            if (g_should_terminate)
+            struct signalfd_siginfo si;
+            while (read(sig_fd, &si, sizeof(si)) == (ssize_t)sizeof(si))
             {
-                quit = 1;
-                break;
+                if (si.ssi_signo == SIGWINCH)
+                {
+                    if (tui)
+                    {
+                        update_terminal_size();
+                        redraw = have_frame;
+                    }
+                }
+                else
+                    quit = 1;
             }
-            if (isatty(STDIN_FILENO))
+        }
+        if (pfds[PFD_STDIN].revents & (POLLIN | POLLHUP))
+        {
+            char keys[64];
+            ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+            if (n == 0)
+                quit = 1;
+            for (ssize_t i = 0; i < n; ++i)
             {
-                int c = getchar();
-                if (c == 'q' || c == KEY_ESC)
+                char key = keys[i];
+                // Arrow keys arrive as ESC [ C / ESC [ D; a lone ESC still quits
+                if (key == KEY_ESC && i + 2 < n && keys[i + 1] == '[')
                 {
+                    key = keys[i + 2] == 'C' ? KEY_RIGHT : keys[i + 2] == 'D' ? KEY_LEFT : 0;
+                    i += 2;
+                }
+                if (key == 'q' || key == KEY_ESC)
                     quit = 1;
-                    break;
+                else if (key == 'v')
+                {
+                    g_view = (g_view + 1) % VIEW_COUNT;
+                    redraw = have_frame;
+                }
+                else if (key == 'b')
+                {
+                    g_bars = (g_bars + 1) % BARS_COUNT;
+                    redraw = have_frame;
+                }
+                else if (key == 's')
+                {
+                    g_show_stats = !g_show_stats;
+                    redraw = have_frame;
                 }
+                else if (g_replay_path && replay_key(key, timer_fd))
+                    redraw = have_frame;
             }
-            struct timespec ts_poll = {0, TIME_BETWEEN_KEY_POLL_US * 1000};
-            if (nanosleep(&ts_poll, NULL) != 0)
+        }
+        if (pfds[PFD_TIMER].revents & POLLIN)
+        {
+            // The expiration count tells how many periods passed; only the latest one is drawn
+            uint64_t expirations;
+            int sampled;
+            if (read(timer_fd, &expirations, sizeof(expirations)) == (ssize_t)sizeof(expirations))
             {
-                if (errno != EINTR)
-                    fprintf(stderr, "Error: nanosleep failed: %s\n", strerror(errno));
+                if (g_replay_path)
+                {
+                    // Skipped samples still pass through the statistics window
+                    for (int k = 0; k < g_replay.step && !g_replay.paused; ++k)
+                    {
+                        uint64_t pos = g_replay.pos;
+                        if (replay_seek((int64_t)pos + 1) != 0 || g_replay.pos == pos)
+                            break;
+                        push_history();
+                    }
+                }
+                else if ((sampled = attach_name ? shm_read_sample() : take_sample()) < 0 && attach_name)
+                {
+                    fprintf(stderr, "Error: The coreusage daemon publishing %s has stopped.\n", attach_name);
+                    quit = 1;
+                }
+                else if (sampled < 0)
+                    fprintf(stderr, "Error: Could not read CPU statistics.\n");
+                else if (sampled == 0)
+                {
+                    if (g_self.enabled)
+                        update_self_stats();
+                    push_history();
+                    unsigned long long start = phase_begin();
+                    if (g_top.enabled)
+                    {
+                        top_scan();
+                        phase_end(PHASE_TOP, start);
+                        start = phase_begin();
+                    }
+                    if (g_shm.daemon)
+                        shm_publish();
+                    if (g_record_path)
+                        ring_append();
+                    if (export_addr)
+                        export_render();
+                    if (g_output != OUTPUT_TUI && write_record() != 0)
+                    {
+                        // The consumer went away
+                        quit = 1;
+                    }
+                    if (!tui)
+                        phase_end(PHASE_OUTPUT, start);
+                }
+                have_frame = 1;
+                redraw = tui;
             }
         }
+        // Scrapes are served after the sample, so they never delay it
+        if (export_addr)
+            export_serve(&pfds[PFD_EXPORT], &pfds[PFD_CLIENTS]);
+        if (quit)
+            break;
+        // Redraw on every sample and immediately after a terminal resize
+        if (redraw)
+        {
+            unsigned long long start = phase_begin();
+            if (render_frame() != 0)
+                return EXIT_FAILURE;
+            phase_end(PHASE_RENDER, start);
+        }
     }
+    close(timer_fd);
+    close(sig_fd);
+    // The exit message is centered in the width of the last frame
+    char banner[128];
+    snprintf(banner, sizeof(banner), "coreusage v." VERSION " - libsensors v.%s - Exiting...",
+             libsensors_version != NULL ? libsensors_version : "unknown");
+    int banner_pad = fb_center_pad(utf8_width(banner));
+    if (tui)
+        fb_finish();
+    free_history();
+    free(g_record_buf);
     // Restore terminal settings
     if (terminal_modified && isatty(STDIN_FILENO))
     {
         set_nonblocking_terminal(0);
         terminal_modified = 0;
     }
-    // Print exit message centered
-    if (print_centered("coreusage v." VERSION " - libsensors v.%s - Exiting...\n", libsensors_version != NULL ? libsensors_version : "unknown") == -1)
-    {
-        fprintf(stderr, "Error: Could not print centered exit message.\n");
-        return EXIT_FAILURE;
-    }
-    sensors_cleanup();
+    if (tui)
+        printf("%*s%s\n", banner_pad, "", banner);
+    if (sampling)
+        sensors_cleanup();
+    ring_close();
+    shm_close();
+    export_close();
+    top_close();
+    irq_table_free(&g_interrupts);
+    irq_table_free(&g_softirqs);
+    cgroup_close();
+    idle_close();
+    stop_sampler();
+    proc_file_close(&g_schedstat_file);
+    proc_file_close(&g_psi_file);
+    proc_file_close(&g_self_io_file);
+    proc_file_close(&g_self_stat_file);
+    close_temp_inputs();
+    coreusage_close(g_cu);
+    free_cpu_arrays();
     return 0;
 }
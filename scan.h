@@ -0,0 +1,28 @@
+/*
+ * scan.h - Number parser shared by coreusage and libcoreusage; not installed
+ */
+
+#ifndef COREUSAGE_SCAN_H
+#define COREUSAGE_SCAN_H
+
+// Parses an unsigned decimal number starting at *p, skipping leading blanks
+// Advances *p past the digits. Returns 1 on success, 0 if no number was found before end.
+static inline int scan_ull(const char **p, const char *end, unsigned long long *out)
+{
+    const char *s = *p;
+    while (s < end && (*s == ' ' || *s == '\t'))
+        s++;
+    if (s >= end || (unsigned char)(*s - '0') > 9)
+    {
+        *p = s;
+        return 0;
+    }
+    unsigned long long v = 0;
+    while (s < end && (unsigned char)(*s - '0') <= 9)
+        v = v * 10 + (unsigned long long)(*s++ - '0');
+    *p = s;
+    *out = v;
+    return 1;
+}
+
+#endif